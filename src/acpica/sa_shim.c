@@ -6,13 +6,28 @@
 #include <memory/virt.h>
 #include <memory/pool.h>
 #include <core/sched.h>
+#include <core/clock.h>
+#include <core/workqueue.h>
 
 #include <lock/mutex.h>
 #include <lock/semaphore.h>
 #include <lock/spinlock.h>
 
+typedef struct
+{
+    work w;
+
+    ACPI_OSD_EXEC_CALLBACK function;
+    void* context;
+} acpi_deferred_call;
+
+// Deferred calls get their own workqueue so that AcpiOsWaitEventsComplete doesn't have to wait for
+// unrelated work
+static workqueue acpi_workqueue;
+
 ACPI_STATUS AcpiOsInitialize(void)
 {
+    workqueue_init(&acpi_workqueue, "acpi");
     return AE_OK;
 }
 
@@ -123,9 +138,31 @@ ACPI_THREAD_ID AcpiOsGetThreadId(void)
     return (ACPI_THREAD_ID)(uint32)sched_thread_current();
 }
 
+static void acpi_deferred_call_run(void* arg)
+{
+    acpi_deferred_call* call = arg;
+
+    call->function(call->context);
+
+    // The worker doesn't touch the work item once this returns, so the call can free itself
+    AcpiOsFree(call);
+}
+
 ACPI_STATUS AcpiOsExecute(ACPI_EXECUTE_TYPE Type, ACPI_OSD_EXEC_CALLBACK Function, void* Context)
 {
-    crash("Not implemented: AcpiOsExecute");
+    acpi_deferred_call* call;
+
+    // This may be called from the SCI handler, so the call can't be run here
+    if ((call = AcpiOsAllocate(sizeof(acpi_deferred_call))) == NULL)
+        return AE_NO_MEMORY;
+
+    call->function = Function;
+    call->context = Context;
+
+    work_init(&call->w, acpi_deferred_call_run, call);
+    work_queue(&acpi_workqueue, &call->w);
+
+    return AE_OK;
 }
 
 void AcpiOsSleep(UINT64 Milliseconds)
@@ -135,14 +172,12 @@ void AcpiOsSleep(UINT64 Milliseconds)
 
 void AcpiOsStall(UINT32 Microseconds)
 {
-    // TODO: Stall more accurately
-    for (; Microseconds != 0; Microseconds--)
-        asm volatile ("PAUSE"); // Prevents the busy loop from being optimized away
+    clock_delay_us(Microseconds);
 }
 
 void AcpiOsWaitEventsComplete(void)
 {
-    crash("Not implemented: AcpiOsWaitEventsComplete");
+    workqueue_flush(&acpi_workqueue);
 }
 
 ACPI_STATUS AcpiOsCreateMutex(ACPI_MUTEX* OutHandle)
@@ -160,18 +195,15 @@ void AcpiOsDeleteMutex(ACPI_MUTEX Handle)
     AcpiOsFree(Handle);
 }
 
+// ACPICA gives timeouts in milliseconds, with ACPI_WAIT_FOREVER meaning no timeout at all
+static uint64 acpi_timeout_ns(UINT16 Timeout)
+{
+    return (Timeout == ACPI_WAIT_FOREVER) ? SCHED_NO_TIMEOUT : Timeout * 1000000ull;
+}
+
 ACPI_STATUS AcpiOsAcquireMutex(ACPI_MUTEX Handle, UINT16 Time)
 {
-    if (Time == 0xffffu)
-    {
-        mutex_acquire(Handle);
-        return AE_OK;
-    }
-    else
-    {
-        // TODO: Implement timeouts
-        return mutex_try_acquire(Handle) ? AE_OK : AE_TIME;
-    }
+    return mutex_acquire_timeout(Handle, acpi_timeout_ns(Time)) ? AE_OK : AE_TIME;
 }
 
 void AcpiOsReleaseMutex(ACPI_MUTEX Handle)
@@ -197,25 +229,26 @@ ACPI_STATUS AcpiOsDeleteSemaphore(ACPI_SEMAPHORE Handle)
 
 ACPI_STATUS AcpiOsWaitSemaphore(ACPI_SEMAPHORE Handle, UINT32 Units, UINT16 Timeout)
 {
-    if (Timeout == 0xffffu)
-    {
-        for (UINT32 i = 0; i < Units; i++)
-            semaphore_wait(Handle);
-    }
-    else
+    uint64 timeout_ns = acpi_timeout_ns(Timeout);
+    uint64 deadline = (timeout_ns == SCHED_NO_TIMEOUT) ? 0 : clock_now_ns() + timeout_ns;
+
+    // The timeout covers getting all of the units, so each wait only gets whatever is left of it
+    for (UINT32 i = 0; i < Units; i++)
     {
-        // TODO: Implement timeouts
-        for (UINT32 i = 0; i < Units; i++)
+        if (deadline != 0)
         {
-            if (!semaphore_try_wait(Handle))
-            {
-                for (UINT32 j = 0; j < i; j++)
-                {
-                    semaphore_signal(Handle);
-                }
+            uint64 now = clock_now_ns();
+            timeout_ns = (now < deadline) ? deadline - now : 0;
+        }
 
-                return AE_TIME;
+        if (!semaphore_wait_timeout(Handle, timeout_ns))
+        {
+            for (UINT32 j = 0; j < i; j++)
+            {
+                semaphore_signal(Handle);
             }
+
+            return AE_TIME;
         }
     }
 
@@ -411,7 +444,8 @@ void AcpiOsRedirectOutput(void* Destination)
 
 UINT64 AcpiOsGetTimer(void)
 {
-    crash("Not implemented: AcpiOsGetTimer");
+    // ACPICA expects the time in units of 100 nanoseconds
+    return clock_now_ns() / 100;
 }
 
 ACPI_STATUS AcpiOsSignal(UINT32 Function, void* Info)
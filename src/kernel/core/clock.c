@@ -0,0 +1,146 @@
+#include <core/clock.h>
+#include <core/sched.h>
+#include <core/time_page.h>
+#include <cpu/tsc.h>
+#include <lock/spinlock.h>
+
+#include <core/klog.h>
+
+static uint64 tick_clock_read(void);
+
+// The scheduler tick is always there, but it only has a resolution of one tick and doesn't advance
+// while interrupts are disabled, so it is only used if nothing better is available.
+static clocksource tick_clocksource = {
+    .name = "tick",
+    .rating = CLOCK_RATING_TICK,
+    .read = tick_clock_read,
+    .frequency = TICKS_PER_SECOND
+};
+
+static spinlock clock_lock;
+
+// The clocksource in use, along with its count and the time in nanoseconds when it was switched to.
+// Readers retry if clock_seq was odd or changed while they were reading, since that means that the
+// clocksource was being switched.
+static const clocksource* clock_source;
+static uint64 clock_base_counts;
+static uint64 clock_base_ns;
+static uint32 clock_seq;
+
+static uint64 tick_clock_read(void)
+{
+    return ticks;
+}
+
+// Finds the largest shift for which counts can be converted to nanoseconds with a 32-bit multiplier
+static void compute_mult_shift(clocksource* cs)
+{
+    uint32 shift;
+    uint64 mult = 0;
+
+    for (shift = 32; shift > 0; shift--)
+    {
+        mult = (NANOSECONDS_PER_SECOND << shift) / cs->frequency;
+
+        if (mult <= 0xFFFFFFFFu)
+            break;
+    }
+
+    cs->mult = (uint32)mult;
+    cs->shift = shift;
+}
+
+// Multiplies each half of the count separately, since the full product may not fit in 64 bits
+static inline uint64 counts_to_ns(const clocksource* cs, uint64 counts)
+{
+    uint32 hi = (uint32)(counts >> 32);
+    uint32 lo = (uint32)counts;
+
+    return (((uint64)hi * cs->mult) << (32 - cs->shift)) + (((uint64)lo * cs->mult) >> cs->shift);
+}
+
+static uint64 clock_read(const clocksource* cs, uint64 base_counts, uint64 base_ns)
+{
+    uint64 counts = cs->read();
+
+    // The count may have been taken on another processor whose counter is slightly ahead
+    if (counts < base_counts)
+        return base_ns;
+
+    return base_ns + counts_to_ns(cs, counts - base_counts);
+}
+
+void clock_init(void)
+{
+    spinlock_init(&clock_lock);
+
+    clock_register(&tick_clocksource);
+    tsc_init();
+}
+
+void clock_register(clocksource* cs)
+{
+    compute_mult_shift(cs);
+
+    spinlock_acquire(&clock_lock);
+
+    if (clock_source != NULL && cs->rating <= clock_source->rating)
+    {
+        spinlock_release(&clock_lock);
+        return;
+    }
+
+    // Nothing can read the clock while the sequence number is odd, so the new clocksource picks up
+    // exactly where the old one left off
+    __atomic_store_n(&clock_seq, clock_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    clock_base_ns = (clock_source != NULL) ? clock_read(clock_source, clock_base_counts, clock_base_ns) : 0;
+    clock_base_counts = cs->read();
+    clock_source = cs;
+
+    __atomic_store_n(&clock_seq, clock_seq + 1, __ATOMIC_RELEASE);
+
+    time_page_set_clock(cs, clock_base_counts, clock_base_ns);
+
+    spinlock_release(&clock_lock);
+
+    klog(KLOG_LEVEL_INFO, "Using clocksource %s (%ld Hz)\n", cs->name, cs->frequency);
+}
+
+const clocksource* clock_current_source(void)
+{
+    return clock_source;
+}
+
+uint64 clock_now_ns(void)
+{
+    const clocksource* cs;
+    uint64 base_counts;
+    uint64 base_ns;
+    uint32 seq;
+
+    do
+    {
+        seq = __atomic_load_n(&clock_seq, __ATOMIC_ACQUIRE);
+
+        cs = clock_source;
+        base_counts = clock_base_counts;
+        base_ns = clock_base_ns;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) != 0 || seq != __atomic_load_n(&clock_seq, __ATOMIC_RELAXED));
+
+    if (cs == NULL)
+        return 0;
+
+    return clock_read(cs, base_counts, base_ns);
+}
+
+void clock_delay_us(uint32 microseconds)
+{
+    uint64 end = clock_now_ns() + (uint64)microseconds * 1000;
+
+    while (clock_now_ns() < end)
+        asm volatile ("pause");
+}
@@ -9,6 +9,7 @@
 #include <core/klog.h>
 #include <io/serial.h>
 #include <core/gdb_stub.h>
+#include <core/smp.h>
 
 static bool lookup_name(unsigned int address, char* out, uint32 flags)
 {
@@ -51,6 +52,7 @@ void do_crash(const char* msg, const char* file, const char* func, uint32 line)
 {
     asm volatile ("cli");
 
+    smp_halt_others();
     serial_stop_interrupts();
     klog_flush();
     tty_switch_vc(&tty_virtual_consoles[0]);
@@ -79,6 +81,7 @@ void do_crash_interrupt(const char* msg, const char* file, const char* func, uin
 {
     asm volatile ("cli");
 
+    smp_halt_others();
     serial_stop_interrupts();
     klog_flush();
     tty_switch_vc(&tty_virtual_consoles[0]);
@@ -110,6 +113,7 @@ void do_crash_pagefault(regs32_t* r, uint32 fault_address)
 
     asm volatile ("cli");
 
+    smp_halt_others();
     serial_stop_interrupts();
     klog_flush();
     tty_switch_vc(&tty_virtual_consoles[0]);
@@ -180,6 +184,7 @@ void do_crash_unhandled_isr(regs32_t* r)
 {
     asm volatile ("cli");
 
+    smp_halt_others();
     serial_stop_interrupts();
     klog_flush();
     tty_switch_vc(&tty_virtual_consoles[0]);
@@ -0,0 +1,177 @@
+#include <core/hrtimer.h>
+#include <core/clock.h>
+#include <io/hpet.h>
+#include <lock/spinlock.h>
+
+#include <core/klog.h>
+
+static spinlock hrtimer_lock;
+static rbtree hrtimer_tree;
+static hpet_event* hrtimer_event;
+
+// The timer whose function is being run right now, if any
+static hrtimer* volatile hrtimer_running;
+
+static bool hrtimer_less(const rbtree_node* a, const rbtree_node* b)
+{
+    return rbtree_entry(a, hrtimer, node)->expires_ns < rbtree_entry(b, hrtimer, node)->expires_ns;
+}
+
+// Must be called with hrtimer_lock held whenever the earliest timer may have changed
+static void reprogram(uint64 now)
+{
+    rbtree_node* first = rbtree_first(&hrtimer_tree);
+    hrtimer* t;
+
+    if (first == NULL)
+    {
+        hpet_event_cancel(hrtimer_event);
+        return;
+    }
+
+    t = rbtree_entry(first, hrtimer, node);
+    hpet_event_arm(hrtimer_event, (t->expires_ns > now) ? t->expires_ns - now : 0);
+}
+
+static void remove_timer(hrtimer* t)
+{
+    rbtree_remove(&hrtimer_tree, &t->node);
+    t->pending = false;
+}
+
+// The HPET and the kernel clock may not agree exactly on how much time has passed, so the event may
+// fire slightly before the earliest timer is due. In that case it is simply armed again.
+static void hrtimer_event_fired(void* arg)
+{
+    rbtree_node* first;
+    uint64 now;
+
+    spinlock_acquire(&hrtimer_lock);
+
+    now = clock_now_ns();
+
+    // The lock is dropped while running each function, since it may arm or cancel timers
+    while ((first = rbtree_first(&hrtimer_tree)) != NULL && rbtree_entry(first, hrtimer, node)->expires_ns <= now)
+    {
+        hrtimer* t = rbtree_entry(first, hrtimer, node);
+
+        remove_timer(t);
+        hrtimer_running = t;
+
+        spinlock_release(&hrtimer_lock);
+        t->function(t->arg);
+        spinlock_acquire(&hrtimer_lock);
+
+        hrtimer_running = NULL;
+
+        now = clock_now_ns();
+    }
+
+    reprogram(now);
+
+    spinlock_release(&hrtimer_lock);
+}
+
+void hrtimer_init_queue(void)
+{
+    spinlock_init(&hrtimer_lock);
+    rbtree_init(&hrtimer_tree);
+
+    if ((hrtimer_event = hpet_event_alloc(hrtimer_event_fired, NULL)) == NULL)
+        klog(KLOG_LEVEL_INFO, "No HPET event available, high-resolution timers are disabled\n");
+}
+
+bool hrtimer_available(void)
+{
+    return hrtimer_event != NULL;
+}
+
+void hrtimer_init(hrtimer* t, timer_function function, void* arg)
+{
+    t->expires_ns = 0;
+    t->function = function;
+    t->arg = arg;
+    t->pending = false;
+}
+
+bool hrtimer_arm(hrtimer* t, uint64 delay_ns)
+{
+    uint64 now;
+
+    if (hrtimer_event == NULL)
+        return false;
+
+    spinlock_acquire(&hrtimer_lock);
+
+    now = clock_now_ns();
+
+    if (t->pending)
+        remove_timer(t);
+
+    t->expires_ns = now + delay_ns;
+    t->pending = true;
+    rbtree_insert(&hrtimer_tree, &t->node, hrtimer_less);
+
+    if (rbtree_first(&hrtimer_tree) == &t->node)
+        reprogram(now);
+
+    spinlock_release(&hrtimer_lock);
+
+    return true;
+}
+
+bool hrtimer_cancel(hrtimer* t)
+{
+    bool was_pending;
+
+    if (hrtimer_event == NULL)
+        return false;
+
+    spinlock_acquire(&hrtimer_lock);
+
+    if ((was_pending = t->pending))
+        remove_timer(t);
+
+    spinlock_release(&hrtimer_lock);
+
+    return was_pending;
+}
+
+bool hrtimer_cancel_sync(hrtimer* t)
+{
+    bool was_pending;
+
+    if (hrtimer_event == NULL)
+        return false;
+
+    spinlock_acquire(&hrtimer_lock);
+
+    if ((was_pending = t->pending))
+        remove_timer(t);
+
+    // The function may arm the timer again, so it has to be cancelled again once it has finished
+    while (hrtimer_running == t)
+    {
+        spinlock_release(&hrtimer_lock);
+
+        while (hrtimer_running == t)
+            asm volatile ("pause");
+
+        spinlock_acquire(&hrtimer_lock);
+
+        if (t->pending)
+        {
+            remove_timer(t);
+            was_pending = true;
+        }
+    }
+
+    spinlock_release(&hrtimer_lock);
+
+    return was_pending;
+}
+
+bool hrtimer_is_pending(const hrtimer* t)
+{
+    return t->pending;
+}
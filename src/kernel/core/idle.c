@@ -0,0 +1,387 @@
+#include <core/idle.h>
+#include <core/clock.h>
+#include <core/percpu.h>
+#include <cpu/cpuid.h>
+#include <acpica/acpi.h>
+#include <string.h>
+#include <printf.h>
+
+#include <core/klog.h>
+
+// Idle periods are predicted with an exponentially weighted moving average, where every new idle
+// period has a weight of 1 / 2^IDLE_PREDICTION_SHIFT
+#define IDLE_PREDICTION_SHIFT 3
+#define IDLE_PREDICTION_INITIAL_NS 1000000ull
+#define IDLE_PREDICTION_MAX_NS NANOSECONDS_PER_SECOND
+
+// C-state types that ACPI uses in _CST. The local APIC timer may stop in C3 and deeper unless the
+// processor says that it keeps running.
+#define ACPI_CSTATE_C1 1
+#define ACPI_CSTATE_C3 3
+
+// Fixed function hardware registers in _CST are vendor-specific, and Intel uses them for MWAIT
+#define ACPI_FFH_VENDOR_INTEL 1
+#define ACPI_FFH_CLASS_MWAIT 2
+
+// Capabilities passed to the processor's _PDC method, which firmware uses to decide which C-states
+// to list in _CST
+#define ACPI_PDC_REVISION 1
+#define ACPI_PDC_C_C1_HALT 0x0002
+#define ACPI_PDC_SMP_C1PT 0x0008
+#define ACPI_PDC_SMP_C2C3 0x0010
+#define ACPI_PDC_C_C1_FFH 0x0100
+#define ACPI_PDC_C_C2C3_FFH 0x0200
+
+#define MWAIT_HINT_CSTATE(hint) ((((hint) >> 4) & 0xf) + 1)
+#define MWAIT_HINT_SUBSTATE(hint) ((hint) & 0xf)
+
+// The generic register descriptor that describes how to enter each state in _CST
+typedef struct
+{
+    uint8 descriptor;
+    uint16 length;
+    uint8 space_id;
+    uint8 bit_width;
+    uint8 bit_offset;
+    uint8 access_size;
+    uint64 address;
+} __attribute__((packed)) acpi_cst_register;
+
+typedef struct idle_cpu
+{
+    // Written by other processors to wake this one up while polling is set. This is the address that
+    // MWAIT monitors, so it is kept on a cache line of its own along with what only this processor
+    // writes while it is awake.
+    volatile uint32 wake;
+    volatile bool polling;
+
+    uint32 state;
+    uint64 entered_ns;
+    uint64 predicted_ns;
+} __attribute__((aligned(PERCPU_ALIGN))) idle_cpu;
+
+static idle_cpu idle_cpu_state __percpu = {
+    .predicted_ns = IDLE_PREDICTION_INITIAL_NS
+};
+
+static idle_state states[IDLE_MAX_STATES];
+static uint32 num_states;
+
+static volatile bool poll_mode;
+static bool mwait_available;
+
+static bool mwait_supports_hint(uint32 hint)
+{
+    uint32 num_substates = (cpuid_mwait_substates >> (MWAIT_HINT_CSTATE(hint) * 4)) & 0xf;
+
+    return mwait_available && MWAIT_HINT_SUBSTATE(hint) < num_substates;
+}
+
+static void set_state(idle_state* s, const char* name, idle_state_type type, uint32 hint, uint32 latency_us)
+{
+    strncpy(s->name, name, sizeof(s->name) - 1);
+    s->name[sizeof(s->name) - 1] = '\0';
+
+    s->type = type;
+    s->mwait_hint = hint;
+
+    // ACPI only gives the exit latency, and a state is assumed to pay off once the processor stays in
+    // it for twice as long as it takes to get out of it again
+    s->exit_latency_us = latency_us;
+    s->target_residency_us = (latency_us != 0) ? latency_us * 2 : 1;
+}
+
+void idle_init(const boot_param* param)
+{
+    mwait_available = cpuid_supports_feature_ecx(CPUID_FEATURE_ECX_MONITOR) && cpuid_mwait_substates != 0;
+    poll_mode = strcmp(cmdline_get_str(param, "idle", "auto"), "poll") == 0;
+
+    set_state(&states[0], "POLL", IDLE_TYPE_POLL, 0, 0);
+    states[0].target_residency_us = 0;
+
+    if (mwait_supports_hint(0))
+        set_state(&states[1], "C1", IDLE_TYPE_MWAIT, 0, 1);
+    else
+        set_state(&states[1], "C1", IDLE_TYPE_HLT, 0, 1);
+
+    num_states = 2;
+
+    klog(KLOG_LEVEL_DEBUG, "Idle: using %s for C1%s\n", (states[1].type == IDLE_TYPE_MWAIT) ? "MWAIT" : "HLT", poll_mode ? ", poll mode enabled" : "");
+}
+
+// Reads one entry of _CST into the given state. Only C1 and states that are entered through MWAIT are
+// supported, since states that are entered by reading an I/O port need the chipset to be told about
+// bus master activity.
+static bool parse_cst_entry(const ACPI_OBJECT* entry, idle_state* s)
+{
+    const acpi_cst_register* reg;
+    uint32 type;
+    uint32 latency;
+    char name[8];
+
+    if (entry->Type != ACPI_TYPE_PACKAGE || entry->Package.Count != 4)
+        return false;
+
+    if (entry->Package.Elements[0].Type != ACPI_TYPE_BUFFER || entry->Package.Elements[0].Buffer.Length < sizeof(acpi_cst_register)
+        || entry->Package.Elements[1].Type != ACPI_TYPE_INTEGER || entry->Package.Elements[2].Type != ACPI_TYPE_INTEGER)
+        return false;
+
+    reg = (const acpi_cst_register*)entry->Package.Elements[0].Buffer.Pointer;
+    type = (uint32)entry->Package.Elements[1].Integer.Value;
+    latency = (uint32)entry->Package.Elements[2].Integer.Value;
+
+    if (type >= ACPI_CSTATE_C3 && !cpuid_supports_feature_pm_eax(CPUID_FEATURE_PM_EAX_ARAT))
+        return false;
+
+    snprintf(name, sizeof(name), "C%d", type);
+
+    if (reg->space_id == ACPI_ADR_SPACE_FIXED_HARDWARE && reg->bit_width == ACPI_FFH_VENDOR_INTEL && reg->bit_offset == ACPI_FFH_CLASS_MWAIT)
+    {
+        if (!mwait_supports_hint((uint32)reg->address))
+            return false;
+
+        set_state(s, name, IDLE_TYPE_MWAIT, (uint32)reg->address, latency);
+        return true;
+    }
+
+    if (type == ACPI_CSTATE_C1)
+    {
+        // C1 always means HLT, but MWAIT also lets the processor be woken up without an interrupt
+        set_state(s, name, mwait_supports_hint(0) ? IDLE_TYPE_MWAIT : IDLE_TYPE_HLT, 0, latency);
+        return true;
+    }
+
+    return false;
+}
+
+static ACPI_STATUS read_cst(ACPI_HANDLE handle, UINT32 level, void* context, void** ret)
+{
+    uint32 pdc[3] = { ACPI_PDC_REVISION, 1, ACPI_PDC_C_C1_HALT | ACPI_PDC_SMP_C1PT | ACPI_PDC_SMP_C2C3 };
+    ACPI_OBJECT pdc_arg;
+    ACPI_OBJECT_LIST pdc_args = { 1, &pdc_arg };
+    ACPI_BUFFER buf = { ACPI_ALLOCATE_BUFFER, NULL };
+    ACPI_OBJECT* cst;
+    idle_state new_states[IDLE_MAX_STATES];
+    uint32 num_new = 1;
+    uint32 eflags;
+    uint32 i;
+
+    // Firmware only lists MWAIT states if it is told that the kernel can use them. Older firmware
+    // doesn't have _PDC at all, so its result doesn't matter.
+    if (mwait_available)
+        pdc[2] |= ACPI_PDC_C_C1_FFH | ACPI_PDC_C_C2C3_FFH;
+
+    pdc_arg.Buffer.Type = ACPI_TYPE_BUFFER;
+    pdc_arg.Buffer.Length = sizeof(pdc);
+    pdc_arg.Buffer.Pointer = (uint8*)pdc;
+
+    AcpiEvaluateObject(handle, (char*)"_PDC", &pdc_args, NULL);
+
+    if (AcpiEvaluateObjectTyped(handle, (char*)"_CST", NULL, &buf, ACPI_TYPE_PACKAGE) != AE_OK)
+        return AE_OK;
+
+    cst = buf.Pointer;
+    new_states[0] = states[0];
+
+    // The first element is the number of states, which is followed by the states from shallowest to
+    // deepest
+    for (i = 1; i < cst->Package.Count && num_new < IDLE_MAX_STATES; i++)
+    {
+        if (parse_cst_entry(&cst->Package.Elements[i], &new_states[num_new]))
+            num_new++;
+    }
+
+    ACPI_FREE(buf.Pointer);
+
+    // If none of the states are usable, the states that are always available are kept
+    if (num_new == 1)
+        return AE_OK;
+
+    eflags = eflags_save();
+    asm volatile ("cli");
+
+    memcpy(states, new_states, sizeof(new_states));
+    num_states = num_new;
+
+    eflags_load(eflags);
+
+    for (i = 1; i < num_states; i++)
+    {
+        klog(KLOG_LEVEL_DEBUG, "Idle: %s (%s), exit latency %dus, target residency %dus\n", states[i].name,
+            (states[i].type == IDLE_TYPE_MWAIT) ? "MWAIT" : "HLT", states[i].exit_latency_us, states[i].target_residency_us);
+    }
+
+    *(bool*)context = true;
+    return AE_CTRL_TERMINATE;
+}
+
+void idle_init_acpi(void)
+{
+    bool found = false;
+
+    // Processors are either declared with the Processor keyword or as devices
+    AcpiWalkNamespace(ACPI_TYPE_PROCESSOR, ACPI_ROOT_OBJECT, ACPI_UINT32_MAX, read_cst, NULL, &found, NULL);
+
+    if (!found)
+        AcpiGetDevices((char*)"ACPI0007", read_cst, &found, NULL);
+
+    if (!found)
+        klog(KLOG_LEVEL_DEBUG, "Idle: no usable _CST, only C1 is available\n");
+}
+
+void idle_set_poll(bool poll)
+{
+    poll_mode = poll;
+}
+
+uint32 idle_num_states(void)
+{
+    return num_states;
+}
+
+const idle_state* idle_get_state(uint32 i)
+{
+    return (i < num_states) ? &states[i] : NULL;
+}
+
+// Picks the deepest state that will pay off within the time that the processor is predicted to stay
+// idle for, falling back to polling if not even the shallowest halting state would
+static uint32 select_state(const idle_cpu* c, uint64 next_event_ns)
+{
+    uint64 predicted = (c->predicted_ns < next_event_ns) ? c->predicted_ns : next_event_ns;
+    uint32 i;
+
+    if (poll_mode)
+        return 0;
+
+    for (i = num_states - 1; i > 0; i--)
+    {
+        if ((uint64)states[i].target_residency_us * 1000 <= predicted)
+            return i;
+    }
+
+    return 0;
+}
+
+// Folds the length of the idle period that just ended into the prediction for the next one
+static void reflect(idle_cpu* c)
+{
+    uint64 measured;
+
+    if (c->entered_ns == 0)
+        return;
+
+    if ((measured = clock_now_ns() - c->entered_ns) > IDLE_PREDICTION_MAX_NS)
+        measured = IDLE_PREDICTION_MAX_NS;
+
+    c->predicted_ns = c->predicted_ns - (c->predicted_ns >> IDLE_PREDICTION_SHIFT) + (measured >> IDLE_PREDICTION_SHIFT);
+    c->entered_ns = 0;
+}
+
+// Clearing wake before setting polling and checking it again afterwards means that a processor that
+// calls idle_wake either sees polling set or has its write to wake seen here
+static void begin_polling(idle_cpu* c)
+{
+    c->wake = 0;
+    __atomic_store_n(&c->polling, true, __ATOMIC_SEQ_CST);
+}
+
+static bool end_polling(idle_cpu* c)
+{
+    __atomic_store_n(&c->polling, false, __ATOMIC_SEQ_CST);
+    return __atomic_exchange_n(&c->wake, 0, __ATOMIC_SEQ_CST) != 0;
+}
+
+// When not in poll mode, polling only lasts as long as the shallowest halting state would need to
+// pay off. If nothing happens by then, the prediction was too short.
+static bool poll_idle(idle_cpu* c)
+{
+    uint64 limit_ns = poll_mode ? 0 : (uint64)states[1].target_residency_us * 1000;
+    bool timed_out = false;
+
+    begin_polling(c);
+    asm volatile ("sti");
+
+    while (c->wake == 0)
+    {
+        asm volatile ("pause");
+
+        if (limit_ns != 0 && clock_now_ns() - c->entered_ns >= limit_ns)
+        {
+            timed_out = true;
+            break;
+        }
+    }
+
+    asm volatile ("cli");
+
+    if (timed_out)
+        c->predicted_ns = limit_ns;
+
+    return end_polling(c);
+}
+
+// MONITOR is armed before wake is checked, so a write after the check still ends the MWAIT. STI
+// only takes effect after the following instruction, so an interrupt can't slip in before MWAIT.
+static bool mwait_idle(idle_cpu* c, uint32 hint)
+{
+    begin_polling(c);
+
+    asm volatile ("monitor" : : "a" (&c->wake), "c" (0), "d" (0));
+
+    if (c->wake == 0)
+        asm volatile ("sti; mwait; cli" : : "a" (hint), "c" (0) : "memory");
+
+    return end_polling(c);
+}
+
+bool idle_enter(uint64 next_event_ns)
+{
+    idle_cpu* c = percpu_ptr(idle_cpu_state);
+    bool woken = false;
+
+    // The scheduler starts the idle thread over when an interrupt finds nothing else to run, which
+    // also ends the previous idle period
+    reflect(c);
+
+    c->state = select_state(c, next_event_ns);
+    c->entered_ns = clock_now_ns();
+
+    switch (states[c->state].type)
+    {
+        case IDLE_TYPE_POLL:
+            woken = poll_idle(c);
+            break;
+
+        case IDLE_TYPE_MWAIT:
+            woken = mwait_idle(c, states[c->state].mwait_hint);
+            break;
+
+        case IDLE_TYPE_HLT:
+            asm volatile ("sti; hlt; cli" : : : "memory");
+            break;
+    }
+
+    reflect(c);
+    return woken;
+}
+
+void idle_exit(void)
+{
+    idle_cpu* c = percpu_ptr(idle_cpu_state);
+
+    // The processor may have been switched to a thread by an interrupt that arrived while it was
+    // polling, and must be sent interrupts again from now on
+    if (c->polling)
+        end_polling(c);
+
+    reflect(c);
+}
+
+bool idle_wake(uint32 cpu)
+{
+    idle_cpu* c = percpu_ptr_cpu(idle_cpu_state, cpu);
+
+    __atomic_store_n(&c->wake, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&c->polling, __ATOMIC_SEQ_CST);
+}
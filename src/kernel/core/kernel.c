@@ -5,8 +5,10 @@
 
 #include <io/console.h>
 #include <cpu/cpuid.h>
+#include <cpu/fpu.h>
 #include <cpu/gdt.h>
 #include <cpu/idt.h>
+#include <cpu/syscall.h>
 #include <core/ksym.h>
 #include <core/gdb_stub.h>
 
@@ -19,12 +21,20 @@
 #include <memory/phys.h>
 #include <memory/page.h>
 #include <memory/virt.h>
+#include <memory/stack.h>
 
 #include <core/sched.h>
+#include <core/clock.h>
+#include <core/hrtimer.h>
+#include <core/smp.h>
+#include <core/workqueue.h>
+#include <core/idle.h>
+#include <core/time_page.h>
 
 #include <fs/vfs.h>
 
 #include <io/acpi.h>
+#include <io/hpet.h>
 
 static boot_param gparam;
 
@@ -36,14 +46,26 @@ static void kernel_main2(const boot_param* param)
     cpuid_init();
     klog(KLOG_LEVEL_INFO, "Detected CPU Vendor: %s (%s)\n", cpuid_detected_vendor->vendor_name, cpuid_detected_vendor->vendor_id.str);
 
+    // Idle threads start running as soon as the scheduler is up, so they need to know how to idle
+    idle_init(param);
+
     // Initialize the memory manager
     kmem_page_init(param);
     kmem_phys_init(param);
     kmem_virt_init(param);
     kmem_pool_generic_init();
+    kmem_stack_init();
+
+    // The clock publishes itself to the time page from the start, and every address space maps it
+    time_page_init();
 
     // Initialize the CPU scheduler
     sched_init(param);
+    fpu_init();
+    syscall_init();
+
+    // The TSC is calibrated against the scheduler tick, so this must come after the scheduler
+    clock_init();
     klog_start_background_thread();
 
     // Now that the scheduler is ready, we can enable interrupts for TTYs
@@ -53,6 +75,19 @@ static void kernel_main2(const boot_param* param)
 
     acpi_init();
 
+    // C-states are listed in the ACPI namespace, and must be known before other processors go idle
+    idle_init_acpi();
+
+    // Now that the ACPI tables are available, start up the other processors
+    smp_init(param);
+
+    // Worker pools are per-processor, so they can only be set up once all processors are known
+    workqueue_init_pools();
+
+    // Comparator interrupts are delivered through the local APIC, which smp_init has enabled
+    hpet_init();
+    hrtimer_init_queue();
+
     sched_thread_end();
 }
 
@@ -91,6 +91,9 @@ void klog_start_background_thread(void)
     if (sched_thread_create(sched_process_current(), klog_background_thread, NULL, &flush_thread) != E_SUCCESS)
         crash("Failed to initialize klog background thread!");
 
+    // Flushing the log is never urgent, so it shouldn't get in the way of anything else
+    sched_thread_set_priority(flush_thread, SCHED_PRIO_FAIR_MIN);
+
     klog(KLOG_LEVEL_DEBUG, "Kernel background logging thread started!\n");
 }
 
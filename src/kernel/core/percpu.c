@@ -0,0 +1,39 @@
+#include <core/percpu.h>
+#include <memory/early.h>
+#include <memory/page.h>
+#include <string.h>
+#include <math.h>
+
+uint32 percpu_offset __percpu;
+uint32 percpu_offsets[SMP_MAX_CPUS];
+
+size_t percpu_area_size(void)
+{
+    return (size_t)(_ld_percpu_end - _ld_percpu_begin);
+}
+
+uint32 percpu_init_area(uint32 cpu, void* area)
+{
+    uint32 offset = (uint32)area - (uint32)_ld_percpu_begin;
+
+    memcpy(area, _ld_percpu_begin, percpu_area_size());
+
+    // The offset is stored in the area itself so that percpu_ptr can find the current processor's
+    // copy of a variable with a single GS-relative load.
+    *(uint32*)((uint8*)&percpu_offset + offset) = offset;
+    percpu_offsets[cpu] = offset;
+
+    return offset;
+}
+
+uint32 percpu_init_bsp(void)
+{
+    // This happens before the memory manager is available, so the area for the bootstrap processor
+    // must come from the early allocator.
+    return percpu_init_area(0, kmalloc_early(percpu_area_size(), PERCPU_ALIGN, NULL));
+}
+
+void* percpu_alloc_area(void)
+{
+    return kmem_page_global_alloc(PT_ENTRY_WRITEABLE | PT_ENTRY_NO_EXECUTE, 0, ROUND_UP(percpu_area_size(), FRAME_SIZE) / FRAME_SIZE);
+}
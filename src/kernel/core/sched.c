@@ -4,49 +4,238 @@
 #include <assert.h>
 #include <cpu/gdt.h>
 #include <cpu/idt.h>
+#include <cpu/apic.h>
+#include <cpu/fpu.h>
+#include <cpu/tsc.h>
+#include <cpu/syscall.h>
+#include <core/smp.h>
+#include <core/percpu.h>
+#include <core/crash.h>
+#include <core/workqueue.h>
+#include <core/idle.h>
+#include <core/preempt.h>
+#include <core/softirq.h>
+#include <core/time_page.h>
 #include <hwio.h>
 
 #include <core/klog.h>
 
-#define THREAD_STACK_SIZE 0x4000
-#define THREAD_EFLAGS ((1 << 1) | (1 << 9))
+#define EFLAGS_IF (1 << 9)
+#define THREAD_EFLAGS ((1 << 1) | EFLAGS_IF)
+#define YIELD_EFLAGS (1 << 1)
 
 #define PIT_CHANNEL_0_DATA 0x40
 #define PIT_COMMAND 0x43
 #define PIT_MODE_COMMAND 0x36 // Select channel 0 with lobyte/hibyte access mode and operating
                               // mode 3 (square wave generator)
 
-// TODO: Deal with muliple processors
-static sched_process* current_process;
-static sched_thread* current_thread;
+// The processor that advances ticks and wakes sleeping threads
+#define TIMEKEEPER_CPU 0
 
-static uint64 next_pid = 0;
+// Lower priority than any real thread, used for processors that are running their idle thread
+#define SCHED_PRIO_IDLE SCHED_NUM_PRIORITIES
+
+// Virtual runtime is counted in 1/1024ths of a tick spent running at the default weight
+#define FAIR_WEIGHT_DEFAULT 1024
+#define FAIR_VRUNTIME_PER_TICK 1024
+
+// A fair thread that wakes up is placed at most this far behind the other fair threads, so that it
+// gets to run soon without being able to save up CPU time by sleeping
+#define FAIR_SLEEPER_CREDIT (TICKS_FAIR_PERIOD * FAIR_VRUNTIME_PER_TICK / 2)
+
+// How far behind the running fair thread a thread that wakes up has to be to preempt it
+#define FAIR_WAKEUP_GRANULARITY FAIR_VRUNTIME_PER_TICK
+
+// Delays are counted in a bucket for every power of two TSC cycles, so that the rare long ones behind
+// latency spikes stand out. The last bucket also counts everything longer than it.
+#define LATENCY_BUCKETS 40
+
+typedef struct
+{
+    uint64 count;
+    uint64 total_cycles;
+    uint64 max_cycles;
+    uint64 max_pid;
+    uint64 max_tid;
+    uint32 buckets[LATENCY_BUCKETS];
+} latency_hist;
+
+// A FIFO queue for each real-time priority, along with a bitmap of which of them are non-empty so
+// that the most important ready thread can be found in constant time
+typedef struct
+{
+    uint32 bitmap;
+    sched_thread_queue queues[SCHED_NUM_RT_PRIORITIES];
+} sched_prio_array;
+
+_Static_assert(SCHED_NUM_RT_PRIORITIES <= 32, "sched_prio_array must have a bit for every priority");
+
+typedef struct
+{
+    sched_process* current_process;
+    sched_thread* current_thread;
+
+    sched_thread* idle_thread;
+
+    uint32 index;
+
+    // Threads that are ready to run on this processor. Real-time threads wait in a FIFO queue for
+    // their priority, while fair threads wait in a tree ordered by virtual runtime. Idle processors
+    // steal threads from the run queues of busier processors, so other processors may remove
+    // threads from them at any time while holding run_queue_lock.
+    spinlock run_queue_lock;
+    sched_prio_array rt_queue;
+    rbtree fair_tree;
+    uint32 fair_weight;
+    volatile uint32 num_ready;
+
+    // Never goes backwards, and is used to place fair threads that wake up relative to the fair
+    // threads that are already here
+    unsigned long long min_vruntime;
+
+    // Describes the thread running on this processor, so that other processors can decide whether a
+    // thread they made ready here should preempt it. current_prio is the priority of its scheduling
+    // class (SCHED_PRIO_FAIR_MAX for any fair thread), and current_vruntime is only meaningful for
+    // a fair thread. Both are protected by run_queue_lock.
+    uint32 current_prio;
+    unsigned long long current_vruntime;
+
+    // The thread that was just switched out. Its stack is still in use until this processor has
+    // switched to the new thread's stack, so other processors can only be allowed to run it once
+    // _sched_finish_switch is called from there.
+    sched_thread* switch_prev;
+
+    // Set when the current thread has been put back in the run queue because it was preempted, so
+    // that the switch can be accounted as an involuntary one
+    bool switch_preempted;
+
+    // A thread that the current thread is handing the processor to, which runs next if it is still
+    // waiting in this run queue and nothing more important is
+    sched_thread* yield_to;
+
+    uint32 ticks_until_rebalance;
 
 #ifndef SCHED_NO_PREEMPT
-static unsigned long long ticks_until_preempt = TICKS_BEFORE_PREEMPT;
+    uint32 ticks_until_preempt;
 #endif
 
+    // When the dynamic tick is enabled, the local APIC timer is only run in one-shot mode for the
+    // next event this processor cares about, except on the timekeeper while any processor is busy.
+    // tick_oneshot_counts is the initial count of the current one-shot event (0 if the timer is
+    // periodic or stopped) and tick_oneshot_accounted is how much of it has already been turned
+    // into ticks.
+    bool tick_stopped;
+    uint32 tick_oneshot_counts;
+    uint32 tick_oneshot_accounted;
+
+    // Delays of the threads that this processor has switched to. These have their own lock, since
+    // sched_latency_dump reads them from other processors.
+    spinlock latency_lock;
+    latency_hist wakeup_latency;
+    latency_hist queue_delay;
+} sched_cpu_state;
+
+static sched_cpu_state cpu_state __percpu;
+
+uint32 preempt_count __percpu;
+
+// Set when this processor should switch threads as soon as it can. Other processors set it before
+// sending a reschedule interrupt.
+volatile bool sched_need_resched __percpu;
+
+// Number of local APIC timer counts per tick, or 0 if the dynamic tick is not enabled
+static uint32 tick_counts;
+
+// Bitmask of processors that are currently running their idle threads
+static volatile uint32 idle_cpus;
+static volatile bool timekeeper_stopped;
+
+_Static_assert(SMP_MAX_CPUS <= 32, "idle_cpus must have a bit for every processor");
+
+static uint64 next_pid = 0;
+
 unsigned long long ticks = 0;
-sched_process_queue process_run_queue;
 
 spinlock process_list_spinlock;
 sched_process* first_process = NULL;
 
 sched_process* kernel_process;
-static sched_thread* idle_thread;
 
-static sched_thread_queue sleep_queue;
+// Processes and threads are also kept in hash tables so that they can be found by their IDs without
+// walking the process list. Lookups don't take any locks: entries are only ever added to the head of
+// a chain with a release store, and removing an entry makes hash_seq odd until it is done, so that a
+// lookup which may have followed a removed entry can start over. This relies on processes and threads
+// coming from pools that are never compacted (see kmem_pool_small_never_compact), so an entry that is
+// freed in the middle of a lookup is still mapped.
+#define SCHED_HASH_BITS 6
+#define SCHED_HASH_SIZE (1u << SCHED_HASH_BITS)
+
+static spinlock hash_lock;
+static volatile uint32 hash_seq;
+static sched_process* pid_hash[SCHED_HASH_SIZE];
+static sched_thread* tid_hash[SCHED_HASH_SIZE];
+
+// Serializes changes to the priorities of threads, which can come from sched_thread_set_priority and
+// from priority inheritance at the same time
+static spinlock priority_lock;
 
 static mempool_small process_pool;
 static mempool_small thread_pool;
 
 static mempool_small process_address_space_pool;
 
-void sched_idle(void);
+void sched_idle(void) __attribute__((noreturn));
+void _sched_yield_resume(void) __hidden;
+
+regs32_saved_t* _sched_yield_switch(uint32 esp) __hidden;
+void _sched_finish_switch(void) __hidden;
+
+static void sleep_timer_expired(void* arg);
+
+// Must be called with interrupts disabled, since the current thread could otherwise be moved to
+// another processor.
+static inline sched_cpu_state* this_cpu(void)
+{
+    return percpu_ptr(cpu_state);
+}
+
+static inline sched_cpu_state* cpu_state_of(uint32 cpu)
+{
+    return percpu_ptr_cpu(cpu_state, cpu);
+}
+
+// Interrupt handlers run with the preempt count raised by one, so the code they interrupted can only
+// be preempted if it is otherwise zero
+static inline bool irq_preemptible(void)
+{
+    return preempt_count_read() == 1;
+}
+
+// The weight of each fair priority, where each step gets about 25% more CPU time than the next one
+// when competing with it
+static const uint32 fair_weights[SCHED_NUM_PRIORITIES - SCHED_NUM_RT_PRIORITIES] = {
+    6100, 4904, 3906, 3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423, 335, 272, 215
+};
+
+static inline uint32 fair_weight_of(uint32 priority)
+{
+    return fair_weights[priority - SCHED_NUM_RT_PRIORITIES];
+}
+
+static inline uint32 class_prio(uint32 priority)
+{
+    return SCHED_PRIO_IS_RT(priority) ? priority : SCHED_PRIO_FAIR_MAX;
+}
+
+// core/sched.S restores threads directly from their saved registers
+_Static_assert(offsetof(regs32_saved_t, eip) == 44 && offsetof(regs32_saved_t, esp) == 56,
+    "core/sched.S depends on the layout of regs32_saved_t");
 
 static void init_registers(regs32_saved_t* r, uint32 stack, uint32 entry)
 {
-    r->gs = r->fs = r->es = r->ds = r->ss = GDT_KERNEL_DATA;
+    r->fs = r->es = r->ds = r->ss = GDT_KERNEL_DATA;
+    r->gs = GDT_PERCPU;
     r->cs = GDT_KERNEL_CODE;
 
     r->edi = r->esi = r->ebp = r->ebx = r->edx = r->ecx = r->eax = 0;
@@ -56,6 +245,110 @@ static void init_registers(regs32_saved_t* r, uint32 stack, uint32 entry)
     r->esp = stack;
 }
 
+static inline uint32 hash_id(uint64 id)
+{
+    return ((uint32)(id ^ (id >> 32)) * 2654435761u) >> (32 - SCHED_HASH_BITS);
+}
+
+static inline uint32 hash_thread_id(uint64 pid, uint64 tid)
+{
+    return hash_id(tid ^ (pid << 20));
+}
+
+static void hash_insert_process(sched_process* p)
+{
+    sched_process** bucket = &pid_hash[hash_id(p->pid)];
+
+    spinlock_acquire(&hash_lock);
+    p->next_in_hash = *bucket;
+    __atomic_store_n(bucket, p, __ATOMIC_RELEASE);
+    spinlock_release(&hash_lock);
+}
+
+static void hash_insert_thread(sched_thread* t)
+{
+    sched_thread** bucket = &tid_hash[hash_thread_id(t->process->pid, t->tid)];
+
+    spinlock_acquire(&hash_lock);
+    t->next_in_hash = *bucket;
+    __atomic_store_n(bucket, t, __ATOMIC_RELEASE);
+    spinlock_release(&hash_lock);
+}
+
+static void hash_remove_thread(sched_thread* t)
+{
+    sched_thread** prev = &tid_hash[hash_thread_id(t->process->pid, t->tid)];
+
+    spinlock_acquire(&hash_lock);
+    __atomic_fetch_add(&hash_seq, 1, __ATOMIC_SEQ_CST);
+
+    while (*prev != t)
+        prev = &(*prev)->next_in_hash;
+
+    __atomic_store_n(prev, t->next_in_hash, __ATOMIC_RELEASE);
+
+    __atomic_fetch_add(&hash_seq, 1, __ATOMIC_RELEASE);
+    spinlock_release(&hash_lock);
+}
+
+static uint32 hash_read_begin(void)
+{
+    uint32 seq;
+
+    while ((seq = __atomic_load_n(&hash_seq, __ATOMIC_ACQUIRE)) & 1)
+        asm volatile ("pause");
+
+    return seq;
+}
+
+// Returns true if an entry may have been removed since hash_read_begin returned the given value, in
+// which case any entry loaded since then may have been freed
+static bool hash_read_retry(uint32 seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&hash_seq, __ATOMIC_RELAXED) != seq;
+}
+
+sched_process* sched_find_process(uint64 pid)
+{
+    sched_process* p;
+    uint32 seq;
+
+    // Every entry is checked to still be in the table before it is looked at, and the match is only
+    // trusted if nothing was removed while looking at it
+    do
+    {
+        seq = hash_read_begin();
+
+        for (p = __atomic_load_n(&pid_hash[hash_id(pid)], __ATOMIC_ACQUIRE); p != NULL && !hash_read_retry(seq); p = __atomic_load_n(&p->next_in_hash, __ATOMIC_ACQUIRE))
+        {
+            if (p->pid == pid)
+                break;
+        }
+    } while (hash_read_retry(seq));
+
+    return p;
+}
+
+sched_thread* sched_find_thread(sched_process* process, uint64 tid)
+{
+    sched_thread* t;
+    uint32 seq;
+
+    do
+    {
+        seq = hash_read_begin();
+
+        for (t = __atomic_load_n(&tid_hash[hash_thread_id(process->pid, tid)], __ATOMIC_ACQUIRE); t != NULL && !hash_read_retry(seq); t = __atomic_load_n(&t->next_in_hash, __ATOMIC_ACQUIRE))
+        {
+            if (t->process == process && t->tid == tid)
+                break;
+        }
+    } while (hash_read_retry(seq));
+
+    return t;
+}
+
 static sched_thread* alloc_init_thread(sched_process* p)
 {
     sched_thread* t = kmem_pool_small_alloc(&thread_pool, 0);
@@ -64,34 +357,69 @@ static sched_thread* alloc_init_thread(sched_process* p)
         return NULL;
 
     t->process = p;
-    t->tid = (p == NULL) ? 0 : p->next_tid++;
+    t->tid = 0;
 
     t->status = STS_READY;
 
+    t->priority = SCHED_PRIO_DEFAULT;
+    t->base_priority = SCHED_PRIO_DEFAULT;
+    t->inherited_priority = SCHED_PRIO_NONE;
+    t->time_slice = TICKS_BEFORE_PREEMPT;
+    t->queued_on = 0;
+
+    t->vruntime = 0;
+
+    spinlock_init(&t->stats_lock);
+    memset(&t->stats, 0, sizeof(t->stats));
+    t->run_start = 0;
+    t->ready_since = tsc_read();
+    t->woken_at = 0;
+
     spinlock_init(&t->registers_lock);
     t->registers_dirty = false;
 
     t->stack_low = t->stack_high = NULL;
     t->in_queue = NULL;
 
-    t->next_in_process = (p == NULL) ? NULL : p->first_thread;
-
-    if (p != NULL)
-    {
-        p->first_thread = t;
+    t->last_cpu = smp_cpu_index();
+    t->last_run = 0;
+    t->affinity = SCHED_AFFINITY_ALL;
 
-        spinlock_acquire(&p->thread_run_queue.lock);
-        sched_thread_enqueue(&p->thread_run_queue, t);
-        spinlock_release(&p->thread_run_queue.lock);
-    }
+    t->prev_in_process = NULL;
+    t->next_in_process = NULL;
+    t->next_in_hash = NULL;
 
     t->held_mutexes = NULL;
+    t->blocked_on = NULL;
+    t->worker = NULL;
+
+    fpu_thread_init(t);
+    timer_init(&t->sleep_timer, sleep_timer_expired, t);
+    hrtimer_init(&t->sleep_hrtimer, sleep_timer_expired, t);
+    t->wait_queue = NULL;
+    t->wait_timed_out = false;
 
 #ifdef SCHED_DEBUG
     t->creation = ticks;
-    t->run_ticks = 0;
 #endif
 
+    if (p != NULL)
+    {
+        spinlock_acquire(&p->lock);
+
+        // Threads of the same process can be created on several processors at once
+        t->tid = p->next_tid++;
+
+        t->next_in_process = p->first_thread;
+        if (p->first_thread != NULL)
+            p->first_thread->prev_in_process = t;
+        p->first_thread = t;
+
+        spinlock_release(&p->lock);
+
+        hash_insert_thread(t);
+    }
+
     if (p != NULL)
         klog(KLOG_LEVEL_DEBUG, "Created thread %ld under process %ld (%s)\n", t->tid, p->pid, p->name);
     else
@@ -118,7 +446,8 @@ static sched_process* alloc_init_process(const char* name, page_context* address
 
     p->next_tid = 0;
     p->first_thread = NULL;
-    sched_thread_queue_init(&p->thread_run_queue);
+
+    memset(&p->exited_stats, 0, sizeof(p->exited_stats));
 
     p->next = NULL;
 
@@ -127,9 +456,7 @@ static sched_process* alloc_init_process(const char* name, page_context* address
     first_process = p;
     spinlock_release(&process_list_spinlock);
 
-    spinlock_acquire(&process_run_queue.lock);
-    sched_process_enqueue(&process_run_queue, p);
-    spinlock_release(&process_run_queue.lock);
+    hash_insert_process(p);
 
     klog(KLOG_LEVEL_DEBUG, "Created process %ld (%s)\n", p->pid, p->name);
     return p;
@@ -142,114 +469,1265 @@ static void pit_init(uint32 divisor)
     outb(PIT_CHANNEL_0_DATA, (divisor >> 8) & 0xff);
 }
 
-static void pit_tick_handle(regs32_t* r)
+static inline bool thread_is_cache_hot(const sched_thread* t)
 {
-    ticks++;
+    // A thread whose registers have not been saved yet is still running on another processor
+    return t->registers_dirty || ticks - t->last_run < TICKS_CACHE_HOT;
+}
 
-#ifdef SCHED_DEBUG
-    if (current_thread != NULL)
+static inline bool thread_allowed_on(const sched_thread* t, uint32 cpu)
+{
+    return (t->affinity & (1u << cpu)) != 0;
+}
+
+// Returns true if a thread may be taken from a run queue to run on one of the processors in dest_mask.
+// If cold_only is set, cache-hot threads are left where they are.
+static inline bool can_take(const sched_thread* t, bool cold_only, uint32 dest_mask)
+{
+    return (t->affinity & dest_mask) != 0 && (!cold_only || !thread_is_cache_hot(t));
+}
+
+// Picks the run queue for a thread that is becoming ready. The processor that it last ran on is
+// preferred, since that is where its working set is most likely to still be cached, followed by this
+// processor. A thread that isn't allowed on any online processor runs here rather than not at all.
+static uint32 select_cpu(const sched_thread* t, uint32 self)
+{
+    uint32 target = t->last_cpu;
+    uint32 i;
+
+    if (target < smp_num_cpus && smp_cpus[target].online && thread_allowed_on(t, target))
+        return target;
+
+    if (thread_allowed_on(t, self))
+        return self;
+
+    for (i = 0; i < smp_num_cpus; i++)
     {
-        current_thread->run_ticks++;
+        if (smp_cpus[i].online && thread_allowed_on(t, i))
+            return i;
     }
-#endif
 
-    spinlock_acquire(&sleep_queue.lock);
-    while (sleep_queue.first != NULL && sleep_queue.first->sleep_until <= ticks)
+    return self;
+}
+
+static void prio_array_init(sched_prio_array* a)
+{
+    uint32 i;
+
+    a->bitmap = 0;
+
+    for (i = 0; i < SCHED_NUM_RT_PRIORITIES; i++)
+        sched_thread_queue_init(&a->queues[i]);
+}
+
+static void prio_array_remove(sched_prio_array* a, uint32 prio, sched_thread* prev, sched_thread* t)
+{
+    sched_thread_queue* q = &a->queues[prio];
+
+    if (prev == NULL)
+        q->first = t->next_in_queue;
+    else
+        prev->next_in_queue = t->next_in_queue;
+
+    if (q->last == t)
+        q->last = prev;
+
+    t->in_queue = NULL;
+
+    if (q->first == NULL)
+        a->bitmap &= ~(1u << prio);
+}
+
+// Removes the first thread of the most important non-empty queue in the given array that may run on
+// one of the processors in dest_mask. If cold_only is set, cache-hot threads are skipped over.
+static sched_thread* prio_array_take(sched_prio_array* a, bool cold_only, uint32 dest_mask)
+{
+    uint32 bitmap = a->bitmap;
+
+    while (bitmap != 0)
     {
-        sched_thread* t = sched_thread_dequeue(&sleep_queue);
+        uint32 prio = (uint32)__builtin_ctz(bitmap);
+        sched_thread* prev = NULL;
+        sched_thread* t;
 
-        spinlock_release(&sleep_queue.lock);
-        spinlock_acquire(&t->process->thread_run_queue.lock);
+        for (t = a->queues[prio].first; t != NULL && !can_take(t, cold_only, dest_mask); prev = t, t = t->next_in_queue) ;
 
-        sched_thread_enqueue(&t->process->thread_run_queue, t);
-        t->status = STS_READY;
+        if (t != NULL)
+        {
+            prio_array_remove(a, prio, prev, t);
+            return t;
+        }
 
-        spinlock_release(&t->process->thread_run_queue.lock);
-        spinlock_acquire(&sleep_queue.lock);
+        bitmap &= bitmap - 1;
     }
-    spinlock_release(&sleep_queue.lock);
 
-#ifndef SCHED_NO_PREEMPT
-    ticks_until_preempt--;
-    if (ticks_until_preempt == 0)
-#else
-    if (current_thread == NULL)
-#endif
+    return NULL;
+}
+
+static bool fair_less(const rbtree_node* a, const rbtree_node* b)
+{
+    return rbtree_entry(a, sched_thread, fair_node)->vruntime < rbtree_entry(b, sched_thread, fair_node)->vruntime;
+}
+
+static void fair_remove(sched_cpu_state* cpu, sched_thread* t)
+{
+    rbtree_remove(&cpu->fair_tree, &t->fair_node);
+    cpu->fair_weight -= t->queued_weight;
+}
+
+// Removes the fair thread with the smallest virtual runtime that may run on one of the processors in
+// dest_mask. If cold_only is set, cache-hot threads are skipped over.
+static sched_thread* fair_take(sched_cpu_state* cpu, bool cold_only, uint32 dest_mask)
+{
+    rbtree_node* node;
+
+    for (node = rbtree_first(&cpu->fair_tree); node != NULL; node = rbtree_next(node))
     {
-        if (current_thread != NULL && current_thread->status != STS_DEAD)
+        sched_thread* t = rbtree_entry(node, sched_thread, fair_node);
+
+        if (can_take(t, cold_only, dest_mask))
         {
-            spinlock_acquire(&current_thread->process->thread_run_queue.lock);
-            sched_thread_enqueue(&current_thread->process->thread_run_queue, current_thread);
-            current_thread->status = STS_READY;
-            spinlock_release(&current_thread->process->thread_run_queue.lock);
+            fair_remove(cpu, t);
+            return t;
         }
+    }
 
-        sched_switch_any(r);
+    return NULL;
+}
+
+// Must be called with run_queue_lock held
+static void update_min_vruntime(sched_cpu_state* cpu)
+{
+    unsigned long long vruntime = ~0ull;
+
+    if (cpu->current_prio == SCHED_PRIO_FAIR_MAX)
+        vruntime = cpu->current_vruntime;
+
+    if (!rbtree_empty(&cpu->fair_tree))
+    {
+        sched_thread* first = rbtree_entry(rbtree_first(&cpu->fair_tree), sched_thread, fair_node);
+
+        if (first->vruntime < vruntime)
+            vruntime = first->vruntime;
     }
+
+    if (vruntime != ~0ull && vruntime > cpu->min_vruntime)
+        cpu->min_vruntime = vruntime;
 }
 
-static void yield_interrupt_handle(regs32_t* r)
+static void stats_add(sched_stats* to, const sched_stats* from)
 {
-    sched_switch_any(r);
+    to->run_cycles += from->run_cycles;
+    to->wait_cycles += from->wait_cycles;
+    to->voluntary_switches += from->voluntary_switches;
+    to->involuntary_switches += from->involuntary_switches;
+    to->wakeups += from->wakeups;
 }
 
-void sched_init(const boot_param* param)
+// Called when a thread that was not ready is placed in a run queue. The time stamp counters of
+// different processors may be slightly out of sync, so the time it spends waiting is only charged
+// if it doesn't appear to be negative.
+static void stats_ready(sched_thread* t, bool wakeup)
 {
-    spinlock_init(&process_list_spinlock);
+    uint64 now = tsc_read();
 
-    kmem_pool_small_init(&process_pool, "sched_process pool", sizeof(sched_process), __alignof__(sched_process), 0);
-    kmem_pool_small_init(&thread_pool, "sched_thread pool", sizeof(sched_thread), __alignof__(sched_thread), 0);
-    kmem_pool_small_init(&process_address_space_pool, "sched_process page_context", sizeof(page_context), __alignof__(page_context), 0);
+    spinlock_acquire(&t->stats_lock);
 
-    sched_process_queue_init(&process_run_queue);
-    sched_thread_queue_init(&sleep_queue);
+    t->ready_since = now;
 
-    current_process = first_process = kernel_process = alloc_init_process("kernel", &kernel_page_context);
-    if (current_process == NULL)
-        crash("Failed to initialize kernel process!");
+    if (wakeup)
+        t->stats.wakeups++;
 
-    sched_process_enqueue(&process_run_queue, current_process);
+    spinlock_release(&t->stats_lock);
+}
 
-    current_thread = alloc_init_thread(first_process);
-    if (current_thread == NULL)
-        crash("Failed to initialize first kernel thread!");
+static void latency_record(latency_hist* h, const sched_thread* t, uint64 cycles)
+{
+    uint32 bucket = (cycles == 0) ? 0 : 63 - (uint32)__builtin_clzll(cycles);
+
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+
+    h->buckets[bucket]++;
+    h->count++;
+    h->total_cycles += cycles;
+
+    if (cycles > h->max_cycles)
+    {
+        h->max_cycles = cycles;
+        h->max_pid = t->process->pid;
+        h->max_tid = t->tid;
+    }
+}
+
+// The thread's delays are recorded by the processor it is switched in on, if any
+static void stats_switch_in(sched_cpu_state* cpu, sched_thread* t, uint64 now)
+{
+    uint64 ready_since;
+    uint64 woken_at;
+
+    spinlock_acquire(&t->stats_lock);
+
+    ready_since = t->ready_since;
+    woken_at = t->woken_at;
+
+    if (ready_since != 0 && now > ready_since)
+        t->stats.wait_cycles += now - ready_since;
+
+    t->ready_since = 0;
+    t->woken_at = 0;
+    t->run_start = now;
+
+    spinlock_release(&t->stats_lock);
+
+    if (cpu == NULL || ready_since == 0)
+        return;
+
+    spinlock_acquire(&cpu->latency_lock);
+
+    latency_record(&cpu->queue_delay, t, (now > ready_since) ? now - ready_since : 0);
+
+    if (woken_at != 0)
+        latency_record(&cpu->wakeup_latency, t, (now > woken_at) ? now - woken_at : 0);
+
+    spinlock_release(&cpu->latency_lock);
+}
+
+static void stats_switch_out(sched_thread* t, uint64 now, bool preempted)
+{
+    spinlock_acquire(&t->stats_lock);
+
+    if (t->run_start != 0 && now > t->run_start)
+        t->stats.run_cycles += now - t->run_start;
+
+    t->run_start = 0;
+
+    if (preempted)
+        t->stats.involuntary_switches++;
+    else
+        t->stats.voluntary_switches++;
+
+    spinlock_release(&t->stats_lock);
+}
+
+// Adds a thread to the run queue of the given processor. Returns true if the thread is more deserving
+// than the thread that processor is currently running, and should preempt it.
+static bool run_queue_insert(sched_cpu_state* cpu, sched_thread* t, bool wakeup)
+{
+    bool preempt;
+
+    // Threads that are only being moved between run queues keep waiting from when they first
+    // became ready
+    if (t->status != STS_READY)
+        stats_ready(t, wakeup);
+
+    spinlock_acquire(&cpu->run_queue_lock);
+
+    t->status = STS_READY;
+    t->queued_on = cpu->index + 1;
+
+    if (SCHED_PRIO_IS_RT(t->priority))
+    {
+        sched_thread_enqueue(&cpu->rt_queue.queues[t->priority], t);
+        cpu->rt_queue.bitmap |= 1u << t->priority;
+
+        preempt = t->priority < cpu->current_prio;
+    }
+    else
+    {
+        if (wakeup && t->vruntime + FAIR_SLEEPER_CREDIT < cpu->min_vruntime)
+            t->vruntime = cpu->min_vruntime - FAIR_SLEEPER_CREDIT;
+
+        t->queued_weight = fair_weight_of(t->priority);
+        rbtree_insert(&cpu->fair_tree, &t->fair_node, fair_less);
+        cpu->fair_weight += t->queued_weight;
+
+        preempt = wakeup && cpu->current_prio == SCHED_PRIO_FAIR_MAX && t->vruntime + FAIR_WAKEUP_GRANULARITY < cpu->current_vruntime;
+    }
+
+    cpu->num_ready++;
+
+    spinlock_release(&cpu->run_queue_lock);
+
+    return preempt;
+}
+
+static void run_queue_push(sched_cpu_state* cpu, sched_thread* t)
+{
+    run_queue_insert(cpu, t, false);
+}
+
+// Must be called with run_queue_lock held after a thread has been removed from the run queue
+static inline void run_queue_taken(sched_cpu_state* cpu, sched_thread* t)
+{
+    t->queued_on = 0;
+    cpu->num_ready--;
+}
+
+static sched_thread* run_queue_pop(sched_cpu_state* cpu)
+{
+    sched_thread* t;
+
+    spinlock_acquire(&cpu->run_queue_lock);
+
+    // A thread can end up here just before being restricted to other processors, and still gets to
+    // run here once rather than waiting for one of them to steal it
+    if ((t = prio_array_take(&cpu->rt_queue, false, SCHED_AFFINITY_ALL)) == NULL)
+        t = fair_take(cpu, false, SCHED_AFFINITY_ALL);
+
+    if (t != NULL)
+        run_queue_taken(cpu, t);
+
+    spinlock_release(&cpu->run_queue_lock);
+
+    return t;
+}
+
+// Removes a thread from the run queue of another processor so that it can be run on this one, whose
+// state is given by dest. Threads that are cache-cold are preferred, since moving them costs the
+// least, and fair threads are looked at first, since they would otherwise have to wait the longest.
+// If all of the threads are cache-hot, the most important one is taken only if allow_hot is set.
+// Threads that aren't allowed to run on this processor are always left alone.
+static sched_thread* run_queue_steal(sched_cpu_state* cpu, sched_cpu_state* dest, bool allow_hot)
+{
+    uint32 self = 1u << smp_cpu_index();
+    unsigned long long min_vruntime;
+    sched_thread* t;
+
+    // This processor's minimum is protected by its own run queue lock, and only one run queue lock is
+    // ever held at a time
+    spinlock_acquire(&dest->run_queue_lock);
+    min_vruntime = dest->min_vruntime;
+    spinlock_release(&dest->run_queue_lock);
+
+    spinlock_acquire(&cpu->run_queue_lock);
+
+    if ((t = fair_take(cpu, true, self)) == NULL && (t = prio_array_take(&cpu->rt_queue, true, self)) == NULL && allow_hot)
+    {
+        if ((t = prio_array_take(&cpu->rt_queue, false, self)) == NULL)
+            t = fair_take(cpu, false, self);
+    }
+
+    if (t != NULL)
+    {
+        run_queue_taken(cpu, t);
+
+        // Virtual runtimes are only comparable between threads on the same processor, so the stolen
+        // thread keeps its distance from the other processor's minimum rather than its value.
+        if (!SCHED_PRIO_IS_RT(t->priority))
+        {
+            long long lag = (long long)(t->vruntime - cpu->min_vruntime);
+
+            t->vruntime = (lag < 0 && (unsigned long long)-lag > min_vruntime) ? 0 : min_vruntime + (unsigned long long)lag;
+        }
+    }
+
+    spinlock_release(&cpu->run_queue_lock);
+
+    return t;
+}
+
+static void notify_cpu(uint32 target, uint32 self, bool preempt);
+
+// Puts the thread that was running on this processor back on its run queue, unless the thread is no
+// longer allowed to run here, in which case it goes to a processor that it is allowed on instead
+static void run_queue_put_back(sched_cpu_state* cpu, sched_thread* t)
+{
+    uint32 target;
+
+    if (thread_allowed_on(t, cpu->index))
+    {
+        run_queue_insert(cpu, t, false);
+        return;
+    }
+
+    target = select_cpu(t, cpu->index);
+    notify_cpu(target, cpu->index, run_queue_insert(cpu_state_of(target), t, false));
+}
+
+// Takes a thread out of the middle of the given processor's run queue. Must be called with
+// run_queue_lock held.
+static void run_queue_remove(sched_cpu_state* cpu, sched_thread* t)
+{
+    if (t->in_queue != NULL)
+    {
+        uint32 prio = (uint32)(t->in_queue - cpu->rt_queue.queues);
+        sched_thread* prev = NULL;
+
+        if (t->in_queue->first != t)
+            for (prev = t->in_queue->first; prev->next_in_queue != t; prev = prev->next_in_queue) ;
+
+        prio_array_remove(&cpu->rt_queue, prio, prev, t);
+    }
+    else
+    {
+        fair_remove(cpu, t);
+    }
+
+    run_queue_taken(cpu, t);
+}
+
+// Takes a thread that is waiting to run off of whichever run queue it is in. Returns the index of the
+// processor whose run queue it was in, plus one, or zero if it wasn't waiting to run.
+static uint32 run_queue_unqueue(sched_thread* t)
+{
+    sched_cpu_state* cpu;
+    uint32 queued_on;
+
+    // The thread can be moved to another processor's run queue until that run queue's lock is held
+    while ((queued_on = __atomic_load_n(&t->queued_on, __ATOMIC_ACQUIRE)) != 0)
+    {
+        cpu = cpu_state_of(queued_on - 1);
+        spinlock_acquire(&cpu->run_queue_lock);
+
+        if (t->queued_on != queued_on)
+        {
+            spinlock_release(&cpu->run_queue_lock);
+            continue;
+        }
+
+        run_queue_remove(cpu, t);
+
+        spinlock_release(&cpu->run_queue_lock);
+        break;
+    }
+
+    return queued_on;
+}
+
+// Takes the thread that the current thread yielded to off of this processor's run queue, unless
+// another processor has stolen it in the meantime or a more important thread is also waiting here
+static sched_thread* run_queue_take_yield_to(sched_cpu_state* cpu)
+{
+    sched_thread* t = cpu->yield_to;
+    uint32 more_important;
+
+    cpu->yield_to = NULL;
+
+    if (t == NULL)
+        return NULL;
+
+    spinlock_acquire(&cpu->run_queue_lock);
+
+    more_important = SCHED_PRIO_IS_RT(t->priority) ? cpu->rt_queue.bitmap & ((1u << t->priority) - 1) : cpu->rt_queue.bitmap;
+
+    if (t->queued_on == cpu->index + 1 && more_important == 0)
+        run_queue_remove(cpu, t);
+    else
+        t = NULL;
+
+    spinlock_release(&cpu->run_queue_lock);
+
+    return t;
+}
+
+// Puts a thread that was preempted back on this processor's run queue. A real-time thread that still
+// has some of its time slice left keeps it, so that being preempted by a more important thread does
+// not cost it its place in the round-robin.
+static void run_queue_requeue(sched_cpu_state* cpu, sched_thread* t, uint32 elapsed)
+{
+    if (SCHED_PRIO_IS_RT(t->priority))
+    {
+#ifndef SCHED_NO_PREEMPT
+        if (cpu->ticks_until_preempt > elapsed)
+            t->time_slice = cpu->ticks_until_preempt - elapsed;
+        else
+#endif
+            t->time_slice = TICKS_BEFORE_PREEMPT;
+    }
+
+    cpu->switch_preempted = true;
+    run_queue_put_back(cpu, t);
+}
+
+// Records which thread is now running on this processor (NULL if it is idle) and how long it may run
+// for. Fair threads split TICKS_FAIR_PERIOD between them according to their weights.
+static void run_queue_set_current(sched_cpu_state* cpu, sched_thread* t)
+{
+    uint32 slice = 1;
+
+    spinlock_acquire(&cpu->run_queue_lock);
+
+    if (t == NULL)
+    {
+        cpu->current_prio = SCHED_PRIO_IDLE;
+    }
+    else if (SCHED_PRIO_IS_RT(t->priority))
+    {
+        cpu->current_prio = t->priority;
+        slice = t->time_slice;
+    }
+    else
+    {
+        uint32 weight = fair_weight_of(t->priority);
+
+        cpu->current_prio = SCHED_PRIO_FAIR_MAX;
+        cpu->current_vruntime = t->vruntime;
+        update_min_vruntime(cpu);
+
+        if ((slice = TICKS_FAIR_PERIOD * weight / (cpu->fair_weight + weight)) == 0)
+            slice = 1;
+    }
+
+    spinlock_release(&cpu->run_queue_lock);
+
+#ifndef SCHED_NO_PREEMPT
+    cpu->ticks_until_preempt = slice;
+#endif
+}
+
+// Charges the running thread for the ticks that it has spent running
+static void run_queue_account(sched_cpu_state* cpu, uint32 elapsed)
+{
+    sched_thread* t = cpu->current_thread;
+
+    if (t == NULL)
+        return;
+
+    if (SCHED_PRIO_IS_RT(t->priority))
+        return;
+
+    t->vruntime += (unsigned long long)elapsed * (FAIR_VRUNTIME_PER_TICK * FAIR_WEIGHT_DEFAULT / fair_weight_of(t->priority));
+
+    spinlock_acquire(&cpu->run_queue_lock);
+
+    if (cpu->current_prio == SCHED_PRIO_FAIR_MAX)
+    {
+        cpu->current_vruntime = t->vruntime;
+        update_min_vruntime(cpu);
+    }
+
+    spinlock_release(&cpu->run_queue_lock);
+}
+
+static sched_cpu_state* find_busiest_cpu(uint32 self, uint32 min_ready)
+{
+    sched_cpu_state* busiest = NULL;
+    uint32 busiest_ready = min_ready;
+    uint32 i;
+
+    for (i = 0; i < smp_num_cpus; i++)
+    {
+        sched_cpu_state* cpu;
+        uint32 num_ready;
+
+        if (i == self || !smp_cpus[i].online)
+            continue;
+
+        cpu = cpu_state_of(i);
+        num_ready = cpu->num_ready;
+
+        if (num_ready >= busiest_ready)
+        {
+            busiest = cpu;
+            busiest_ready = num_ready;
+        }
+    }
+
+    return busiest;
+}
+
+static void send_reschedule(uint32 cpu)
+{
+    // A processor that is polling or waiting in MWAIT only needs to see the write
+    if (idle_wake(cpu))
+        return;
+
+    // Without a local APIC there is only one processor, which notices new threads on its next tick
+    if (apic_enabled)
+        apic_send_ipi(smp_cpus[cpu].apic_id, APIC_ICR_DELIVERY_FIXED | SCHED_RESCHEDULE_VECTOR);
+}
+
+// Wakes up an idle processor other than the given ones so that it can steal a thread
+static void kick_idle_cpu(uint32 exclude_a, uint32 exclude_b)
+{
+    uint32 idle = idle_cpus & ~((1u << exclude_a) | (1u << exclude_b));
+
+    if (idle != 0)
+        send_reschedule((uint32)__builtin_ctz(idle));
+}
+
+static void timekeeper_restart(sched_cpu_state* cpu);
+
+// Lets a processor know that a thread was placed on its run queue. If the thread should preempt the
+// thread that processor is running, it is told to reschedule. If it is busy anyway, an idle processor
+// is woken up instead so that it can steal the thread.
+static void notify_cpu(uint32 target, uint32 self, bool preempt)
+{
+    if ((idle_cpus & (1u << target)) != 0)
+    {
+        send_reschedule(target);
+    }
+#ifndef SCHED_NO_PREEMPT
+    else if (preempt)
+    {
+        // Without a local APIC, the preemption happens at the next preemption point or tick instead
+        *percpu_ptr_cpu(sched_need_resched, target) = true;
+        send_reschedule(target);
+    }
+#endif
+    else if (smp_num_online > 1)
+    {
+        kick_idle_cpu(target, self);
+    }
+}
+
+// Places a thread that has become ready on the run queue picked by select_cpu
+static void make_ready(sched_thread* t)
+{
+    uint32 self = smp_cpu_index();
+    uint32 target;
+
+    t->woken_at = tsc_read();
+    target = select_cpu(t, self);
+
+    // If the timekeeper's tick is stopped, every processor is idle and nobody has been keeping
+    // track of time. It must be caught up before another processor starts running a thread.
+    if (target != self && self == TIMEKEEPER_CPU && this_cpu()->tick_stopped)
+        timekeeper_restart(this_cpu());
+
+    notify_cpu(target, self, run_queue_insert(cpu_state_of(target), t, true));
+
+    if (t->worker != NULL)
+        workqueue_worker_waking(t);
+}
+
+// A thread that is waiting with a timeout is only woken up here if it is still in its wait queue.
+// Otherwise, whoever dequeued it is responsible for waking it up. Tick-based timers are run from the
+// timer softirq with interrupts enabled, but make_ready must be called with them disabled.
+static void sleep_timer_expired(void* arg)
+{
+    sched_thread* t = arg;
+    sched_thread_queue* queue = t->wait_queue;
+    uint32 eflags = eflags_save();
+
+    asm volatile ("cli");
+
+    if (queue != NULL)
+    {
+        spinlock_acquire(&queue->lock);
+
+        if (t->in_queue != queue)
+        {
+            spinlock_release(&queue->lock);
+            eflags_load(eflags);
+            return;
+        }
+
+        sched_thread_queue_remove(queue, t);
+        t->wait_timed_out = true;
+
+        spinlock_release(&queue->lock);
+    }
+
+    make_ready(t);
+
+    eflags_load(eflags);
+}
+
+static sched_thread* steal_thread(void)
+{
+    sched_cpu_state* busiest;
+
+    if (smp_num_online <= 1 || (busiest = find_busiest_cpu(smp_cpu_index(), 1)) == NULL)
+        return NULL;
+
+    return run_queue_steal(busiest, this_cpu(), true);
+}
+
+// Pulls cache-cold threads from the busiest processor until both run queues are roughly the same
+// length. Cache-hot threads are left alone, since idle processors will steal them anyway if they
+// would otherwise go unused.
+static void rebalance(sched_cpu_state* cpu)
+{
+    sched_cpu_state* busiest;
+    uint32 num_ready = cpu->num_ready;
+    uint32 busiest_ready;
+    uint32 num_to_move;
+    sched_thread* t;
+
+    if (smp_num_online <= 1 || (busiest = find_busiest_cpu(smp_cpu_index(), num_ready + 2)) == NULL)
+        return;
+
+    // The busiest run queue may have shrunk since it was found
+    if ((busiest_ready = busiest->num_ready) <= num_ready)
+        return;
+
+    for (num_to_move = (busiest_ready - num_ready) / 2; num_to_move > 0; num_to_move--)
+    {
+        if ((t = run_queue_steal(busiest, cpu, false)) == NULL)
+            break;
+
+        run_queue_push(cpu, t);
+    }
+}
+
+// Must only be called on the timekeeping processor with interrupts disabled. Expired timers are
+// run from the timer softirq rather than right away.
+static void advance_ticks(uint32 elapsed)
+{
+    ticks += elapsed;
+    time_page_tick(ticks);
+
+    if (timer_next_expiry() <= ticks)
+        softirq_raise(SOFTIRQ_TIMER);
+}
+
+// Only the timekeeping processor ever raises the timer softirq
+static void run_timers(void)
+{
+    uint32 eflags = eflags_save();
+    unsigned long long now;
+
+    asm volatile ("cli");
+    now = ticks;
+    eflags_load(eflags);
+
+    timer_run(now);
+}
+
+// Gets the number of whole ticks that have passed since the current one-shot event was armed and
+// that have not already been returned by a previous call.
+static uint32 tick_oneshot_elapsed(sched_cpu_state* cpu)
+{
+    uint32 counts;
+    uint32 elapsed;
+
+    if (cpu->tick_oneshot_counts == 0)
+        return 0;
+
+    counts = cpu->tick_oneshot_counts - apic_timer_get_current() - cpu->tick_oneshot_accounted;
+    elapsed = counts / tick_counts;
+
+    cpu->tick_oneshot_accounted += elapsed * tick_counts;
+    return elapsed;
+}
+
+static void tick_oneshot_arm(sched_cpu_state* cpu, uint64 nticks)
+{
+    uint32 partial = 0;
+
+    // The part of a tick that passed during the previous event is carried over, so that the
+    // timekeeper does not lose time by repeatedly re-arming the timer.
+    if (cpu->tick_oneshot_counts != 0)
+    {
+        tick_oneshot_elapsed(cpu);
+        partial = cpu->tick_oneshot_counts - apic_timer_get_current() - cpu->tick_oneshot_accounted;
+    }
+
+    if (nticks > 0xFFFFFFFF / tick_counts - 1)
+        nticks = 0xFFFFFFFF / tick_counts - 1;
+    else if (nticks == 0)
+        nticks = 1;
+
+    cpu->tick_oneshot_counts = (uint32)nticks * tick_counts - partial;
+    cpu->tick_oneshot_accounted = 0 - partial;
+
+    apic_timer_set_oneshot(APIC_TIMER_VECTOR, cpu->tick_oneshot_counts);
+}
+
+static void tick_start_periodic(sched_cpu_state* cpu)
+{
+    cpu->tick_oneshot_counts = 0;
+    apic_timer_set_periodic(APIC_TIMER_VECTOR, tick_counts);
+}
+
+// Catches up on the ticks that passed while the timekeeper's tick was stopped and starts ticking
+// periodically again. Must be called on the timekeeping processor.
+static void timekeeper_restart(sched_cpu_state* cpu)
+{
+    uint32 elapsed;
+
+    if (!cpu->tick_stopped)
+        return;
+
+    elapsed = tick_oneshot_elapsed(cpu);
+
+    cpu->tick_stopped = false;
+    __atomic_store_n(&timekeeper_stopped, false, __ATOMIC_SEQ_CST);
+    tick_start_periodic(cpu);
+
+    advance_ticks(elapsed);
+}
+
+static bool all_cpus_idle(void)
+{
+    uint32 i;
+
+    for (i = 0; i < smp_num_cpus; i++)
+    {
+        if (!smp_cpus[i].online)
+            continue;
+
+        if ((idle_cpus & (1u << i)) == 0 || cpu_state_of(i)->num_ready != 0)
+            return false;
+    }
+
+    return true;
+}
+
+// Stops the timekeeper's periodic tick if every processor is idle, in which case nothing can read
+// ticks until the timekeeper wakes up again. The one-shot timer is then armed for the next pending
+// timer, and is also used to find out how much time passed when the timekeeper is woken early.
+static void timekeeper_idle(sched_cpu_state* cpu)
+{
+    unsigned long long next;
+
+    if (cpu->tick_stopped)
+        advance_ticks(tick_oneshot_elapsed(cpu));
+
+    __atomic_store_n(&timekeeper_stopped, true, __ATOMIC_SEQ_CST);
+
+    if (!all_cpus_idle())
+    {
+        __atomic_store_n(&timekeeper_stopped, false, __ATOMIC_SEQ_CST);
+
+        if (cpu->tick_stopped)
+        {
+            cpu->tick_stopped = false;
+            tick_start_periodic(cpu);
+        }
+
+        return;
+    }
+
+    next = timer_next_expiry();
+
+    cpu->tick_stopped = true;
+    tick_oneshot_arm(cpu, (next == ~0ull) ? next : (next > ticks) ? next - ticks : 1);
+}
+
+// Reprograms the local APIC timer after this processor has switched threads or handled a tick. Must
+// be called with interrupts disabled.
+static void tick_update(sched_cpu_state* cpu)
+{
+    uint32 self = smp_cpu_index();
+    uint32 next_event;
+
+    if (cpu->current_thread == NULL)
+    {
+        __atomic_fetch_or(&idle_cpus, 1u << self, __ATOMIC_SEQ_CST);
+
+        if (tick_counts == 0)
+            return;
+
+        // Other idle processors don't need a tick at all, since they are sent a reschedule IPI when
+        // there is something for them to do.
+        if (self == TIMEKEEPER_CPU)
+        {
+            timekeeper_idle(cpu);
+        }
+        else if (!cpu->tick_stopped)
+        {
+            cpu->tick_stopped = true;
+            cpu->tick_oneshot_counts = 0;
+            apic_timer_stop();
+        }
+
+        return;
+    }
+
+    __atomic_fetch_and(&idle_cpus, ~(1u << self), __ATOMIC_SEQ_CST);
+
+    if (tick_counts == 0)
+        return;
+
+    if (self == TIMEKEEPER_CPU)
+    {
+        timekeeper_restart(cpu);
+        return;
+    }
+
+    // The timekeeper may have decided to stop its tick just before this processor became busy
+    if (__atomic_load_n(&timekeeper_stopped, __ATOMIC_SEQ_CST))
+        send_reschedule(TIMEKEEPER_CPU);
+
+#ifndef SCHED_NO_PREEMPT
+    next_event = (cpu->ticks_until_preempt < cpu->ticks_until_rebalance) ? cpu->ticks_until_preempt : cpu->ticks_until_rebalance;
+#else
+    next_event = cpu->ticks_until_rebalance;
+#endif
+
+    cpu->tick_stopped = false;
+    cpu->tick_oneshot_counts = 0;
+    tick_oneshot_arm(cpu, next_event);
+}
+
+// Returns true if the scheduler was invoked to switch threads
+static bool sched_tick(regs32_t* r, uint32 elapsed)
+{
+    sched_cpu_state* cpu = this_cpu();
+
+    if (cpu->ticks_until_rebalance <= elapsed)
+    {
+        cpu->ticks_until_rebalance = TICKS_BETWEEN_REBALANCE;
+        rebalance(cpu);
+    }
+    else
+    {
+        cpu->ticks_until_rebalance -= elapsed;
+    }
+
+    run_queue_account(cpu, elapsed);
+
+#ifndef SCHED_NO_PREEMPT
+    if (cpu->ticks_until_preempt > elapsed && !percpu_read(sched_need_resched))
+    {
+        cpu->ticks_until_preempt -= elapsed;
+    }
+    else
+#else
+    if (cpu->current_thread == NULL)
+#endif
+    {
+        sched_thread* current_thread = cpu->current_thread;
+
+        // The switch has to wait for the next preemption point if the interrupted code can't be
+        // preempted
+        if (!irq_preemptible())
+        {
+            percpu_write(sched_need_resched, true);
+            return false;
+        }
+
+        if (current_thread != NULL && current_thread->status != STS_DEAD)
+            run_queue_requeue(cpu, current_thread, elapsed);
+
+        sched_switch_any(r);
+        return true;
+    }
+
+    return false;
+}
+
+static void pit_tick_handle(regs32_t* r)
+{
+    // The PIT is only ever delivered to the bootstrap processor, so it is responsible for keeping
+    // track of time and waking sleeping threads until the dynamic tick is enabled.
+    advance_ticks(1);
+    sched_tick(r, 1);
+}
+
+static void apic_timer_tick_handle(regs32_t* r)
+{
+    sched_cpu_state* cpu = this_cpu();
+    uint32 elapsed;
+
+    apic_eoi();
+
+    elapsed = (cpu->tick_oneshot_counts == 0) ? 1 : tick_oneshot_elapsed(cpu);
+
+    if (tick_counts != 0 && smp_cpu_index() == TIMEKEEPER_CPU)
+        advance_ticks(elapsed);
+
+    if (!sched_tick(r, elapsed))
+        tick_update(cpu);
+}
+
+// Gets the number of nanoseconds until this idle processor's own timer wakes it up. Only the
+// timekeeper keeps its timer running while all processors are idle, and only until the next timer
+// expires.
+static uint64 idle_next_event_ns(sched_cpu_state* cpu)
+{
+    unsigned long long next;
+
+    if (!cpu->tick_stopped)
+        return NANOSECONDS_PER_TICK;
+
+    if (smp_cpu_index() != TIMEKEEPER_CPU || (next = timer_next_expiry()) == ~0ull)
+        return SCHED_NO_TIMEOUT;
+
+    return (next > ticks) ? (next - ticks) * NANOSECONDS_PER_TICK : 0;
+}
+
+// The idle thread starts over from here every time the processor becomes idle. A processor that is
+// woken up by idle_wake rather than by a reschedule interrupt calls into the scheduler itself.
+void sched_idle(void)
+{
+    asm volatile ("cli");
+
+    while (true)
+    {
+        if (idle_enter(idle_next_event_ns(this_cpu())))
+            asm volatile ("int %0" : : "i" (CONTEXT_SWITCH_INTERRUPT));
+    }
+}
+
+static void yield_interrupt_handle(regs32_t* r)
+{
+    sched_switch_any(r);
+}
+
+static void reschedule_interrupt_handle(regs32_t* r)
+{
+    sched_cpu_state* cpu = this_cpu();
+
+    apic_eoi();
+
+    if (!irq_preemptible())
+    {
+        if (cpu->current_thread == NULL)
+            percpu_write(sched_need_resched, true);
+
+        return;
+    }
+
+    // Another processor made a thread ready while this one was idle, so look for it right away
+    // rather than waiting for the next tick.
+    if (cpu->current_thread == NULL)
+    {
+        sched_switch_any(r);
+    }
+#ifndef SCHED_NO_PREEMPT
+    else if (percpu_read(sched_need_resched))
+    {
+        if (cpu->current_thread->status != STS_DEAD)
+            run_queue_requeue(cpu, cpu->current_thread, 0);
+
+        sched_switch_any(r);
+    }
+#endif
+}
+
+void sched_irq_exit(regs32_t* r, bool interrupts_enabled)
+{
+    sched_cpu_state* cpu = this_cpu();
+
+    if (!percpu_read(sched_need_resched) || preempt_count_read() != 0 || !interrupts_enabled)
+        return;
+
+    if (cpu->current_thread == NULL)
+    {
+        sched_switch_any(r);
+    }
+#ifndef SCHED_NO_PREEMPT
+    else if (cpu->current_thread->status == STS_RUNNING)
+    {
+        run_queue_requeue(cpu, cpu->current_thread, 0);
+        sched_switch_any(r);
+    }
+#endif
+}
+
+void sched_preempt(void)
+{
+#ifndef SCHED_NO_PREEMPT
+    uint32 eflags = eflags_save();
+    sched_cpu_state* cpu;
+
+    // Code that disabled interrupts without taking a spinlock can't be preempted either. This is also
+    // what keeps the spinlocks taken below from calling back in here.
+    if ((eflags & EFLAGS_IF) == 0)
+        return;
+
+    asm volatile ("cli");
+
+    cpu = this_cpu();
+
+    // A thread that has already set itself up to block is about to give up the processor anyway
+    if (percpu_read(sched_need_resched) && preempt_count_read() == 0 && cpu->current_thread != NULL
+        && cpu->current_thread->status == STS_RUNNING)
+    {
+        run_queue_requeue(cpu, cpu->current_thread, 0);
+        sched_yield();
+    }
+
+    eflags_load(eflags);
+#endif
+}
+
+static sched_thread* create_idle_thread(void* stack_low, void* stack_high)
+{
+    sched_thread* t = alloc_init_thread(NULL);
+
+    if (t == NULL)
+        return NULL;
+
+    t->stack_low = stack_low;
+    t->stack_high = stack_high;
+    init_registers(&t->registers, (uint32)stack_high, (uint32)sched_idle);
+
+    return t;
+}
+
+void sched_init(const boot_param* param)
+{
+    sched_cpu_state* cpu = this_cpu();
+    void* idle_stack;
+
+    spinlock_init(&process_list_spinlock);
+    spinlock_init(&hash_lock);
+    spinlock_init(&priority_lock);
+
+    kmem_pool_small_init(&process_pool, "sched_process pool", sizeof(sched_process), __alignof__(sched_process), 0);
+    kmem_pool_small_init(&thread_pool, "sched_thread pool", sizeof(sched_thread), __alignof__(sched_thread), 0);
+    kmem_pool_small_never_compact(&process_pool);
+    kmem_pool_small_never_compact(&thread_pool);
+    kmem_pool_small_init(&process_address_space_pool, "sched_process page_context", sizeof(page_context), __alignof__(page_context), 0);
+
+    timer_init_wheel();
+    softirq_register(SOFTIRQ_TIMER, run_timers);
+
+    cpu->index = smp_cpu_index();
+
+    spinlock_init(&cpu->run_queue_lock);
+    spinlock_init(&cpu->latency_lock);
+    prio_array_init(&cpu->rt_queue);
+    rbtree_init(&cpu->fair_tree);
+    cpu->fair_weight = 0;
+    cpu->num_ready = 0;
+    cpu->min_vruntime = 0;
+    cpu->yield_to = NULL;
+    percpu_write(sched_need_resched, false);
+    cpu->ticks_until_rebalance = TICKS_BETWEEN_REBALANCE;
+
+    cpu->tick_stopped = false;
+    cpu->tick_oneshot_counts = 0;
+
+    cpu->current_process = first_process = kernel_process = alloc_init_process("kernel", &kernel_page_context);
+    if (cpu->current_process == NULL)
+        crash("Failed to initialize kernel process!");
+
+    cpu->current_thread = alloc_init_thread(first_process);
+    if (cpu->current_thread == NULL)
+        crash("Failed to initialize first kernel thread!");
+
+    cpu->current_thread->status = STS_RUNNING;
+    cpu->current_thread->registers_dirty = true;
+    stats_switch_in(NULL, cpu->current_thread, tsc_read());
+    cpu->current_prio = class_prio(cpu->current_thread->priority);
+    cpu->current_vruntime = 0;
+
+    // Each processor has its own idle thread with its own stack, since several processors may be
+    // idle at the same time.
+    idle_stack = kmem_stack_alloc();
+    if (idle_stack == NULL || (cpu->idle_thread = create_idle_thread(idle_stack, (uint8*)idle_stack + THREAD_STACK_SIZE)) == NULL)
+        crash("Failed to initialize idle thread!");
+
+#ifndef SCHED_NO_PREEMPT
+    cpu->ticks_until_preempt = TICKS_BEFORE_PREEMPT;
+#endif
+
+    // Register the PIT tick handler and enable the PIT
+    idt_register_irq_handler(0, pit_tick_handle);
+    pit_init(PIT_TICK_DIVISOR);
+    idt_set_irq_enabled(0, true);
+
+    // The context switch interrupt should NOT be callable from userspace and should disable interrupts
+    idt_set_ext_handler_flags(CONTEXT_SWITCH_INTERRUPT - IDT_EXT_START, 0x8E);
+    idt_register_ext_handler(CONTEXT_SWITCH_INTERRUPT - IDT_EXT_START, yield_interrupt_handle);
+
+    // Application processors use their local APIC timers for preemption instead of the PIT
+    idt_set_ext_handler_flags(APIC_TIMER_VECTOR - IDT_EXT_START, 0x8E);
+    idt_register_ext_handler(APIC_TIMER_VECTOR - IDT_EXT_START, apic_timer_tick_handle);
+
+    idt_set_ext_handler_flags(SCHED_RESCHEDULE_VECTOR - IDT_EXT_START, 0x8E);
+    idt_register_ext_handler(SCHED_RESCHEDULE_VECTOR - IDT_EXT_START, reschedule_interrupt_handle);
+}
+
+void sched_init_ap(void* stack_low, void* stack_high)
+{
+    sched_cpu_state* cpu = this_cpu();
+
+    cpu->index = smp_cpu_index();
+
+    cpu->current_process = NULL;
+    cpu->current_thread = NULL;
+    cpu->current_prio = SCHED_PRIO_IDLE;
+    cpu->yield_to = NULL;
+    percpu_write(sched_need_resched, false);
+
+    // The run queue is not initialized here, since other processors may already be looking at it
+    // to steal threads. The copy of the per-CPU template that this processor started with already
+    // holds an empty run queue.
+    cpu->ticks_until_rebalance = TICKS_BETWEEN_REBALANCE;
+
+    // The stack that this processor was started up on becomes the stack of its idle thread, since
+    // nothing on it will be needed once the first thread is scheduled.
+    if ((cpu->idle_thread = create_idle_thread(stack_low, stack_high)) == NULL)
+        crash("Failed to initialize idle thread!");
+
+#ifndef SCHED_NO_PREEMPT
+    cpu->ticks_until_preempt = 1;
+#endif
+
+    // With the dynamic tick, an idle processor doesn't need its timer until it is given a thread to
+    // run. Otherwise, it polls for threads to steal on every tick.
+    cpu->tick_stopped = false;
+    cpu->tick_oneshot_counts = 0;
+
+    if (tick_counts == 0)
+        apic_timer_set_periodic(APIC_TIMER_VECTOR, apic_timer_counts_per_ms * MILLISECONDS_PER_TICK);
+
+    tick_update(cpu);
+
+    asm volatile ("sti");
+    sched_idle();
+}
+
+void sched_tick_sync(void)
+{
+    uint32 eflags = eflags_save();
+    asm volatile ("cli");
+
+    if (smp_cpu_index() == TIMEKEEPER_CPU)
+        timekeeper_restart(this_cpu());
+
+    eflags_load(eflags);
+}
+
+void sched_enable_dynamic_tick(const boot_param* param)
+{
+    sched_cpu_state* cpu;
+    uint32 eflags;
+
+    if (!apic_enabled || apic_timer_counts_per_ms == 0)
+        return;
+
+    if (cmdline_get_bool(param, "no_dynamic_tick"))
+    {
+        klog(KLOG_LEVEL_INFO, "Dynamic tick disabled on the command line\n");
+        return;
+    }
+
+    eflags = eflags_save();
+    asm volatile ("cli");
+
+    cpu = this_cpu();
+    assert(smp_cpu_index() == TIMEKEEPER_CPU);
 
-    current_thread->registers_dirty = true;
-    sched_thread_dequeue(&current_process->thread_run_queue);
+    // The timekeeper switches over from the PIT to its local APIC timer, since that timer can be
+    // stopped and restarted without affecting any other processor.
+    tick_counts = apic_timer_counts_per_ms * MILLISECONDS_PER_TICK;
 
-    idle_thread = alloc_init_thread(NULL);
-    if (idle_thread == NULL)
-        crash("Failed to initialize idle thread!");
-    init_registers(&idle_thread->registers, (uint32)idle_thread->stack_high, (uint32) sched_idle);
+    idt_set_irq_enabled(PIT_IRQ, false);
+    tick_start_periodic(cpu);
 
-    // Register the PIT tick handler and enable the PIT
-    idt_register_irq_handler(0, pit_tick_handle);
-    pit_init(PIT_TICK_DIVISOR);
-    idt_set_irq_enabled(0, true);
+    eflags_load(eflags);
 
-    // The context switch interrupt should NOT be callable from userspace and should disable interrupts
-    idt_set_ext_handler_flags(CONTEXT_SWITCH_INTERRUPT - IDT_EXT_START, 0x8E);
-    idt_register_ext_handler(CONTEXT_SWITCH_INTERRUPT - IDT_EXT_START, yield_interrupt_handle);
+    klog(KLOG_LEVEL_INFO, "Dynamic tick enabled (%d APIC timer counts per tick)\n", tick_counts);
 }
 
 sched_process* sched_process_current(void)
 {
-    return current_process;
+    return __sched_process_current();
 }
 
 sched_thread* sched_thread_current(void)
 {
-    return current_thread;
+    return __sched_thread_current();
 }
 
+// These are single GS-relative loads, so they don't need interrupts to be disabled: the current
+// thread and process are the same no matter which processor the calling thread is running on.
 sched_process* __sched_process_current(void)
 {
-    return current_process;
+    return percpu_read(cpu_state.current_process);
 }
 
 sched_thread* __sched_thread_current(void)
 {
-    return current_thread;
+    return percpu_read(cpu_state.current_thread);
 }
 
 int sched_process_create(const char* name, sched_process** process)
@@ -285,8 +1763,9 @@ void sched_process_destroy(sched_process* process)
 
 int sched_thread_create(sched_process* process, sched_thread_function func, void* arg, sched_thread** thread)
 {
-    void** stack_low = kmem_page_global_alloc(PT_ENTRY_WRITEABLE | PT_ENTRY_NO_EXECUTE, 0, THREAD_STACK_SIZE / FRAME_SIZE);
+    void** stack_low = kmem_stack_alloc();
     void** stack_high = stack_low + THREAD_STACK_SIZE / sizeof(void*);
+    uint32 eflags;
 
     if (stack_low == NULL)
         return E_NO_MEMORY;
@@ -300,8 +1779,7 @@ int sched_thread_create(sched_process* process, sched_thread_function func, void
 
     if (t == NULL)
     {
-        spinlock_release(&process->lock);
-        kmem_page_global_free(stack_low, THREAD_STACK_SIZE / FRAME_SIZE);
+        kmem_stack_free(stack_low);
         return E_NO_MEMORY;
     }
 
@@ -309,6 +1787,13 @@ int sched_thread_create(sched_process* process, sched_thread_function func, void
     t->stack_low = stack_low;
     t->stack_high = stack_high;
 
+    // The thread can only be made ready once its registers are set up, since another processor may
+    // start running it immediately.
+    eflags = eflags_save();
+    asm volatile ("cli");
+    make_ready(t);
+    eflags_load(eflags);
+
     if (thread != NULL)
         *thread = t;
 
@@ -322,29 +1807,272 @@ void sched_thread_destroy(sched_thread* thread)
 
     assert(thread->in_queue == NULL);
     assert(thread->held_mutexes == NULL);
+    assert(!timer_is_pending(&thread->sleep_timer));
+    assert(!hrtimer_is_pending(&thread->sleep_hrtimer));
 
-    if (thread->stack_low != NULL)
-        kmem_page_global_free(thread->stack_low, THREAD_STACK_SIZE / FRAME_SIZE);
+    fpu_thread_destroy(thread);
 
-    if (thread->process->first_thread == thread)
-    {
+    stats_add(&thread->process->exited_stats, &thread->stats);
+
+    if (thread->prev_in_process == NULL)
         thread->process->first_thread = thread->next_in_process;
-    }
     else
-    {
-        sched_thread* prev_thread;
+        thread->prev_in_process->next_in_process = thread->next_in_process;
 
-        for (prev_thread = thread->process->first_thread; prev_thread != NULL && prev_thread->next_in_process != thread; prev_thread = prev_thread->next_in_process) ;
+    if (thread->next_in_process != NULL)
+        thread->next_in_process->prev_in_process = thread->prev_in_process;
 
-        if (prev_thread != NULL)
-            prev_thread->next_in_process = thread->next_in_process;
-    }
+    hash_remove_thread(thread);
 
     klog(KLOG_LEVEL_DEBUG, "Destroyed thread %ld under process %ld (%s)\n", thread->tid, thread->process->pid, thread->process->name);
 
     kmem_pool_small_free(&thread_pool, thread);
 }
 
+void sched_thread_get_stats(sched_thread* thread, sched_stats* stats)
+{
+    uint64 now = tsc_read();
+
+    spinlock_acquire(&thread->stats_lock);
+
+    *stats = thread->stats;
+
+    if (thread->run_start != 0 && now > thread->run_start)
+        stats->run_cycles += now - thread->run_start;
+
+    if (thread->ready_since != 0 && now > thread->ready_since)
+        stats->wait_cycles += now - thread->ready_since;
+
+    spinlock_release(&thread->stats_lock);
+}
+
+void sched_process_get_stats(sched_process* process, sched_stats* stats)
+{
+    sched_thread* t;
+    sched_stats thread_stats;
+
+    spinlock_acquire(&process->lock);
+
+    *stats = process->exited_stats;
+
+    for (t = process->first_thread; t != NULL; t = t->next_in_process)
+    {
+        sched_thread_get_stats(t, &thread_stats);
+        stats_add(stats, &thread_stats);
+    }
+
+    spinlock_release(&process->lock);
+}
+
+static uint64 cycles_to_ns(uint64 cycles)
+{
+    uint64 mhz = tsc_frequency / 1000000;
+
+    return (mhz != 0) ? cycles * 1000 / mhz : cycles;
+}
+
+static void latency_dump_hist(uint32 cpu, const char* name, const latency_hist* h)
+{
+    uint32 i;
+
+    if (h->count == 0)
+    {
+        klog(KLOG_LEVEL_INFO, "cpu%u %s: no samples\n", cpu, name);
+        return;
+    }
+
+    klog(KLOG_LEVEL_INFO, "cpu%u %s: %ld samples, avg %ld ns, max %ld ns (p%ld, t%ld)\n",
+        cpu, name, h->count, cycles_to_ns(h->total_cycles / h->count), cycles_to_ns(h->max_cycles),
+        h->max_pid, h->max_tid);
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        if (h->buckets[i] == 0)
+            continue;
+
+        if (i == LATENCY_BUCKETS - 1)
+            klog(KLOG_LEVEL_INFO, "  >= %ld ns: %u\n", cycles_to_ns(1ull << i), h->buckets[i]);
+        else
+            klog(KLOG_LEVEL_INFO, "  %ld - %ld ns: %u\n", cycles_to_ns((i == 0) ? 0 : 1ull << i), cycles_to_ns(1ull << (i + 1)), h->buckets[i]);
+    }
+}
+
+void sched_latency_dump(void)
+{
+    latency_hist wakeup_latency;
+    latency_hist queue_delay;
+    sched_cpu_state* cpu;
+    uint32 i;
+
+    if (tsc_frequency == 0)
+        klog(KLOG_LEVEL_INFO, "The TSC frequency is unknown, so latencies are in TSC cycles\n");
+
+    for (i = 0; i < smp_num_cpus; i++)
+    {
+        if (!smp_cpus[i].online)
+            continue;
+
+        cpu = cpu_state_of(i);
+
+        // The histograms are copied out first so that the lock isn't held while logging
+        spinlock_acquire(&cpu->latency_lock);
+        wakeup_latency = cpu->wakeup_latency;
+        queue_delay = cpu->queue_delay;
+        spinlock_release(&cpu->latency_lock);
+
+        latency_dump_hist(i, "wakeup latency", &wakeup_latency);
+        latency_dump_hist(i, "run queue delay", &queue_delay);
+    }
+}
+
+void sched_latency_reset(void)
+{
+    sched_cpu_state* cpu;
+    uint32 i;
+
+    for (i = 0; i < smp_num_cpus; i++)
+    {
+        if (!smp_cpus[i].online)
+            continue;
+
+        cpu = cpu_state_of(i);
+
+        spinlock_acquire(&cpu->latency_lock);
+        memset(&cpu->wakeup_latency, 0, sizeof(cpu->wakeup_latency));
+        memset(&cpu->queue_delay, 0, sizeof(cpu->queue_delay));
+        spinlock_release(&cpu->latency_lock);
+    }
+}
+
+// Must be called with priority_lock held
+static void update_priority(sched_thread* thread)
+{
+    uint32 priority = (thread->inherited_priority < thread->base_priority) ? thread->inherited_priority : thread->base_priority;
+    sched_cpu_state* cpu;
+    uint32 queued_on;
+
+    if (priority == thread->priority)
+        return;
+
+    if ((queued_on = run_queue_unqueue(thread)) != 0)
+    {
+        thread->priority = priority;
+        thread->time_slice = TICKS_BEFORE_PREEMPT;
+
+        notify_cpu(queued_on - 1, smp_cpu_index(), run_queue_insert(cpu_state_of(queued_on - 1), thread, false));
+        return;
+    }
+
+    thread->priority = priority;
+
+    // A thread that is running on another processor may be boosted by a thread that blocks on one of
+    // its mutexes, and that processor must then not let less important threads preempt it
+    if (thread->status == STS_RUNNING && thread->last_cpu < smp_num_cpus)
+    {
+        cpu = cpu_state_of(thread->last_cpu);
+        spinlock_acquire(&cpu->run_queue_lock);
+
+        if (thread == cpu->current_thread)
+        {
+            cpu->current_prio = class_prio(priority);
+            cpu->current_vruntime = thread->vruntime;
+        }
+
+        spinlock_release(&cpu->run_queue_lock);
+    }
+}
+
+int sched_thread_set_priority(sched_thread* thread, uint32 priority)
+{
+    if (priority >= SCHED_NUM_PRIORITIES)
+        return E_INVALID;
+
+    spinlock_acquire(&priority_lock);
+
+    thread->base_priority = priority;
+    update_priority(thread);
+
+    spinlock_release(&priority_lock);
+
+    return E_SUCCESS;
+}
+
+int sched_thread_set_affinity(sched_thread* thread, uint32 mask)
+{
+    uint32 online = 0;
+    uint32 queued_on;
+    uint32 target;
+    bool move_self = false;
+    uint32 eflags;
+    uint32 i;
+
+    for (i = 0; i < smp_num_cpus; i++)
+    {
+        if (smp_cpus[i].online)
+            online |= 1u << i;
+    }
+
+    if ((mask & online) == 0)
+        return E_INVALID;
+
+    spinlock_acquire(&priority_lock);
+
+    thread->affinity = mask;
+
+    if ((queued_on = run_queue_unqueue(thread)) != 0)
+    {
+        target = thread_allowed_on(thread, queued_on - 1) ? queued_on - 1 : select_cpu(thread, smp_cpu_index());
+        notify_cpu(target, smp_cpu_index(), run_queue_insert(cpu_state_of(target), thread, false));
+    }
+    else if (thread->status == STS_RUNNING && !thread_allowed_on(thread, thread->last_cpu))
+    {
+        // A running thread is moved when it is put back on a run queue, which happens right away if it
+        // is this thread. Otherwise, the processor that it is running on is told to preempt it.
+        if (thread == this_cpu()->current_thread)
+        {
+            move_self = true;
+        }
+#ifndef SCHED_NO_PREEMPT
+        else if (thread->last_cpu < smp_num_cpus)
+        {
+            *percpu_ptr_cpu(sched_need_resched, thread->last_cpu) = true;
+            send_reschedule(thread->last_cpu);
+        }
+#endif
+    }
+
+    spinlock_release(&priority_lock);
+
+    // run_queue_put_back sends the thread to a processor that it is allowed on
+    if (move_self)
+    {
+        eflags = eflags_save();
+        asm volatile ("cli");
+
+        run_queue_put_back(this_cpu(), thread);
+
+        sched_yield();
+        eflags_load(eflags);
+    }
+
+    return E_SUCCESS;
+}
+
+uint32 sched_thread_get_affinity(const sched_thread* thread)
+{
+    return thread->affinity;
+}
+
+void sched_thread_set_inherited_priority(sched_thread* thread, uint32 priority)
+{
+    spinlock_acquire(&priority_lock);
+
+    thread->inherited_priority = priority;
+    update_priority(thread);
+
+    spinlock_release(&priority_lock);
+}
+
 void sched_thread_queue_init(sched_thread_queue* queue)
 {
     spinlock_init(&queue->lock);
@@ -359,12 +2087,72 @@ void sched_process_queue_init(sched_process_queue* queue)
 
 void sched_thread_wake(sched_thread* thread)
 {
+    uint32 eflags;
+
+    assert(thread->in_queue == NULL && thread->status == STS_BLOCKING);
+
+    eflags = eflags_save();
+    asm volatile ("cli");
+    make_ready(thread);
+    eflags_load(eflags);
+
+    // The thread may need to preempt this one, and there may not be a reschedule interrupt to do it
+    preempt_check_resched();
+}
+
+void sched_thread_wake_all(sched_thread_queue* queue)
+{
+    uint32 eflags = eflags_save();
+    sched_thread* t;
+
+    asm volatile ("cli");
+
+    while ((t = sched_thread_dequeue(queue)) != NULL)
+    {
+        assert(t->status == STS_BLOCKING);
+        make_ready(t);
+    }
+
+    eflags_load(eflags);
+}
+
+void sched_thread_wake_yield(sched_thread* thread)
+{
+    uint32 eflags;
+    sched_cpu_state* cpu;
+    sched_thread* current;
+
     assert(thread->in_queue == NULL && thread->status == STS_BLOCKING);
 
-    spinlock_acquire(&thread->process->thread_run_queue.lock);
-    thread->status = STS_READY;
-    sched_thread_enqueue(&thread->process->thread_run_queue, thread);
-    spinlock_release(&thread->process->thread_run_queue.lock);
+    eflags = eflags_save();
+    asm volatile ("cli");
+
+    cpu = this_cpu();
+    current = cpu->current_thread;
+
+    // The current thread can only give up the processor if it could block here, and it doesn't hand
+    // it to a less important thread or one that isn't allowed to run here
+    if ((eflags & EFLAGS_IF) == 0 || preempt_count_read() != 0 || current == NULL || current->status != STS_RUNNING
+        || thread->priority > current->priority || !thread_allowed_on(thread, cpu->index))
+    {
+        make_ready(thread);
+        eflags_load(eflags);
+
+        preempt_check_resched();
+        return;
+    }
+
+    thread->woken_at = tsc_read();
+    run_queue_insert(cpu, thread, true);
+
+    if (thread->worker != NULL)
+        workqueue_worker_waking(thread);
+
+    cpu->yield_to = thread;
+    run_queue_put_back(cpu, current);
+
+    sched_yield();
+    eflags_load(eflags);
 }
 
 void sched_thread_enqueue(sched_thread_queue* queue, sched_thread* thread)
@@ -379,6 +2167,28 @@ void sched_thread_enqueue(sched_thread_queue* queue, sched_thread* thread)
     queue->last = thread;
 }
 
+bool sched_thread_queue_remove(sched_thread_queue* queue, sched_thread* thread)
+{
+    sched_thread* prev = NULL;
+    sched_thread* t;
+
+    for (t = queue->first; t != NULL && t != thread; prev = t, t = t->next_in_queue) ;
+
+    if (t == NULL)
+        return false;
+
+    if (prev == NULL)
+        queue->first = t->next_in_queue;
+    else
+        prev->next_in_queue = t->next_in_queue;
+
+    if (queue->last == t)
+        queue->last = prev;
+
+    t->in_queue = NULL;
+    return true;
+}
+
 sched_thread* sched_thread_dequeue(sched_thread_queue* queue)
 {
     sched_thread* t = queue->first;
@@ -469,159 +2279,237 @@ static void load_registers(regs32_t* ir, const regs32_saved_t* sr)
 
 void sched_switch_thread(sched_thread* thread, regs32_t* r)
 {
-    if (thread == current_thread)
+    sched_cpu_state* cpu = this_cpu();
+    uint64 now;
+
+    // The current thread may have been woken up and placed back in the run queue before it finished
+    // yielding, in which case it should just continue running.
+    if (thread == cpu->current_thread)
+    {
+        thread->status = STS_RUNNING;
+
+        spinlock_acquire(&thread->stats_lock);
+        thread->ready_since = 0;
+        thread->woken_at = 0;
+        spinlock_release(&thread->stats_lock);
+
         return;
+    }
+
+    now = tsc_read();
+
+    if (cpu->current_thread == NULL)
+        idle_exit();
 
     assert(thread->status == STS_READY);
-    assert(current_thread == NULL || current_thread->registers_dirty || current_thread->status == STS_DEAD);
+    assert(cpu->current_thread == NULL || cpu->current_thread->registers_dirty || cpu->current_thread->status == STS_DEAD);
     assert(thread->stack_low == NULL || (thread->registers.esp <= (uint32)thread->stack_high && thread->registers.esp >= (uint32)thread->stack_low));
 
 #ifdef SCHED_SWITCH_DEBUG
-    if (current_process == NULL)
+    if (cpu->current_process == NULL)
     {
         klog(KLOG_LEVEL_DEBUG, "Switching from idle to p%ld (%s), t%ld\n",
             thread->process->pid, thread->process->name, thread->tid);
     }
-    else if (current_thread == NULL)
+    else if (cpu->current_thread == NULL)
     {
         klog(KLOG_LEVEL_DEBUG, "Switching from p%ld (%s) to p%ld (%s), t%ld\n",
-            current_process->pid, current_process->name,
+            cpu->current_process->pid, cpu->current_process->name,
             thread->process->pid, thread->process->name, thread->tid);
     }
     else
     {
         klog(KLOG_LEVEL_DEBUG, "Switching from p%ld (%s), t%ld to p%ld (%s), t%ld\n",
-            current_process->pid, current_process->name, current_thread->tid,
+            cpu->current_process->pid, cpu->current_process->name, cpu->current_thread->tid,
             thread->process->pid, thread->process->name, thread->tid);
     }
 #endif
 
-    if (current_thread != NULL)
+    if (cpu->current_thread != NULL)
     {
-        spinlock_acquire(&current_thread->registers_lock);
-        save_registers(r, &current_thread->registers);
-        spinlock_release(&current_thread->registers_lock);
-        current_thread->registers_dirty = false;
+        if (r != NULL)
+        {
+            spinlock_acquire(&cpu->current_thread->registers_lock);
+            save_registers(r, &cpu->current_thread->registers);
+            spinlock_release(&cpu->current_thread->registers_lock);
+        }
+
+        fpu_switch_out(cpu->current_thread);
+        stats_switch_out(cpu->current_thread, now, cpu->switch_preempted);
+        cpu->current_thread->last_run = ticks;
+
+        // If this interrupt already switched threads once, it is still running on the stack of the
+        // thread switched out then. The thread being switched out now never got to run, so nothing is
+        // using its stack.
+        if (cpu->switch_prev != NULL)
+            __atomic_store_n(&cpu->current_thread->registers_dirty, false, __ATOMIC_RELEASE);
+        else
+            cpu->switch_prev = cpu->current_thread;
     }
 
-    current_thread = thread;
-    current_process = thread->process;
+    cpu->current_thread = thread;
+    cpu->current_process = thread->process;
 
-    if (current_process->address_space != active_page_context)
-        kmem_page_context_switch(current_process->address_space);
+    if (cpu->current_process->address_space != percpu_read(active_page_context))
+        kmem_page_context_switch(cpu->current_process->address_space);
 
     // Wait until registers are fully saved before attempting to acquire the spinlock
-    while (current_thread->registers_dirty)
+    while (cpu->current_thread->registers_dirty)
         asm volatile ("pause");
 
-    current_thread->status = STS_RUNNING;
-    current_thread->registers_dirty = true;
+    cpu->current_thread->status = STS_RUNNING;
+    cpu->current_thread->last_cpu = smp_cpu_index();
+    cpu->current_thread->registers_dirty = true;
+
+    syscall_set_kernel_stack(cpu->current_thread->stack_high);
 
-    spinlock_acquire(&current_thread->registers_lock);
-    load_registers(r, &current_thread->registers);
-    spinlock_release(&current_thread->registers_lock);
+    stats_switch_in(cpu, cpu->current_thread, now);
+
+    if (r != NULL)
+    {
+        spinlock_acquire(&cpu->current_thread->registers_lock);
+        load_registers(r, &cpu->current_thread->registers);
+        spinlock_release(&cpu->current_thread->registers_lock);
+    }
 }
 
 void sched_switch_any(regs32_t* r)
 {
-    sched_process* begin_process;
-    sched_process* new_process;
+    sched_cpu_state* cpu = this_cpu();
     sched_thread* new_thread;
-    uint32 old_esp;
-
-    spinlock_acquire(&process_run_queue.lock);
-    new_process = begin_process = sched_process_dequeue(&process_run_queue);
 
-    while (new_process != NULL)
-    {
-        sched_process_enqueue(&process_run_queue, new_process);
-
-        spinlock_acquire(&new_process->thread_run_queue.lock);
-        new_thread = sched_thread_dequeue(&new_process->thread_run_queue);
-        spinlock_release(&new_process->thread_run_queue.lock);
-
-        if (new_thread != NULL)
-            break;
-
-        new_process = sched_process_dequeue(&process_run_queue);
-
-        if (new_process == begin_process)
-        {
-            sched_process_enqueue(&process_run_queue, new_process);
-            new_process = NULL;
-            break;
-        }
-    }
+    percpu_write(sched_need_resched, false);
 
-    spinlock_release(&process_run_queue.lock);
+    // Only this processor's own run queue needs to be locked in the common case. Other processors'
+    // run queues are only touched when this one has nothing left to run.
+    if ((new_thread = run_queue_take_yield_to(cpu)) == NULL && (new_thread = run_queue_pop(cpu)) == NULL)
+        new_thread = steal_thread();
 
-    if (new_process != NULL && new_thread != NULL)
+    if (new_thread != NULL)
     {
         sched_switch_thread(new_thread, r);
+        run_queue_set_current(cpu, new_thread);
 
-#ifndef SCHED_NO_PREEMPT
-        ticks_until_preempt = TICKS_BEFORE_PREEMPT;
-#endif
+        // Idle processors no longer poll for work, so one of them must be told about any threads
+        // that are still waiting here.
+        if (cpu->num_ready != 0 && smp_num_online > 1)
+            kick_idle_cpu(smp_cpu_index(), smp_cpu_index());
     }
     else
     {
 #ifdef SCHED_SWITCH_DEBUG
-        if (current_process != NULL)
+        if (cpu->current_process != NULL)
         {
-            if (current_thread != NULL)
+            if (cpu->current_thread != NULL)
             {
                 klog(KLOG_LEVEL_DEBUG, "Switching from p%ld (%s), t%ld to idle\n",
-                    current_process->pid, current_process->name, current_thread->tid);
+                    cpu->current_process->pid, cpu->current_process->name, cpu->current_thread->tid);
             }
             else
             {
                 klog(KLOG_LEVEL_DEBUG, "Switching from p%ld (%s) to idle\n",
-                    current_process->pid, current_process->name);
+                    cpu->current_process->pid, cpu->current_process->name);
             }
         }
 #endif
 
-        if (current_thread != NULL)
+        if (cpu->current_thread != NULL)
         {
-            spinlock_acquire(&current_thread->registers_lock);
-            save_registers(r, &current_thread->registers);
-            spinlock_release(&current_thread->registers_lock);
-            current_thread->registers_dirty = false;
+            if (r != NULL)
+            {
+                spinlock_acquire(&cpu->current_thread->registers_lock);
+                save_registers(r, &cpu->current_thread->registers);
+                spinlock_release(&cpu->current_thread->registers_lock);
+            }
+
+            fpu_switch_out(cpu->current_thread);
+            stats_switch_out(cpu->current_thread, tsc_read(), false);
+            cpu->current_thread->last_run = ticks;
+            cpu->switch_prev = cpu->current_thread;
         }
 
-        current_process = NULL;
-        current_thread = NULL;
+        cpu->current_process = NULL;
+        cpu->current_thread = NULL;
 
-        old_esp = r->esp;
-        load_registers(r, &idle_thread->registers);
-        r->esp = old_esp;
+        if (r != NULL)
+            load_registers(r, &cpu->idle_thread->registers);
 
-#ifndef SCHED_NO_PREEMPT
-        ticks_until_preempt = 1;
-#endif
+        run_queue_set_current(cpu, NULL);
+    }
+
+    cpu->switch_preempted = false;
+    tick_update(cpu);
+}
+
+regs32_saved_t* _sched_yield_switch(uint32 esp)
+{
+    sched_cpu_state* cpu = this_cpu();
+    sched_thread* t = cpu->current_thread;
+
+    // sched_yield has already pushed everything that the thread needs to continue onto its stack, so
+    // only what is needed to get back there has to be saved. The segment registers are always the
+    // kernel's and never change.
+    if (t != NULL)
+    {
+        spinlock_acquire(&t->registers_lock);
+        t->registers.eip = (uint32)_sched_yield_resume;
+        t->registers.esp = esp;
+        t->registers.eflags = YIELD_EFLAGS;
+        spinlock_release(&t->registers_lock);
+
+        if (t->worker != NULL && (t->status == STS_BLOCKING || t->status == STS_SLEEPING))
+            workqueue_worker_sleeping(t);
     }
+
+    sched_switch_any(NULL);
+
+    return (cpu->current_thread != NULL) ? &cpu->current_thread->registers : &cpu->idle_thread->registers;
+}
+
+void _sched_finish_switch(void)
+{
+    sched_cpu_state* cpu = this_cpu();
+    sched_thread* prev = cpu->switch_prev;
+    uint32 esp = (uint32)__builtin_frame_address(0);
+
+    if (prev == NULL)
+        return;
+
+    // An NMI that arrives in the middle of a switch returns through here as well, but must leave the
+    // previous thread alone if the switch hasn't gotten off of its stack yet.
+    if (prev->stack_low != NULL && esp >= (uint32)prev->stack_low && esp < (uint32)prev->stack_high)
+        return;
+
+    cpu->switch_prev = NULL;
+    __atomic_store_n(&prev->registers_dirty, false, __ATOMIC_RELEASE);
 }
 
-void sched_yield(void)
+// Without high-resolution timers, the sleep is rounded up to whole ticks so that it is never shorter
+// than requested. Part of the current tick has already passed, so one more tick has to be waited for.
+static void arm_sleep_timer(sched_thread* t, uint64 nanoseconds)
 {
-    asm volatile ("int %0" : : "i" (CONTEXT_SWITCH_INTERRUPT));
+    if (!hrtimer_arm(&t->sleep_hrtimer, nanoseconds))
+        timer_arm(&t->sleep_timer, (nanoseconds + NANOSECONDS_PER_TICK - 1) / NANOSECONDS_PER_TICK + 1);
 }
 
 void sched_sleep(uint64 milliseconds)
 {
-    uint64 nticks = milliseconds / MILLISECONDS_PER_TICK;
+    sched_sleep_ns(milliseconds * 1000000);
+}
+
+void sched_sleep_ns(uint64 nanoseconds)
+{
     uint32 eflags;
-    sched_thread* prev_thread;
+    sched_cpu_state* cpu;
 
     eflags = eflags_save();
     asm volatile ("cli");
 
-    if (nticks == 0)
+    cpu = this_cpu();
+
+    if (nanoseconds == 0)
     {
-        spinlock_acquire(&current_process->thread_run_queue.lock);
-        sched_thread_enqueue(&current_process->thread_run_queue, current_thread);
-        current_thread->status = STS_READY;
-        spinlock_release(&current_process->thread_run_queue.lock);
+        run_queue_put_back(cpu, cpu->current_thread);
 
         sched_yield();
         eflags_load(eflags);
@@ -629,46 +2517,69 @@ void sched_sleep(uint64 milliseconds)
         return;
     }
 
-    current_thread->status = STS_SLEEPING;
-    current_thread->sleep_until = ticks + nticks;
+    cpu->current_thread->status = STS_SLEEPING;
+    arm_sleep_timer(cpu->current_thread, nanoseconds);
+
+    sched_yield();
+    eflags_load(eflags);
+}
 
-    spinlock_acquire(&sleep_queue.lock);
-    current_thread->in_queue = &sleep_queue;
+bool sched_yield_timeout(sched_thread_queue* queue, uint64 nanoseconds)
+{
+    sched_thread* t = this_cpu()->current_thread;
+    bool timed_out;
 
-    if (sleep_queue.first == NULL || sleep_queue.first->sleep_until >= current_thread->sleep_until)
-    {
-        current_thread->next_in_queue = sleep_queue.first;
-        sleep_queue.first = current_thread;
-    }
-    else
+    if (nanoseconds == SCHED_NO_TIMEOUT)
     {
-        for (prev_thread = sleep_queue.first; prev_thread->next_in_queue != NULL && prev_thread->next_in_queue->sleep_until < current_thread->sleep_until; prev_thread = prev_thread->next_in_queue) ;
-
-        current_thread->next_in_queue = prev_thread->next_in_queue;
-        prev_thread->next_in_queue = current_thread;
+        sched_yield();
+        return true;
     }
 
-    spinlock_release(&sleep_queue.lock);
+    t->wait_queue = queue;
+    t->wait_timed_out = false;
+    arm_sleep_timer(t, nanoseconds);
 
     sched_yield();
-    eflags_load(eflags);
+
+    // If the thread was dequeued before the timer expired, the timer's function may still be about to
+    // look at the wait queue, which the caller is free to get rid of as soon as this returns
+    hrtimer_cancel_sync(&t->sleep_hrtimer);
+    timer_cancel_sync(&t->sleep_timer);
+
+    timed_out = t->wait_timed_out;
+    t->wait_queue = NULL;
+
+    return !timed_out;
 }
 
 void sched_thread_end(void)
 {
+    sched_cpu_state* cpu;
+    void* stack_low;
+
     // Note that we don't need to store EFLAGS, since this thread will never resume
     asm volatile ("cli");
 
-    if (current_thread->held_mutexes != NULL)
+    cpu = this_cpu();
+
+    if (cpu->current_thread->held_mutexes != NULL)
         crash("Thread ended with held mutexes");
 
-    current_thread->status = STS_DEAD;
+    cpu->current_thread->status = STS_DEAD;
+    stats_switch_out(cpu->current_thread, tsc_read(), false);
+
+    stack_low = cpu->current_thread->stack_low;
+
+    spinlock_acquire(&cpu->current_process->lock);
+    sched_thread_destroy(cpu->current_thread);
+    spinlock_release(&cpu->current_process->lock);
 
-    spinlock_acquire(&current_process->lock);
-    sched_thread_destroy(current_thread);
-    spinlock_release(&current_process->lock);
+    // The stack isn't reused until this processor has switched away from it, since interrupts stay
+    // disabled until then
+    if (stack_low != NULL)
+        kmem_stack_free(stack_low);
 
-    current_thread = NULL;
+    cpu->current_thread = NULL;
 
     // After this yield, the function will never return
     sched_yield();
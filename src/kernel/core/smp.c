@@ -0,0 +1,396 @@
+#include <core/smp.h>
+#include <core/percpu.h>
+#include <core/preempt.h>
+#include <core/sched.h>
+#include <core/crash.h>
+#include <core/klog.h>
+#include <cpu/apic.h>
+#include <cpu/fpu.h>
+#include <cpu/gdt.h>
+#include <cpu/idt.h>
+#include <cpu/msr.h>
+#include <cpu/syscall.h>
+#include <memory/phys.h>
+#include <memory/page.h>
+#include <acpica/acpi.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#define AP_START_TIMEOUT 200
+
+typedef struct
+{
+    uint32 cr3;
+    uint32 cr4;
+    uint32 efer_nx;
+    uint32 stack;
+    uint32 entry;
+} __attribute__((packed)) smp_trampoline_data;
+
+extern const uint8 _smp_trampoline_begin[];
+extern const uint8 _smp_trampoline_end[];
+extern const uint8 _smp_trampoline_pm_target[];
+extern const uint8 _smp_trampoline_pm_entry[];
+extern const uint8 _smp_trampoline_gdt[];
+extern const uint8 _smp_trampoline_gdt_base[];
+extern const uint8 _smp_trampoline_data[];
+
+smp_cpu smp_cpus[SMP_MAX_CPUS];
+uint32 smp_num_cpus = 1;
+volatile uint32 smp_num_online = 1;
+
+static uint32 cpu_index __percpu;
+
+static smp_cpu* volatile ap_cpu;
+static volatile bool ap_started;
+static uint32 ap_percpu_base;
+static void* ap_stack_low;
+static void* ap_stack_high;
+
+static spinlock tlb_shootdown_lock;
+static volatile addr_v tlb_shootdown_address;
+static volatile uint32 tlb_shootdown_pages;
+static volatile uint32 tlb_shootdown_remaining;
+
+static volatile bool halting;
+
+static void tlb_shootdown_service(void)
+{
+    smp_cpu* cpu = smp_cpu_current();
+
+    if (!__atomic_exchange_n(&cpu->tlb_shootdown_pending, false, __ATOMIC_ACQUIRE))
+        return;
+
+    if (tlb_shootdown_pages == 0)
+        kmem_page_flush_local_all();
+    else
+        kmem_page_flush_local_region(tlb_shootdown_address, tlb_shootdown_pages);
+
+    __atomic_fetch_sub(&tlb_shootdown_remaining, 1, __ATOMIC_RELEASE);
+}
+
+static void tlb_shootdown_handle(regs32_t* r)
+{
+    tlb_shootdown_service();
+    apic_eoi();
+}
+
+static void nmi_handle(regs32_t* r)
+{
+    if (halting)
+    {
+        hang();
+    }
+
+    do_crash_unhandled_isr(r);
+}
+
+static void smp_ap_main(void)
+{
+    smp_cpu* cpu;
+
+    cpu = ap_cpu;
+    ap_started = true;
+
+    // Per-CPU variables cannot be used until the GDT has been set up
+    gdt_init_ap(ap_percpu_base);
+    percpu_write(cpu_index, cpu->index);
+
+    // The trampoline's identity mapping is no longer needed, so switch to the kernel's paging
+    // context as soon as possible.
+    kmem_page_context_switch(&kernel_page_context);
+
+    idt_init_ap();
+    apic_init_ap();
+    fpu_init_ap();
+    syscall_init_ap();
+
+    // Once this processor is marked as online, it will start receiving TLB shootdowns. Anything that
+    // was changed before then must be flushed manually.
+    cpu->online = true;
+    __atomic_fetch_add(&smp_num_online, 1, __ATOMIC_SEQ_CST);
+    kmem_page_flush_local_all();
+
+    klog(KLOG_LEVEL_INFO, "Processor %d (APIC ID %d) is online\n", cpu->index, cpu->apic_id);
+
+    sched_init_ap(ap_stack_low, ap_stack_high);
+}
+
+static bool start_ap(smp_cpu* cpu, addr_p trampoline, smp_trampoline_data* data)
+{
+    uint32 waited;
+    void* percpu_area;
+
+    if ((percpu_area = percpu_alloc_area()) == NULL)
+    {
+        klog(KLOG_LEVEL_ERR, "Failed to allocate per-CPU data for processor %d\n", cpu->index);
+        return false;
+    }
+
+    ap_cpu = cpu;
+    ap_percpu_base = percpu_init_area(cpu->index, percpu_area);
+
+    if ((ap_stack_low = kmem_stack_alloc()) == NULL)
+    {
+        klog(KLOG_LEVEL_ERR, "Failed to allocate a stack for processor %d\n", cpu->index);
+        kmem_page_global_free(percpu_area, (uint32)(ROUND_UP(percpu_area_size(), FRAME_SIZE) / FRAME_SIZE));
+        return false;
+    }
+
+    ap_stack_high = (uint8*)ap_stack_low + THREAD_STACK_SIZE;
+    ap_started = false;
+
+    data->stack = (uint32)ap_stack_high;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // Use the INIT-SIPI-SIPI sequence to start the processor. The second SIPI is only sent if the
+    // processor did not respond to the first one.
+    apic_send_ipi(cpu->apic_id, APIC_ICR_DELIVERY_INIT | APIC_ICR_LEVEL_ASSERT);
+    sched_sleep(10);
+
+    apic_send_ipi(cpu->apic_id, APIC_ICR_DELIVERY_STARTUP | (uint32)(trampoline >> FRAME_SHIFT));
+    sched_sleep(MILLISECONDS_PER_TICK);
+
+    if (!ap_started && !cpu->online)
+        apic_send_ipi(cpu->apic_id, APIC_ICR_DELIVERY_STARTUP | (uint32)(trampoline >> FRAME_SHIFT));
+
+    // Wait for the processor to finish using the trampoline, since it is shared by all processors
+    for (waited = 0; !cpu->online && waited < AP_START_TIMEOUT; waited += MILLISECONDS_PER_TICK)
+        sched_sleep(MILLISECONDS_PER_TICK);
+
+    if (!cpu->online)
+    {
+        // The stack cannot be freed, since the processor may still start up late and use it
+        klog(KLOG_LEVEL_WARN, "Processor %d (APIC ID %d) failed to start\n", cpu->index, cpu->apic_id);
+        return false;
+    }
+
+    return true;
+}
+
+static void boot_aps(void)
+{
+    addr_p trampoline;
+    uint8* trampoline_virt;
+    smp_trampoline_data* data;
+    page_context boot_context;
+    uint32 cr4;
+    uint32 i;
+
+    if ((trampoline = kmem_frame_alloc(FA_LOW_MEM)) == FRAME_NULL)
+    {
+        klog(KLOG_LEVEL_ERR, "Failed to allocate a frame for the SMP trampoline\n");
+        return;
+    }
+
+    // The trampoline must be identity mapped for the instruction right after paging is enabled, so
+    // application processors start up in a temporary paging context that shares the kernel's
+    // mappings.
+    if (!kmem_page_context_create(&boot_context))
+    {
+        klog(KLOG_LEVEL_ERR, "Failed to create the SMP boot paging context\n");
+        kmem_frame_free(trampoline);
+        return;
+    }
+
+    if (!kmem_page_map(&boot_context, (addr_v)trampoline, 0, false, trampoline))
+    {
+        klog(KLOG_LEVEL_ERR, "Failed to map the SMP trampoline\n");
+        kmem_page_context_destroy(&boot_context);
+        kmem_frame_free(trampoline);
+        return;
+    }
+
+    trampoline_virt = (uint8*)(addr_v)(trampoline + KERNEL_VIRTUAL_ADDRESS_BEGIN);
+    memcpy(trampoline_virt, _smp_trampoline_begin, (size_t)(_smp_trampoline_end - _smp_trampoline_begin));
+
+    *(uint32*)(trampoline_virt + (_smp_trampoline_pm_target - _smp_trampoline_begin)) = (uint32)trampoline + (uint32)(_smp_trampoline_pm_entry - _smp_trampoline_begin);
+    *(uint32*)(trampoline_virt + (_smp_trampoline_gdt_base - _smp_trampoline_begin)) = (uint32)trampoline + (uint32)(_smp_trampoline_gdt - _smp_trampoline_begin);
+
+    asm volatile ("mov %%cr4, %0" : "=r" (cr4));
+
+    data = (smp_trampoline_data*)(trampoline_virt + (_smp_trampoline_data - _smp_trampoline_begin));
+    data->cr3 = boot_context.physical_address;
+    data->cr4 = cr4;
+    data->efer_nx = (msr_is_supported() && (msr_read(MSR_EFER) & MSR_EFER_FLAG_NX) != 0) ? 1 : 0;
+    data->entry = (uint32)smp_ap_main;
+
+    for (i = 1; i < smp_num_cpus; i++)
+        start_ap(&smp_cpus[i], trampoline, data);
+
+    kmem_page_unmap(&boot_context, (addr_v)trampoline, false);
+    kmem_page_context_destroy(&boot_context);
+    kmem_frame_free(trampoline);
+}
+
+static void add_cpu(uint8 apic_id, uint8 acpi_id)
+{
+    smp_cpu* cpu;
+
+    if (apic_id == smp_cpus[0].apic_id)
+    {
+        smp_cpus[0].acpi_id = acpi_id;
+        return;
+    }
+
+    if (smp_num_cpus == SMP_MAX_CPUS)
+    {
+        klog(KLOG_LEVEL_WARN, "Ignoring processor with APIC ID %d, since only %d processors are supported\n", apic_id, SMP_MAX_CPUS);
+        return;
+    }
+
+    cpu = &smp_cpus[smp_num_cpus];
+    cpu->index = smp_num_cpus++;
+    cpu->apic_id = apic_id;
+    cpu->acpi_id = acpi_id;
+    cpu->online = false;
+    cpu->tlb_shootdown_pending = false;
+}
+
+void smp_init(const boot_param* param)
+{
+    ACPI_TABLE_MADT* madt;
+    ACPI_SUBTABLE_HEADER* entry;
+    addr_p apic_base;
+    bool no_smp;
+
+    smp_cpus[0].index = 0;
+    smp_cpus[0].online = true;
+
+    spinlock_init(&tlb_shootdown_lock);
+    idt_register_isr_handler(2, nmi_handle);
+
+    if (!apic_is_supported())
+    {
+        klog(KLOG_LEVEL_INFO, "No local APIC found, running with a single processor\n");
+        return;
+    }
+
+    if (AcpiGetTable((char*)ACPI_SIG_MADT, 1, (ACPI_TABLE_HEADER**)&madt) != AE_OK)
+    {
+        klog(KLOG_LEVEL_INFO, "No MADT found, running with a single processor\n");
+        return;
+    }
+
+    // Find the address of the local APIC, which may be overriden by a 64-bit address
+    apic_base = madt->Address;
+
+    for (entry = (ACPI_SUBTABLE_HEADER*)(madt + 1); (uint8*)entry < (uint8*)madt + madt->Header.Length; entry = (ACPI_SUBTABLE_HEADER*)((uint8*)entry + entry->Length))
+    {
+        if (entry->Length == 0)
+            break;
+
+        if (entry->Type == ACPI_MADT_TYPE_LOCAL_APIC_OVERRIDE)
+            apic_base = ((ACPI_MADT_LOCAL_APIC_OVERRIDE*)entry)->Address;
+    }
+
+    apic_init(apic_base);
+
+    smp_cpus[0].apic_id = apic_get_id();
+
+    // The local APIC timer is needed for the dynamic tick even if only one processor is used
+    apic_timer_calibrate();
+    sched_enable_dynamic_tick(param);
+
+    for (entry = (ACPI_SUBTABLE_HEADER*)(madt + 1); (uint8*)entry < (uint8*)madt + madt->Header.Length; entry = (ACPI_SUBTABLE_HEADER*)((uint8*)entry + entry->Length))
+    {
+        if (entry->Length == 0)
+            break;
+
+        if (entry->Type == ACPI_MADT_TYPE_LOCAL_APIC)
+        {
+            ACPI_MADT_LOCAL_APIC* lapic = (ACPI_MADT_LOCAL_APIC*)entry;
+
+            if ((lapic->LapicFlags & ACPI_MADT_ENABLED) != 0)
+                add_cpu(lapic->Id, lapic->ProcessorId);
+        }
+        else if (entry->Type == ACPI_MADT_TYPE_LOCAL_X2APIC)
+        {
+            klog(KLOG_LEVEL_WARN, "Ignoring x2APIC processor entry in MADT\n");
+        }
+    }
+
+    klog(KLOG_LEVEL_INFO, "Found %d processor(s)\n", smp_num_cpus);
+
+    no_smp = cmdline_get_bool(param, "no_smp");
+    if (smp_num_cpus == 1 || no_smp)
+    {
+        smp_num_cpus = 1;
+        return;
+    }
+
+    idt_set_ext_handler_flags(SMP_TLB_SHOOTDOWN_VECTOR - IDT_EXT_START, 0x8E);
+    idt_register_ext_handler(SMP_TLB_SHOOTDOWN_VECTOR - IDT_EXT_START, tlb_shootdown_handle);
+
+    boot_aps();
+
+    klog(KLOG_LEVEL_INFO, "%d of %d processor(s) are online\n", smp_num_online, smp_num_cpus);
+}
+
+uint32 smp_cpu_index(void)
+{
+    return percpu_read(cpu_index);
+}
+
+smp_cpu* smp_cpu_current(void)
+{
+    return &smp_cpus[smp_cpu_index()];
+}
+
+void smp_tlb_shootdown(addr_v address, uint32 num_pages)
+{
+    uint32 eflags;
+    uint32 self;
+    uint32 i;
+
+    if (smp_num_online <= 1)
+        return;
+
+    // A processor spinning on a lock held here would never take the IPI, so waiting for it would
+    // deadlock. Every spinlock raises the preempt count, so this catches callers that hold one.
+    assert(preempt_count_read() == 0);
+
+    eflags = eflags_save();
+    asm volatile ("cli");
+
+    // Another processor may be waiting for us to service its own shootdown, so that must be done
+    // while waiting for the lock.
+    while (!spinlock_try_acquire(&tlb_shootdown_lock))
+    {
+        tlb_shootdown_service();
+        asm volatile ("pause");
+    }
+
+    self = smp_cpu_index();
+
+    tlb_shootdown_address = address;
+    tlb_shootdown_pages = num_pages;
+    tlb_shootdown_remaining = 0;
+
+    for (i = 0; i < smp_num_cpus; i++)
+    {
+        if (i != self && smp_cpus[i].online)
+        {
+            __atomic_fetch_add(&tlb_shootdown_remaining, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&smp_cpus[i].tlb_shootdown_pending, true, __ATOMIC_RELEASE);
+        }
+    }
+
+    apic_send_ipi(0, APIC_ICR_DELIVERY_FIXED | APIC_ICR_DEST_OTHERS | SMP_TLB_SHOOTDOWN_VECTOR);
+
+    while (__atomic_load_n(&tlb_shootdown_remaining, __ATOMIC_ACQUIRE) != 0)
+        asm volatile ("pause");
+
+    spinlock_release(&tlb_shootdown_lock);
+    eflags_load(eflags);
+}
+
+void smp_halt_others(void)
+{
+    if (smp_num_online <= 1 || halting)
+        return;
+
+    halting = true;
+    apic_send_ipi(0, APIC_ICR_DELIVERY_NMI | APIC_ICR_DEST_OTHERS);
+}
@@ -0,0 +1,224 @@
+#include <core/softirq.h>
+#include <core/preempt.h>
+#include <core/percpu.h>
+#include <core/workqueue.h>
+#include <lock/spinlock.h>
+
+// How many times softirqs that were raised while running softirqs are run again before the rest is
+// handed off to a worker thread
+#define SOFTIRQ_MAX_RESTARTS 10
+
+typedef struct softirq_cpu
+{
+    uint32 pending;
+
+    // The number of interrupt handlers that are running, and whether softirqs are running
+    uint32 irq_depth;
+    bool running;
+
+    tasklet* tasklet_head;
+    tasklet* tasklet_tail;
+
+    work work;
+} __attribute__((aligned(PERCPU_ALIGN))) softirq_cpu;
+
+static void softirq_work(void* arg);
+static void run_tasklets(void);
+static void defer_pending(softirq_cpu* c);
+
+static softirq_cpu softirq_state __percpu = {
+    .work = { .function = softirq_work }
+};
+
+static softirq_function handlers[SOFTIRQ_NUM] = {
+    [SOFTIRQ_TASKLET] = run_tasklets
+};
+
+// Must be called with interrupts disabled, and returns with them disabled again. Interrupts are
+// enabled while the softirq functions run.
+static void run_pending(softirq_cpu* c)
+{
+    uint32 restarts = SOFTIRQ_MAX_RESTARTS;
+    uint32 pending;
+
+    c->running = true;
+    preempt_count_inc();
+
+    while ((pending = c->pending) != 0)
+    {
+        if (restarts-- == 0)
+        {
+            defer_pending(c);
+            break;
+        }
+
+        c->pending = 0;
+        asm volatile ("sti");
+
+        while (pending != 0)
+        {
+            uint32 n = (uint32)__builtin_ctz(pending);
+
+            pending &= pending - 1;
+
+            if (handlers[n] != NULL)
+                handlers[n]();
+        }
+
+        asm volatile ("cli");
+    }
+
+    preempt_count_dec();
+    c->running = false;
+}
+
+// Runs softirqs that could not be run when an interrupt handler returned. Workers are pinned to the
+// processor whose pool they belong to, so this runs on the processor that queued it.
+static void softirq_work(void* arg)
+{
+    uint32 eflags = eflags_save();
+    softirq_cpu* c;
+
+    asm volatile ("cli");
+
+    c = percpu_ptr(softirq_state);
+
+    if (!c->running)
+        run_pending(c);
+
+    eflags_load(eflags);
+
+    preempt_check_resched();
+}
+
+// Hands the pending softirqs off to a worker thread. Until this processor has a worker pool of its
+// own, the worker would run on the bootstrap processor and see that processor's softirqs instead, so
+// they are left for the next interrupt to run.
+static void defer_pending(softirq_cpu* c)
+{
+    if (workqueue_runs_locally())
+        work_queue(&system_workqueue, &c->work);
+}
+
+static void tasklet_add(softirq_cpu* c, tasklet* t)
+{
+    t->next = NULL;
+
+    if (c->tasklet_tail != NULL)
+        c->tasklet_tail->next = t;
+    else
+        c->tasklet_head = t;
+
+    c->tasklet_tail = t;
+}
+
+static void run_tasklets(void)
+{
+    uint32 eflags = eflags_save();
+    softirq_cpu* c;
+    tasklet* t;
+    tasklet* next;
+
+    asm volatile ("cli");
+
+    c = percpu_ptr(softirq_state);
+    t = c->tasklet_head;
+    c->tasklet_head = c->tasklet_tail = NULL;
+
+    eflags_load(eflags);
+
+    for (; t != NULL; t = next)
+    {
+        next = t->next;
+
+        // A tasklet that is still running on another processor is put back to try again later, so
+        // that it never runs on two processors at once
+        if (__atomic_exchange_n(&t->running, true, __ATOMIC_ACQUIRE))
+        {
+            asm volatile ("cli");
+            tasklet_add(c, t);
+            c->pending |= 1u << SOFTIRQ_TASKLET;
+            eflags_load(eflags);
+
+            continue;
+        }
+
+        __atomic_store_n(&t->scheduled, false, __ATOMIC_SEQ_CST);
+        t->function(t->arg);
+        __atomic_store_n(&t->running, false, __ATOMIC_RELEASE);
+    }
+}
+
+void softirq_register(softirq_vector n, softirq_function fn)
+{
+    handlers[n] = fn;
+}
+
+void softirq_raise(softirq_vector n)
+{
+    uint32 eflags = eflags_save();
+    softirq_cpu* c;
+
+    asm volatile ("cli");
+
+    c = percpu_ptr(softirq_state);
+    c->pending |= 1u << n;
+
+    // Nothing would notice the softirq until the next interrupt, which may be a long time away on an
+    // idle processor
+    if (c->irq_depth == 0 && !c->running)
+        defer_pending(c);
+
+    eflags_load(eflags);
+}
+
+void softirq_irq_enter(void)
+{
+    percpu_ptr(softirq_state)->irq_depth++;
+}
+
+void softirq_irq_exit(bool interrupts_enabled)
+{
+    softirq_cpu* c = percpu_ptr(softirq_state);
+
+    if (--c->irq_depth != 0 || c->running || c->pending == 0)
+        return;
+
+    // Enabling interrupts here would let them in where the interrupted code had them disabled, e.g.
+    // in the middle of a yield
+    if (!interrupts_enabled)
+    {
+        defer_pending(c);
+        return;
+    }
+
+    run_pending(c);
+}
+
+void tasklet_init(tasklet* t, tasklet_function function, void* arg)
+{
+    t->function = function;
+    t->arg = arg;
+    t->next = NULL;
+
+    t->scheduled = false;
+    t->running = false;
+}
+
+bool tasklet_schedule(tasklet* t)
+{
+    uint32 eflags;
+
+    if (__atomic_exchange_n(&t->scheduled, true, __ATOMIC_ACQUIRE))
+        return false;
+
+    eflags = eflags_save();
+    asm volatile ("cli");
+
+    tasklet_add(percpu_ptr(softirq_state), t);
+    softirq_raise(SOFTIRQ_TASKLET);
+
+    eflags_load(eflags);
+
+    return true;
+}
@@ -0,0 +1,87 @@
+#include <core/time_page.h>
+#include <core/clock.h>
+#include <core/crash.h>
+#include <memory/page.h>
+#include <lock/spinlock.h>
+#include <string.h>
+
+// The time page is written by the timekeeping processor's tick and by clock_register, which may run
+// anywhere, so writers are serialized by time_page_lock
+static spinlock time_page_lock;
+static time_page* tp;
+static addr_p tp_frame;
+
+static inline void write_begin(void)
+{
+    __atomic_store_n(&tp->seq, tp->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void write_end(void)
+{
+    __atomic_store_n(&tp->seq, tp->seq + 1, __ATOMIC_RELEASE);
+}
+
+void time_page_init(void)
+{
+    spinlock_init(&time_page_lock);
+
+    if ((tp = kmem_page_global_alloc(PT_ENTRY_WRITEABLE | PT_ENTRY_NO_EXECUTE, 0, 1)) == NULL || !kmem_page_global_get((addr_v)tp, &tp_frame, NULL))
+        crash("Failed to allocate the time page!");
+
+    memset(tp, 0, FRAME_SIZE);
+    tp->clock = TIME_PAGE_CLOCK_COARSE;
+}
+
+bool time_page_map(page_context* c)
+{
+    if (tp == NULL)
+        return true;
+
+    return kmem_page_map(c, TIME_PAGE_ADDRESS, PT_ENTRY_USER | PT_ENTRY_NO_EXECUTE, false, tp_frame);
+}
+
+void time_page_tick(unsigned long long ticks)
+{
+    uint64 now = clock_now_ns();
+
+    spinlock_acquire(&time_page_lock);
+    write_begin();
+
+    tp->ticks = ticks;
+    tp->coarse_ns = now;
+
+    write_end();
+    spinlock_release(&time_page_lock);
+}
+
+void time_page_set_clock(const clocksource* cs, uint64 base_counts, uint64 base_ns)
+{
+    spinlock_acquire(&time_page_lock);
+    write_begin();
+
+    // User code can only read the TSC itself. With any other clocksource, it has to make do with the
+    // time as of the last tick.
+    tp->clock = cs->rdtsc ? TIME_PAGE_CLOCK_TSC : TIME_PAGE_CLOCK_COARSE;
+    tp->base_counts = base_counts;
+    tp->base_ns = base_ns;
+    tp->mult = cs->mult;
+    tp->shift = cs->shift;
+    tp->coarse_ns = base_ns;
+
+    write_end();
+    spinlock_release(&time_page_lock);
+}
+
+void time_page_set_wall_clock(uint64 wall_ns)
+{
+    int64 offset = (int64)(wall_ns - clock_now_ns());
+
+    spinlock_acquire(&time_page_lock);
+    write_begin();
+
+    tp->wall_offset_ns = offset;
+
+    write_end();
+    spinlock_release(&time_page_lock);
+}
@@ -0,0 +1,341 @@
+#include <core/timer.h>
+#include <core/sched.h>
+#include <lock/spinlock.h>
+
+// The root level of the wheel has a slot for each of the next TVR_SIZE ticks. Each of the outer
+// levels has TVN_SIZE slots, each of which covers as many ticks as the whole level below it. When
+// the level below wraps around, the timers in the next slot of the outer level are cascaded down.
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+
+#define TVN_SHIFT(level) (TVR_BITS + (level) * TVN_BITS)
+
+// Timers that expire further in the future than this are placed as far out as the wheel goes, and
+// are moved to the right slot once they are cascaded down again.
+#define TIMER_MAX_DELAY 0xFFFFFFFFull
+
+#define ROOT_BITMAP_WORDS (TVR_SIZE / 32)
+
+static spinlock timer_lock;
+
+// The next tick that has not been processed yet
+static unsigned long long timer_base;
+
+// The timer whose function is being run right now, if any
+static timer* volatile timer_running;
+
+static uint32 timer_num_pending;
+static uint32 timer_num_root;
+
+static timer* wheel_root[TVR_SIZE];
+static timer* wheel_levels[TVN_LEVELS][TVN_SIZE];
+
+// Keeps track of which root slots are occupied, so that the next expiry can be found without
+// looking at every slot
+static uint32 root_bitmap[ROOT_BITMAP_WORDS];
+
+static inline bool is_root_bucket(timer** bucket)
+{
+    return bucket >= &wheel_root[0] && bucket < &wheel_root[TVR_SIZE];
+}
+
+static void bucket_add(timer** bucket, timer* t)
+{
+    t->next = *bucket;
+    t->prev = NULL;
+    t->bucket = bucket;
+
+    if (t->next != NULL)
+        t->next->prev = t;
+
+    *bucket = t;
+
+    if (is_root_bucket(bucket))
+    {
+        uint32 slot = (uint32)(bucket - wheel_root);
+
+        root_bitmap[slot / 32] |= 1u << (slot % 32);
+        timer_num_root++;
+    }
+}
+
+static void bucket_remove(timer* t)
+{
+    timer** bucket = t->bucket;
+
+    if (t->prev == NULL)
+        *bucket = t->next;
+    else
+        t->prev->next = t->next;
+
+    if (t->next != NULL)
+        t->next->prev = t->prev;
+
+    t->next = t->prev = NULL;
+    t->bucket = NULL;
+
+    if (is_root_bucket(bucket))
+    {
+        uint32 slot = (uint32)(bucket - wheel_root);
+
+        if (*bucket == NULL)
+            root_bitmap[slot / 32] &= ~(1u << (slot % 32));
+
+        timer_num_root--;
+    }
+}
+
+static timer** find_bucket(unsigned long long expires)
+{
+    unsigned long long delta;
+    uint32 level;
+
+    // Timers that have already expired are run on the next tick that gets processed
+    if (expires < timer_base)
+        expires = timer_base;
+
+    delta = expires - timer_base;
+
+    if (delta < TVR_SIZE)
+        return &wheel_root[expires & TVR_MASK];
+
+    if (delta > TIMER_MAX_DELAY)
+        expires = timer_base + TIMER_MAX_DELAY;
+
+    for (level = 0; level < TVN_LEVELS - 1 && delta >= (1ull << TVN_SHIFT(level + 1)); level++) ;
+
+    return &wheel_levels[level][(expires >> TVN_SHIFT(level)) & TVN_MASK];
+}
+
+static void add_timer(timer* t)
+{
+    bucket_add(find_bucket(t->expires), t);
+    timer_num_pending++;
+}
+
+static void remove_timer(timer* t)
+{
+    bucket_remove(t);
+    timer_num_pending--;
+}
+
+// Moves all timers in a slot of the given outer level to where they belong relative to the current
+// base. Returns the index of the slot that was cascaded.
+static uint32 cascade(uint32 level)
+{
+    uint32 index = (uint32)(timer_base >> TVN_SHIFT(level)) & TVN_MASK;
+    timer* t;
+
+    while ((t = wheel_levels[level][index]) != NULL)
+    {
+        remove_timer(t);
+        add_timer(t);
+    }
+
+    return index;
+}
+
+static bool find_next_root_slot(uint32 index, uint32* offset)
+{
+    uint32 word = index / 32;
+    uint32 bits = root_bitmap[word] & ~((1u << (index % 32)) - 1);
+    uint32 i;
+
+    // The first word is checked again at the end, since slots before the index hold timers that
+    // expire after the root level wraps around.
+    for (i = 0; i <= ROOT_BITMAP_WORDS; i++)
+    {
+        if (bits != 0)
+        {
+            *offset = (word * 32 + (uint32)__builtin_ctz(bits) - index) & TVR_MASK;
+            return true;
+        }
+
+        word = (word + 1) % ROOT_BITMAP_WORDS;
+        bits = root_bitmap[word];
+    }
+
+    return false;
+}
+
+static unsigned long long next_expiry_locked(void)
+{
+    unsigned long long next = ~0ull;
+    uint32 index = (uint32)timer_base & TVR_MASK;
+    uint32 offset;
+
+    if (timer_num_pending == 0)
+        return next;
+
+    if (find_next_root_slot(index, &offset))
+        next = timer_base + offset;
+
+    // Timers in the outer levels might be cascaded into a root slot right at the next boundary
+    if (timer_num_pending != timer_num_root)
+    {
+        unsigned long long boundary = (index == 0) ? timer_base : (timer_base | TVR_MASK) + 1;
+
+        if (boundary < next)
+            next = boundary;
+    }
+
+    return next;
+}
+
+void timer_init_wheel(void)
+{
+    spinlock_init(&timer_lock);
+    timer_base = ticks;
+}
+
+void timer_init(timer* t, timer_function function, void* arg)
+{
+    t->expires = 0;
+    t->function = function;
+    t->arg = arg;
+
+    t->next = t->prev = NULL;
+    t->bucket = NULL;
+}
+
+void timer_arm(timer* t, uint64 delay_ticks)
+{
+    uint32 eflags = eflags_save();
+    asm volatile ("cli");
+
+    sched_tick_sync();
+    timer_arm_at(t, ticks + delay_ticks);
+
+    eflags_load(eflags);
+}
+
+void timer_arm_at(timer* t, unsigned long long expires)
+{
+    // If this is the timekeeper and its tick is stopped, it needs to notice the new timer
+    sched_tick_sync();
+
+    spinlock_acquire(&timer_lock);
+
+    if (t->bucket != NULL)
+        remove_timer(t);
+
+    t->expires = expires;
+    add_timer(t);
+
+    spinlock_release(&timer_lock);
+}
+
+bool timer_cancel(timer* t)
+{
+    bool pending;
+
+    spinlock_acquire(&timer_lock);
+
+    if ((pending = (t->bucket != NULL)))
+        remove_timer(t);
+
+    spinlock_release(&timer_lock);
+
+    return pending;
+}
+
+bool timer_cancel_sync(timer* t)
+{
+    bool pending;
+
+    spinlock_acquire(&timer_lock);
+
+    if ((pending = (t->bucket != NULL)))
+        remove_timer(t);
+
+    // The function may arm the timer again, so it has to be cancelled again once it has finished
+    while (timer_running == t)
+    {
+        spinlock_release(&timer_lock);
+
+        while (timer_running == t)
+            asm volatile ("pause");
+
+        spinlock_acquire(&timer_lock);
+
+        if (t->bucket != NULL)
+        {
+            remove_timer(t);
+            pending = true;
+        }
+    }
+
+    spinlock_release(&timer_lock);
+
+    return pending;
+}
+
+bool timer_is_pending(const timer* t)
+{
+    return t->bucket != NULL;
+}
+
+void timer_run(unsigned long long now)
+{
+    spinlock_acquire(&timer_lock);
+
+    while (timer_base <= now)
+    {
+        unsigned long long next = next_expiry_locked();
+        uint32 index;
+        uint32 level;
+        timer* t;
+
+        // Ticks with nothing to do are skipped over entirely, which matters after the timekeeper's
+        // tick has been stopped for a long time.
+        if (next > now)
+        {
+            timer_base = now + 1;
+            break;
+        }
+        else if (next > timer_base)
+        {
+            timer_base = next;
+        }
+
+        index = (uint32)timer_base & TVR_MASK;
+
+        if (index == 0)
+        {
+            for (level = 0; level < TVN_LEVELS && cascade(level) == 0; level++) ;
+        }
+
+        // The lock is dropped while running each function, since it may arm or cancel timers
+        while ((t = wheel_root[index]) != NULL)
+        {
+            remove_timer(t);
+            timer_running = t;
+
+            spinlock_release(&timer_lock);
+            t->function(t->arg);
+            spinlock_acquire(&timer_lock);
+
+            timer_running = NULL;
+        }
+
+        timer_base++;
+    }
+
+    spinlock_release(&timer_lock);
+}
+
+unsigned long long timer_next_expiry(void)
+{
+    unsigned long long next;
+
+    spinlock_acquire(&timer_lock);
+    next = next_expiry_locked();
+    spinlock_release(&timer_lock);
+
+    return next;
+}
@@ -0,0 +1,537 @@
+#include <core/workqueue.h>
+#include <core/smp.h>
+#include <memory/pool.h>
+#include <core/crash.h>
+
+#include <core/klog.h>
+
+typedef struct workqueue_pool
+{
+    spinlock lock;
+
+    work* first;
+    work* last;
+
+    // Workers that have nothing to do wait in idle_queue. num_running counts the workers that are
+    // neither idle nor blocked in the middle of a work item, and another worker is only woken up to
+    // run queued work when it drops to zero.
+    sched_thread_queue idle_queue;
+    uint32 num_workers;
+    uint32 num_running;
+    bool spawning;
+
+    struct workqueue_worker* workers;
+} workqueue_pool;
+
+typedef struct workqueue_worker
+{
+    workqueue_pool* pool;
+    struct workqueue_worker* next;
+
+    // All of these are protected by the pool's lock. A worker is busy while it is running a work item,
+    // and sleeping while it is blocked in the middle of one.
+    bool busy;
+    bool sleeping;
+
+    // Whether a work item is running is tracked here rather than in the work item itself, since the
+    // work item may be freed by its own function. rerun is set if it was queued again while running.
+    work* current;
+    bool rerun;
+} workqueue_worker;
+
+workqueue system_workqueue = {
+    .name = "system"
+};
+
+static workqueue_pool pools[SMP_MAX_CPUS];
+static uint32 num_pools;
+
+// Must be called with the pool's lock held
+static void wake_idle_worker(workqueue_pool* pool)
+{
+    sched_thread* t;
+
+    spinlock_acquire(&pool->idle_queue.lock);
+    t = sched_thread_dequeue(&pool->idle_queue);
+    spinlock_release(&pool->idle_queue.lock);
+
+    if (t != NULL)
+    {
+        pool->num_running++;
+        sched_thread_wake(t);
+    }
+}
+
+// Finds the worker that is running the given work item, if any. Must be called with the pool's lock
+// held.
+static workqueue_worker* find_running_worker(workqueue_pool* pool, const work* w)
+{
+    for (workqueue_worker* worker = pool->workers; worker != NULL; worker = worker->next)
+    {
+        if (worker->current == w)
+            return worker;
+    }
+
+    return NULL;
+}
+
+static void work_done(workqueue* wq)
+{
+    sched_thread* t;
+
+    spinlock_acquire(&wq->lock);
+
+    wq->in_flight--;
+
+    // Flushers may be waiting for any one of the workqueue's work items, so they all check again
+    spinlock_acquire(&wq->flushers.lock);
+    while ((t = sched_thread_dequeue(&wq->flushers)) != NULL)
+        sched_thread_wake(t);
+    spinlock_release(&wq->flushers.lock);
+
+    spinlock_release(&wq->lock);
+}
+
+// Must be called with wq->lock held and interrupts disabled. The lock is dropped while waiting.
+static void flush_wait(workqueue* wq)
+{
+    sched_thread* t = sched_thread_current();
+
+    spinlock_acquire(&wq->flushers.lock);
+    t->status = STS_BLOCKING;
+    sched_thread_enqueue(&wq->flushers, t);
+    spinlock_release(&wq->flushers.lock);
+    spinlock_release(&wq->lock);
+
+    sched_yield();
+
+    spinlock_acquire(&wq->lock);
+}
+
+static void worker_main(void* arg);
+
+// Must be called with the pool's lock held and interrupts disabled. The lock is dropped while the
+// thread is being created, since that may block.
+static void spawn_worker(workqueue_pool* pool, uint32 eflags)
+{
+    workqueue_worker* worker;
+    sched_thread* t;
+
+    pool->spawning = true;
+    pool->num_workers++;
+    pool->num_running++;
+
+    spinlock_release(&pool->lock);
+    eflags_load(eflags);
+
+    if ((worker = kmem_pool_generic_alloc(sizeof(workqueue_worker), 0)) != NULL)
+    {
+        worker->pool = pool;
+        worker->next = NULL;
+        worker->busy = false;
+        worker->sleeping = false;
+        worker->current = NULL;
+        worker->rerun = false;
+
+        if (sched_thread_create(kernel_process, worker_main, worker, &t) != E_SUCCESS)
+        {
+            kmem_pool_generic_free(worker);
+            worker = NULL;
+        }
+    }
+
+    asm volatile ("cli");
+    spinlock_acquire(&pool->lock);
+
+    if (worker == NULL)
+    {
+        klog(KLOG_LEVEL_WARN, "Failed to start a workqueue worker\n");
+
+        pool->num_workers--;
+        pool->num_running--;
+    }
+
+    pool->spawning = false;
+}
+
+// Must be called with the pool's lock held and interrupts disabled. The lock is dropped while the
+// work item is running.
+static void run_work(workqueue_pool* pool, workqueue_worker* worker, work* w, uint32 eflags)
+{
+    workqueue* wq;
+    bool rerun;
+
+    worker->busy = true;
+    worker->current = w;
+
+    do
+    {
+        // Once pending is cleared, the work item can be queued again, possibly through a different
+        // workqueue, so the workqueue that this run counts against must be remembered
+        wq = w->wq;
+        __atomic_store_n(&w->pending, false, __ATOMIC_RELEASE);
+
+        spinlock_release(&pool->lock);
+        eflags_load(eflags);
+
+        w->function(w->arg);
+
+        asm volatile ("cli");
+        spinlock_acquire(&pool->lock);
+
+        // The work item may have been freed by its function, so it mustn't be touched again unless it
+        // was queued again in the meantime
+        if ((rerun = worker->rerun))
+            worker->rerun = false;
+        else
+            worker->current = NULL;
+
+        spinlock_release(&pool->lock);
+        work_done(wq);
+        spinlock_acquire(&pool->lock);
+    } while (rerun);
+
+    worker->busy = false;
+}
+
+static void worker_main(void* arg)
+{
+    workqueue_worker* worker = arg;
+    workqueue_pool* pool = worker->pool;
+    sched_thread* t = sched_thread_current();
+    uint32 eflags = eflags_save();
+    work* w;
+
+    t->worker = worker;
+
+    // Workers stay on their pool's processor, where the work that they run was queued and is most
+    // likely to still be cached. This only fails if that processor never came online.
+    sched_thread_set_affinity(t, 1u << (uint32)(pool - pools));
+
+    asm volatile ("cli");
+    spinlock_acquire(&pool->lock);
+
+    // The worker must be on the pool's list before it takes any work, so that work_queue can tell
+    // whether a work item is running
+    worker->next = pool->workers;
+    pool->workers = worker;
+
+    while (true)
+    {
+        if ((w = pool->first) == NULL)
+        {
+            pool->num_running--;
+
+            spinlock_acquire(&pool->idle_queue.lock);
+            t->status = STS_BLOCKING;
+            sched_thread_enqueue(&pool->idle_queue, t);
+            spinlock_release(&pool->idle_queue.lock);
+            spinlock_release(&pool->lock);
+
+            sched_yield();
+
+            spinlock_acquire(&pool->lock);
+            continue;
+        }
+
+        // Make sure that there is an idle worker ready to take over if this work item blocks
+        if (pool->idle_queue.first == NULL && pool->num_workers < WORKQUEUE_MAX_WORKERS && !pool->spawning)
+        {
+            spawn_worker(pool, eflags);
+            continue;
+        }
+
+        pool->first = w->next;
+        if (pool->last == w)
+            pool->last = NULL;
+
+        w->queued = false;
+
+        run_work(pool, worker, w, eflags);
+    }
+}
+
+void workqueue_init_pools(void)
+{
+    uint32 eflags;
+    uint32 i;
+
+    // Work that was queued before this (e.g. by ACPI during early initialization) is already waiting
+    // on the first pool, which is otherwise still zeroed, so the pools' work lists are left alone
+    for (i = 0; i < smp_num_cpus; i++)
+    {
+        spinlock_init(&pools[i].lock);
+        sched_thread_queue_init(&pools[i].idle_queue);
+    }
+
+    num_pools = smp_num_cpus;
+
+    // Each pool starts out with a single worker, and the rest are started once they are needed
+    for (i = 0; i < num_pools; i++)
+    {
+        eflags = eflags_save();
+        asm volatile ("cli");
+        spinlock_acquire(&pools[i].lock);
+
+        spawn_worker(&pools[i], eflags);
+
+        spinlock_release(&pools[i].lock);
+        eflags_load(eflags);
+
+        if (pools[i].num_workers == 0)
+            crash("Failed to start workqueue workers!");
+    }
+
+    klog(KLOG_LEVEL_DEBUG, "Started workqueue pools for %d processors\n", num_pools);
+}
+
+bool workqueue_runs_locally(void)
+{
+    return smp_cpu_index() < num_pools || smp_cpu_index() == 0;
+}
+
+void workqueue_init(workqueue* wq, const char* name)
+{
+    wq->name = name;
+
+    spinlock_init(&wq->lock);
+    wq->in_flight = 0;
+    sched_thread_queue_init(&wq->flushers);
+}
+
+void workqueue_flush(workqueue* wq)
+{
+    uint32 eflags = eflags_save();
+    asm volatile ("cli");
+
+    spinlock_acquire(&wq->lock);
+
+    while (wq->in_flight != 0)
+        flush_wait(wq);
+
+    spinlock_release(&wq->lock);
+
+    eflags_load(eflags);
+}
+
+void work_init(work* w, work_function function, void* arg)
+{
+    w->function = function;
+    w->arg = arg;
+
+    w->wq = NULL;
+    w->pool = NULL;
+    w->next = NULL;
+
+    w->pending = false;
+    w->queued = false;
+}
+
+// Must be called with the work item's workqueue lock held
+static bool work_is_running(const work* w)
+{
+    workqueue_pool* pool = w->pool;
+    bool running;
+
+    if (pool == NULL)
+        return false;
+
+    spinlock_acquire(&pool->lock);
+    running = find_running_worker(pool, w) != NULL;
+    spinlock_release(&pool->lock);
+
+    return running;
+}
+
+bool work_queue(workqueue* wq, work* w)
+{
+    workqueue_pool* pool;
+    workqueue_worker* worker;
+
+    // Whoever sets pending gets to queue the work item, so it can't end up on two pools at once
+    if (__atomic_exchange_n(&w->pending, true, __ATOMIC_ACQUIRE))
+        return false;
+
+    w->wq = wq;
+
+    spinlock_acquire(&wq->lock);
+    wq->in_flight++;
+    spinlock_release(&wq->lock);
+
+    // A work item that is still running must not start running on another pool at the same time, so
+    // the worker that is running it will simply run it again
+    if ((pool = w->pool) != NULL)
+    {
+        spinlock_acquire(&pool->lock);
+
+        if ((worker = find_running_worker(pool, w)) != NULL)
+        {
+            worker->rerun = true;
+            spinlock_release(&pool->lock);
+            return true;
+        }
+
+        spinlock_release(&pool->lock);
+    }
+
+    pool = &pools[(smp_cpu_index() < num_pools) ? smp_cpu_index() : 0];
+
+    spinlock_acquire(&pool->lock);
+
+    w->pool = pool;
+    w->next = NULL;
+    w->queued = true;
+
+    if (pool->first == NULL)
+        pool->first = w;
+    else
+        pool->last->next = w;
+
+    pool->last = w;
+
+    if (pool->num_running == 0)
+        wake_idle_worker(pool);
+
+    spinlock_release(&pool->lock);
+
+    return true;
+}
+
+bool work_cancel(work* w)
+{
+    workqueue_pool* pool;
+    workqueue_worker* worker;
+    workqueue* wq;
+
+    while (w->pending)
+    {
+        pool = w->pool;
+
+        // The work item is in the middle of being queued, and will be on a pool very shortly
+        if (pool == NULL)
+        {
+            asm volatile ("pause");
+            continue;
+        }
+
+        spinlock_acquire(&pool->lock);
+
+        if (pool != w->pool || !w->pending)
+        {
+            spinlock_release(&pool->lock);
+            continue;
+        }
+
+        if (w->queued)
+        {
+            work** prev = &pool->first;
+            work* last = NULL;
+
+            while (*prev != w)
+            {
+                last = *prev;
+                prev = &(*prev)->next;
+            }
+
+            *prev = w->next;
+            if (pool->last == w)
+                pool->last = last;
+
+            w->queued = false;
+        }
+        else if ((worker = find_running_worker(pool, w)) != NULL && worker->rerun)
+        {
+            worker->rerun = false;
+        }
+        else
+        {
+            spinlock_release(&pool->lock);
+            asm volatile ("pause");
+            continue;
+        }
+
+        wq = w->wq;
+        __atomic_store_n(&w->pending, false, __ATOMIC_RELEASE);
+
+        spinlock_release(&pool->lock);
+
+        work_done(wq);
+        work_flush(w);
+
+        return true;
+    }
+
+    work_flush(w);
+    return false;
+}
+
+void work_flush(work* w)
+{
+    workqueue* wq = w->wq;
+    uint32 eflags;
+
+    if (wq == NULL)
+        return;
+
+    eflags = eflags_save();
+    asm volatile ("cli");
+
+    spinlock_acquire(&wq->lock);
+
+    // Workers only take the workqueue's lock after the work item has stopped running, so checking
+    // with it held can't miss the wakeup
+    while (w->pending || work_is_running(w))
+        flush_wait(wq);
+
+    spinlock_release(&wq->lock);
+
+    eflags_load(eflags);
+}
+
+bool work_is_pending(const work* w)
+{
+    return w->pending;
+}
+
+void workqueue_worker_sleeping(sched_thread* t)
+{
+    workqueue_worker* worker = t->worker;
+    workqueue_pool* pool = worker->pool;
+
+    // Idle workers block as well, but aren't counted as running in the first place
+    if (!worker->busy)
+        return;
+
+    spinlock_acquire(&pool->lock);
+
+    // The thread may already have been woken up again, in which case it will just carry on
+    if (t->status == STS_BLOCKING || t->status == STS_SLEEPING)
+    {
+        worker->sleeping = true;
+
+        if (--pool->num_running == 0 && pool->first != NULL)
+            wake_idle_worker(pool);
+    }
+
+    spinlock_release(&pool->lock);
+}
+
+void workqueue_worker_waking(sched_thread* t)
+{
+    workqueue_worker* worker = t->worker;
+    workqueue_pool* pool = worker->pool;
+
+    // Idle workers are woken up by their pool with its lock held, and are counted as running by it
+    if (!worker->busy)
+        return;
+
+    spinlock_acquire(&pool->lock);
+
+    if (worker->sleeping)
+    {
+        worker->sleeping = false;
+        pool->num_running++;
+    }
+
+    spinlock_release(&pool->lock);
+}
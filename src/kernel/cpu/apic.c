@@ -0,0 +1,191 @@
+#include <cpu/apic.h>
+#include <cpu/cpuid.h>
+#include <cpu/msr.h>
+#include <cpu/idt.h>
+#include <memory/virt.h>
+#include <core/sched.h>
+#include <core/crash.h>
+#include <core/klog.h>
+
+#define APIC_REG_ID              0x020
+#define APIC_REG_TPR             0x080
+#define APIC_REG_EOI             0x0B0
+#define APIC_REG_SVR             0x0F0
+#define APIC_REG_ESR             0x280
+#define APIC_REG_ICR_LOW         0x300
+#define APIC_REG_ICR_HIGH        0x310
+#define APIC_REG_LVT_TIMER       0x320
+#define APIC_REG_LVT_LINT0       0x350
+#define APIC_REG_LVT_LINT1       0x360
+#define APIC_REG_LVT_ERROR       0x370
+#define APIC_REG_TIMER_INITIAL   0x380
+#define APIC_REG_TIMER_CURRENT   0x390
+#define APIC_REG_TIMER_DIVIDE    0x3E0
+
+#define APIC_SVR_ENABLE          (1 << 8)
+#define APIC_ICR_PENDING         (1 << 12)
+#define APIC_LVT_MASKED          (1 << 16)
+#define APIC_LVT_TIMER_PERIODIC  (1 << 17)
+
+// Divide configuration value that causes the timer to count down once every 16 bus clocks
+#define APIC_TIMER_DIVIDE_16     0x3
+
+#define APIC_CALIBRATE_TICKS     10
+
+static volatile uint32* apic_regs;
+
+bool apic_enabled;
+uint32 apic_timer_counts_per_ms;
+
+static inline uint32 apic_read(uint32 reg)
+{
+    return apic_regs[reg / sizeof(uint32)];
+}
+
+static inline void apic_write(uint32 reg, uint32 val)
+{
+    apic_regs[reg / sizeof(uint32)] = val;
+}
+
+static void apic_spurious_handle(regs32_t* r)
+{
+    // Spurious interrupts must not be acknowledged with an EOI
+}
+
+static void apic_enable_local(void)
+{
+    // Make sure that the local APIC is enabled in the MSR, since some firmware leaves it disabled on
+    // application processors until it is explicitly turned on.
+    msr_write(MSR_APIC_BASE, msr_read(MSR_APIC_BASE) | MSR_APIC_BASE_FLAG_ENABLE);
+
+    apic_write(APIC_REG_TPR, 0);
+    apic_write(APIC_REG_LVT_ERROR, APIC_LVT_MASKED);
+    apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED);
+    apic_write(APIC_REG_SVR, APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+
+    // Clear any errors left over from before the APIC was enabled
+    apic_write(APIC_REG_ESR, 0);
+    apic_write(APIC_REG_ESR, 0);
+}
+
+bool apic_is_supported(void)
+{
+    return msr_is_supported() && cpuid_supports_feature_edx(CPUID_FEATURE_EDX_APIC);
+}
+
+void apic_init(addr_p base)
+{
+    void* regs;
+
+    if (apic_enabled)
+        return;
+
+    if ((regs = kmem_virt_alloc(1)) == NULL)
+        crash("Failed to allocate virtual memory for the local APIC!");
+
+    if (!kmem_page_global_map((addr_v)regs, PT_ENTRY_WRITEABLE | PT_ENTRY_NO_EXECUTE | PT_ENTRY_CACHE_DISABLE | PT_ENTRY_GLOBAL, true, base & ~(addr_p)FRAME_OFFSET_MASK))
+        crash("Failed to map the local APIC!");
+
+    apic_regs = (volatile uint32*)((addr_v)regs + (addr_v)(base & FRAME_OFFSET_MASK));
+
+    // APIC interrupts must not be callable from userspace and must run with interrupts disabled
+    idt_set_ext_handler_flags(APIC_SPURIOUS_VECTOR - IDT_EXT_START, 0x8E);
+    idt_register_ext_handler(APIC_SPURIOUS_VECTOR - IDT_EXT_START, apic_spurious_handle);
+
+    idt_set_ext_handler_flags(APIC_TIMER_VECTOR - IDT_EXT_START, 0x8E);
+
+    // The bootstrap processor keeps receiving legacy PIC interrupts through LINT0 in ExtINT mode,
+    // so the LINT pins are left as the firmware configured them.
+    apic_enable_local();
+    apic_enabled = true;
+
+    klog(KLOG_LEVEL_INFO, "Local APIC at 0x%08x enabled (ID %d)\n", (uint32)base, apic_get_id());
+}
+
+void apic_init_ap(void)
+{
+    apic_enable_local();
+
+    // Only the bootstrap processor should receive interrupts from the legacy PIC
+    apic_write(APIC_REG_LVT_LINT0, APIC_LVT_MASKED);
+}
+
+uint8 apic_get_id(void)
+{
+    return (uint8)(apic_read(APIC_REG_ID) >> 24);
+}
+
+void apic_eoi(void)
+{
+    apic_write(APIC_REG_EOI, 0);
+}
+
+void apic_send_ipi(uint8 apic_id, uint32 flags)
+{
+    uint32 eflags = eflags_save();
+    asm volatile ("cli");
+
+    while ((apic_read(APIC_REG_ICR_LOW) & APIC_ICR_PENDING) != 0)
+        asm volatile ("pause");
+
+    apic_write(APIC_REG_ICR_HIGH, (uint32)apic_id << 24);
+    apic_write(APIC_REG_ICR_LOW, flags);
+
+    eflags_load(eflags);
+}
+
+void apic_timer_calibrate(void)
+{
+    unsigned long long start;
+    uint32 elapsed;
+    uint32 eflags;
+
+    eflags = eflags_save();
+    asm volatile ("sti");
+
+    // Wait for the start of a new tick so that the measurement covers whole ticks
+    start = ticks;
+    while (ticks == start)
+        asm volatile ("pause" : : : "memory");
+
+    apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED | APIC_TIMER_VECTOR);
+    apic_write(APIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
+
+    start = ticks;
+    while (ticks < start + APIC_CALIBRATE_TICKS)
+        asm volatile ("pause" : : : "memory");
+
+    elapsed = 0xFFFFFFFF - apic_read(APIC_REG_TIMER_CURRENT);
+    apic_write(APIC_REG_TIMER_INITIAL, 0);
+
+    eflags_load(eflags);
+
+    apic_timer_counts_per_ms = elapsed / (APIC_CALIBRATE_TICKS * MILLISECONDS_PER_TICK);
+    klog(KLOG_LEVEL_DEBUG, "APIC timer runs at %d counts per millisecond\n", apic_timer_counts_per_ms);
+}
+
+void apic_timer_set_periodic(uint8 vector, uint32 count)
+{
+    apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_LVT_TIMER_PERIODIC | vector);
+    apic_write(APIC_REG_TIMER_INITIAL, count);
+}
+
+void apic_timer_set_oneshot(uint8 vector, uint32 count)
+{
+    apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_REG_LVT_TIMER, vector);
+    apic_write(APIC_REG_TIMER_INITIAL, count);
+}
+
+uint32 apic_timer_get_current(void)
+{
+    return apic_read(APIC_REG_TIMER_CURRENT);
+}
+
+void apic_timer_stop(void)
+{
+    apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED);
+    apic_write(APIC_REG_TIMER_INITIAL, 0);
+}
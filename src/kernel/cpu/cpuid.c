@@ -58,12 +58,19 @@ uint8 cpuid_processor_type;
 uint16 cpuid_family_id;
 uint8 cpuid_model_id;
 
+uint32 cpuid_mwait_substates;
+
 static uint32 cpuid_features_edx;
 static uint32 cpuid_features_ecx;
 
 static uint32 cpuid_features_ext_edx;
 static uint32 cpuid_features_ext_ecx;
 
+static uint32 cpuid_features_apm_edx;
+
+static uint32 cpuid_features_mwait_ecx;
+static uint32 cpuid_features_pm_eax;
+
 void cpuid_init(void)
 {
     size_t i;
@@ -95,6 +102,19 @@ void cpuid_init(void)
     cpuid_family_id = (eax_info.info.family == 0xF) ? (uint16)(0xF + eax_info.info.ext_family) : eax_info.info.family;
     cpuid_model_id = (eax_info.info.family == 0x6 || eax_info.info.family == 0xF) ? (uint8)(eax_info.info.model + (eax_info.info.ext_model << 4)) : eax_info.info.model;
 
+    // MONITOR/MWAIT parameters, which say which C-states can be requested through MWAIT
+    if (cpuid_max_eax >= 5 && cpuid_supports_feature_ecx(CPUID_FEATURE_ECX_MONITOR))
+    {
+        asm volatile ("cpuid" : "=c" (cpuid_features_mwait_ecx), "=d" (cpuid_mwait_substates) : "a" (5) : "ebx");
+    }
+
+    // Thermal and power management information, which says whether the local APIC timer keeps
+    // running in deep C-states
+    if (cpuid_max_eax >= 6)
+    {
+        asm volatile ("cpuid" : "=a" (cpuid_features_pm_eax) : "a" (6) : "ebx", "ecx", "edx");
+    }
+
     // Run CPUID with EAX=0x80000000 to detect support for extended CPUID functions
     asm volatile ("cpuid" : "=a" (cpuid_max_ext_eax) : "a" (0x80000000) : "ebx", "ecx", "edx");
 
@@ -103,6 +123,13 @@ void cpuid_init(void)
     {
         asm volatile ("cpuid" : "=c" (cpuid_features_ext_ecx), "=d" (cpuid_features_ext_edx) : "a" (0x80000001) : "ebx");
     }
+
+    // Advanced power management information, which says whether the TSC keeps running at a constant
+    // rate in all P-states and C-states
+    if (cpuid_max_ext_eax >= 0x80000007u)
+    {
+        asm volatile ("cpuid" : "=d" (cpuid_features_apm_edx) : "a" (0x80000007) : "ebx", "ecx");
+    }
 }
 
 bool cpuid_supports_feature_edx(cpuid_feature_edx f)
@@ -124,3 +151,18 @@ bool cpuid_supports_feature_ext_ecx(cpuid_feature_ext_ecx f)
 {
     return (cpuid_features_ext_ecx & (uint32)f) == (uint32)f;
 }
+
+bool cpuid_supports_feature_apm_edx(cpuid_feature_apm_edx f)
+{
+    return (cpuid_features_apm_edx & (uint32)f) == (uint32)f;
+}
+
+bool cpuid_supports_feature_mwait_ecx(cpuid_feature_mwait_ecx f)
+{
+    return (cpuid_features_mwait_ecx & (uint32)f) == (uint32)f;
+}
+
+bool cpuid_supports_feature_pm_eax(cpuid_feature_pm_eax f)
+{
+    return (cpuid_features_pm_eax & (uint32)f) == (uint32)f;
+}
@@ -0,0 +1,217 @@
+#include <cpu/fpu.h>
+#include <cpu/cpuid.h>
+#include <cpu/idt.h>
+#include <core/sched.h>
+#include <core/smp.h>
+#include <core/percpu.h>
+#include <core/crash.h>
+#include <memory/pool.h>
+#include <assert.h>
+
+#include <core/klog.h>
+
+#define CR0_TS (1 << 3)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+#define FPU_NM_VECTOR 7
+
+#define FXSAVE_AREA_SIZE 512
+#define FSAVE_AREA_SIZE 108
+
+#define MXCSR_DEFAULT 0x1F80
+
+#define FPU_NO_CPU 0xFFFFFFFF
+
+bool fpu_sse_enabled;
+static bool fxsr_enabled;
+
+static mempool_small fpu_state_pool;
+
+// The thread whose state was last loaded into this processor's FPU. If fpu_live is set, its state is
+// in the FPU registers right now and may differ from its saved copy. Otherwise, it has been saved,
+// but the registers still hold the same state unless fpu_owner is NULL.
+static struct sched_thread* fpu_owner __percpu;
+static bool fpu_live __percpu;
+
+static bool fpu_in_kernel __percpu;
+static uint32 fpu_kernel_eflags __percpu;
+
+static inline void clts(void)
+{
+    asm volatile ("clts");
+}
+
+static inline void stts(void)
+{
+    uint32 cr0;
+
+    asm volatile ("mov %%cr0, %0" : "=r" (cr0));
+    asm volatile ("mov %0, %%cr0" : : "r" (cr0 | CR0_TS));
+}
+
+static void fpu_save(void* state)
+{
+    if (fxsr_enabled)
+        asm volatile ("fxsave %0" : "=m" (*(uint8(*)[FXSAVE_AREA_SIZE])state));
+    else
+        asm volatile ("fnsave %0; fwait" : "=m" (*(uint8(*)[FSAVE_AREA_SIZE])state));
+}
+
+static void fpu_restore(const void* state)
+{
+    if (fxsr_enabled)
+        asm volatile ("fxrstor %0" : : "m" (*(const uint8(*)[FXSAVE_AREA_SIZE])state));
+    else
+        asm volatile ("frstor %0" : : "m" (*(const uint8(*)[FSAVE_AREA_SIZE])state));
+}
+
+static void fpu_nm_handle(regs32_t* r)
+{
+    sched_thread* t = __sched_thread_current();
+
+    // Nothing else ever sets CR0.TS, so the FPU must have been used outside of any thread or inside
+    // of kernel_fpu_begin with TS set by mistake.
+    if (t == NULL || percpu_read(fpu_in_kernel))
+        crash("FPU used outside of a thread");
+
+    clts();
+    percpu_write(fpu_live, true);
+
+    if (percpu_read(fpu_owner) == t && t->fpu_cpu == smp_cpu_index())
+        return;
+
+    if (t->fpu_state == NULL)
+    {
+        // This is the thread's first time using the FPU, so it starts with a clean state
+        if ((t->fpu_state = kmem_pool_small_alloc(&fpu_state_pool, 0)) == NULL)
+            crash("Failed to allocate FPU state");
+
+        asm volatile ("fninit");
+
+        if (fpu_sse_enabled)
+        {
+            uint32 mxcsr = MXCSR_DEFAULT;
+            asm volatile ("ldmxcsr %0" : : "m" (mxcsr));
+        }
+    }
+    else
+    {
+        fpu_restore(t->fpu_state);
+    }
+
+    percpu_write(fpu_owner, t);
+    t->fpu_cpu = smp_cpu_index();
+}
+
+void fpu_init(void)
+{
+    uint32 cr4;
+
+    fxsr_enabled = cpuid_supports_feature_edx(CPUID_FEATURE_EDX_FXSR);
+    fpu_sse_enabled = fxsr_enabled && cpuid_supports_feature_edx(CPUID_FEATURE_EDX_SSE);
+
+    if (fxsr_enabled)
+    {
+        asm volatile ("mov %%cr4, %0" : "=r" (cr4));
+        cr4 |= CR4_OSFXSR;
+
+        if (fpu_sse_enabled)
+            cr4 |= CR4_OSXMMEXCPT;
+
+        asm volatile ("mov %0, %%cr4" : : "r" (cr4));
+    }
+
+    // CR0.TS is kept set whenever no thread's state is live in the FPU
+    stts();
+
+    kmem_pool_small_init(&fpu_state_pool, "sched_thread fpu state", fxsr_enabled ? FXSAVE_AREA_SIZE : FSAVE_AREA_SIZE, 16, 0);
+    idt_register_isr_handler(FPU_NM_VECTOR, fpu_nm_handle);
+
+    klog(KLOG_LEVEL_INFO, "Lazy FPU switching enabled (%s)\n", fpu_sse_enabled ? "FXSAVE, SSE" : fxsr_enabled ? "FXSAVE" : "FSAVE");
+}
+
+void fpu_init_ap(void)
+{
+    stts();
+}
+
+void fpu_thread_init(sched_thread* t)
+{
+    t->fpu_state = NULL;
+    t->fpu_cpu = FPU_NO_CPU;
+}
+
+void fpu_thread_destroy(sched_thread* t)
+{
+    uint32 eflags = eflags_save();
+    asm volatile ("cli");
+
+    // Other processors may still think that this thread owns their FPU, but the thread's fpu_cpu
+    // can never match them again, so it doesn't matter if its memory is reused for another thread.
+    if (percpu_read(fpu_owner) == t)
+    {
+        percpu_write(fpu_owner, NULL);
+
+        if (percpu_read(fpu_live))
+        {
+            percpu_write(fpu_live, false);
+            stts();
+        }
+    }
+
+    eflags_load(eflags);
+
+    if (t->fpu_state != NULL)
+        kmem_pool_small_free(&fpu_state_pool, t->fpu_state);
+
+    t->fpu_state = NULL;
+}
+
+void fpu_switch_out(sched_thread* t)
+{
+    if (!percpu_read(fpu_live))
+        return;
+
+    assert(percpu_read(fpu_owner) == t);
+
+    fpu_save(t->fpu_state);
+
+    // FSAVE reinitializes the FPU, so the registers no longer hold the thread's state
+    if (!fxsr_enabled)
+        percpu_write(fpu_owner, NULL);
+
+    percpu_write(fpu_live, false);
+    stts();
+}
+
+void kernel_fpu_begin(void)
+{
+    uint32 eflags = eflags_save();
+    asm volatile ("cli");
+
+    assert(!percpu_read(fpu_in_kernel));
+
+    clts();
+
+    // The current thread's state has to be saved before the kernel clobbers the registers, and it
+    // will be loaded again the next time the thread uses the FPU.
+    if (percpu_read(fpu_live))
+        fpu_save(percpu_read(fpu_owner)->fpu_state);
+
+    percpu_write(fpu_owner, NULL);
+    percpu_write(fpu_live, false);
+
+    percpu_write(fpu_in_kernel, true);
+    percpu_write(fpu_kernel_eflags, eflags);
+}
+
+void kernel_fpu_end(void)
+{
+    assert(percpu_read(fpu_in_kernel));
+
+    percpu_write(fpu_in_kernel, false);
+    stts();
+
+    eflags_load(percpu_read(fpu_kernel_eflags));
+}
@@ -1,64 +1,100 @@
 #include <cpu/gdt.h>
+#include <core/percpu.h>
+#include <string.h>
 #include <assert.h>
 
-static gdt_pointer gdt_ptr;
-gdt_entry gdt_entries[GDT_NUM_ENTRIES];
+// Every processor has its own copy of the GDT, since the per-CPU segment has a different base on
+// each processor.
+static gdt_pointer gdt_ptr __percpu;
+gdt_entry gdt_entries[GDT_NUM_ENTRIES] __percpu;
 tss_entry tss_entries[GDT_NUM_TSS_ENTRIES];
 
-void gdt_init(void)
+static void _gdt_set(gdt_entry* entries, uint32 n, uint32 base, uint32 limit, uint8 access, uint8 flags)
 {
-    uint32 i;
+    gdt_entry* e;
+    assert(n < GDT_NUM_ENTRIES);
+
+    e = &entries[n];
+
+    // Set the GDT entry's base address
+    e->base_low = (uint16)(base & 0xFFFF);
+    e->base_mid = (uint8)((base >> 16) & 0xFF);
+    e->base_high = (uint8)((base >> 24) & 0xFF);
+
+    // Set the GDT entry's limit
+    e->limit_low = (uint16)(limit & 0xFFFF);
+    e->limit_high = (uint8)((limit >> 16) & 0xF);
+
+    // Set the access byte and flags
+    e->access = access;
+    e->flags = (uint8)(flags & 0xF);
+}
+
+static void _gdt_set_tss(gdt_entry* entries, uint32 n, tss_entry* tss)
+{
+    _gdt_set(entries, n, (uint32)tss, sizeof(tss_entry), 0x98, 0x4);
+}
+
+static void _gdt_load(uint32 percpu_base)
+{
+    gdt_entry* entries = (gdt_entry*)((uint8*)gdt_entries + percpu_base);
+    gdt_pointer* ptr = (gdt_pointer*)((uint8*)&gdt_ptr + percpu_base);
 
     // Set up the GDT pointer
-    gdt_ptr.base = (uint32)&gdt_entries;
-    gdt_ptr.limit = sizeof(gdt_entry) * GDT_NUM_ENTRIES - 1;
+    ptr->base = (uint32)entries;
+    ptr->limit = sizeof(gdt_entry) * GDT_NUM_ENTRIES - 1;
+
+    // 0x28 is the per-CPU data segment. Its base is set so that the linked address of a per-CPU
+    // variable refers to this processor's copy of it.
+    _gdt_set(entries, GDT_PERCPU / sizeof(gdt_entry), percpu_base, 0xFFFFFFFF, 0x92, 0xC);
+
+    // Flush the GDT
+    gdt_flush(ptr);
+}
+
+void gdt_init(void)
+{
+    uint32 percpu_base = percpu_init_bsp();
+    gdt_entry* entries = (gdt_entry*)((uint8*)gdt_entries + percpu_base);
+    uint32 i;
 
     // 0x00 is the NULL descriptor
-    gdt_set(0, 0x00000000, 0x00000000, 0x00, 0x0);
+    _gdt_set(entries, 0, 0x00000000, 0x00000000, 0x00, 0x0);
 
     // 0x08 is the kernel code segment
-    gdt_set(1, 0x00000000, 0xFFFFFFFF, 0x9A, 0xC);
+    _gdt_set(entries, 1, 0x00000000, 0xFFFFFFFF, 0x9A, 0xC);
 
     // 0x10 is the kernel data segment
-    gdt_set(2, 0x00000000, 0xFFFFFFFF, 0x92, 0xC);
+    _gdt_set(entries, 2, 0x00000000, 0xFFFFFFFF, 0x92, 0xC);
 
     // 0x18 is the user code segment
-    gdt_set(3, 0x00000000, 0xFFFFFFFF, 0xFA, 0xC);
+    _gdt_set(entries, 3, 0x00000000, 0xFFFFFFFF, 0xFA, 0xC);
 
     // 0x20 is the user data segment
-    gdt_set(4, 0x00000000, 0xFFFFFFFF, 0xF2, 0xC);
+    _gdt_set(entries, 4, 0x00000000, 0xFFFFFFFF, 0xF2, 0xC);
 
     // TODO: Initialize TSS entry values
 
     for (i = 0; i < GDT_NUM_TSS_ENTRIES; i++)
-        gdt_set_tss(GDT_NUM_ENTRIES - i - 1, &tss_entries[i]);
+        _gdt_set_tss(entries, GDT_NUM_ENTRIES - i - 1, &tss_entries[i]);
 
-    // Flush the GDT
-    gdt_flush(&gdt_ptr);
+    _gdt_load(percpu_base);
 }
 
-void gdt_set(uint32 n, uint32 base, uint32 limit, uint8 access, uint8 flags)
+void gdt_init_ap(uint32 percpu_base)
 {
-    gdt_entry* e;
-    assert(n < GDT_NUM_ENTRIES);
+    // Application processors start out with a copy of the bootstrap processor's GDT
+    memcpy((uint8*)gdt_entries + percpu_base, (uint8*)gdt_entries + percpu_offsets[0], sizeof(gdt_entries));
 
-    e = &gdt_entries[n];
-
-    // Set the GDT entry's base address
-    e->base_low = (uint16)(base & 0xFFFF);
-    e->base_mid = (uint8)((base >> 16) & 0xFF);
-    e->base_high = (uint8)((base >> 24) & 0xFF);
-
-    // Set the GDT entry's limit
-    e->limit_low = (uint16)(limit & 0xFFFF);
-    e->limit_high = (uint8)((limit >> 16) & 0xF);
+    _gdt_load(percpu_base);
+}
 
-    // Set the access byte and flags
-    e->access = access;
-    e->flags = (uint8)(flags & 0xF);
+void gdt_set(uint32 n, uint32 base, uint32 limit, uint8 access, uint8 flags)
+{
+    _gdt_set(percpu_ptr(gdt_entries)[0], n, base, limit, access, flags);
 }
 
 void gdt_set_tss(uint32 n, tss_entry* tss)
 {
-    gdt_set(n, (uint32)&tss - 0xC0000000, sizeof(tss_entry), 0x98, 0x4);
+    _gdt_set_tss(percpu_ptr(gdt_entries)[0], n, tss);
 }
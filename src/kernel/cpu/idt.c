@@ -1,4 +1,7 @@
 #include <cpu/idt.h>
+#include <core/softirq.h>
+#include <core/preempt.h>
+#include <core/sched.h>
 #include <hwio.h>
 #include <assert.h>
 
@@ -27,6 +30,13 @@
 #define COMMAND_EOI 0x20
 #define COMMAND_READ_ISR 0x0A
 
+// The type of an IDT entry is in the low bits of its flags. Interrupt gates disable interrupts on
+// entry, while trap gates leave them alone.
+#define GATE_TYPE_MASK 0x0F
+#define GATE_TYPE_INTERRUPT 0x0E
+
+#define EFLAGS_IF (1 << 9)
+
 typedef void (*asm_int_handler)(void);
 
 // These point to arrays of pointers to assembly functions that provide
@@ -159,6 +169,12 @@ void idt_init(void)
     remap_pic(IDT_IRQS_START, IDT_IRQS_START + 8);
 }
 
+void idt_init_ap(void)
+{
+    // Application processors share the IDT set up by the bootstrap processor
+    idt_flush(&idt_ptr);
+}
+
 void idt_set_entry(uint32 n, uint32 offset, uint16 selector, uint8 flags)
 {
     idt_entry* e;
@@ -273,6 +289,8 @@ bool _idt_is_ring0(regs32* r)
 void _idt_handle(regs32* r)
 {
     interrupt_handler handler = 0;
+    uint32 eflags = r->eflags;
+    bool hardirq = false;
 
     // Find the proper handler and perform IRQ pre-handling code if needed
     if (r->int_no < IDT_NUM_ISRS)
@@ -294,6 +312,15 @@ void _idt_handle(regs32* r)
         handler = ext_handlers[r->int_no - IDT_EXT_START];
     }
 
+    // Softirqs are only run after handlers that can't block, i.e. those that are entered through an
+    // interrupt gate. Exceptions are left out, since an NMI may arrive anywhere.
+    if (r->int_no >= IDT_IRQS_START && (idt_entries[r->int_no].flags & GATE_TYPE_MASK) == GATE_TYPE_INTERRUPT)
+    {
+        hardirq = true;
+        preempt_count_inc();
+        softirq_irq_enter();
+    }
+
     // Call the relevant handler
     if (handler != 0) (*handler)(r);
     else if (r->int_no < IDT_NUM_ISRS) crash("Unhandled ISR!");
@@ -303,4 +330,11 @@ void _idt_handle(regs32* r)
     {
         irq_end(r);
     }
+
+    if (hardirq)
+    {
+        preempt_count_dec();
+        softirq_irq_exit((eflags & EFLAGS_IF) != 0);
+        sched_irq_exit(r, (eflags & EFLAGS_IF) != 0);
+    }
 }
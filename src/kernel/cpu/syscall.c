@@ -0,0 +1,79 @@
+#include <cpu/syscall.h>
+#include <cpu/cpuid.h>
+#include <cpu/msr.h>
+#include <cpu/gdt.h>
+#include <cpu/idt.h>
+#include <core/percpu.h>
+#include <assert.h>
+
+#include <core/klog.h>
+
+#define MSR_SYSENTER_CS 0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+// SYSENTER and SYSEXIT don't read the GDT, but assume that the kernel data segment and the user code
+// and data segments follow the kernel code segment in this order
+_Static_assert(GDT_KERNEL_DATA == GDT_KERNEL_CODE + 8 && GDT_USER_CODE == GDT_KERNEL_CODE + 16 && GDT_USER_DATA == GDT_KERNEL_CODE + 24,
+    "SYSENTER requires the kernel and user segments to be laid out consecutively");
+
+bool syscall_sysenter_enabled;
+uint32 syscall_stack_top __percpu;
+
+static syscall_function syscall_table[SYSCALL_MAX];
+
+extern void _syscall_sysenter(void);
+uint32 _syscall_dispatch(uint32 n, uint32 a, uint32 b, uint32 c, uint32 d) __hidden;
+
+uint32 _syscall_dispatch(uint32 n, uint32 a, uint32 b, uint32 c, uint32 d)
+{
+    syscall_function fn;
+
+    if (n >= SYSCALL_MAX || (fn = syscall_table[n]) == NULL)
+        return (uint32)-E_NOT_SUPPORTED;
+
+    return fn(a, b, c, d);
+}
+
+static void syscall_int_handle(regs32_t* r)
+{
+    r->eax = _syscall_dispatch(r->eax, r->ebx, r->esi, r->edi, r->ebp);
+}
+
+static void sysenter_init_msrs(void)
+{
+    msr_write(MSR_SYSENTER_CS, GDT_KERNEL_CODE);
+
+    // SYSENTER can't load the kernel stack itself, since it changes with every thread switch. Instead,
+    // it starts out on this processor's copy of syscall_stack_top, and the entry code loads the stack
+    // from there.
+    msr_write(MSR_SYSENTER_ESP, (uint32)percpu_ptr(syscall_stack_top));
+    msr_write(MSR_SYSENTER_EIP, (uint32)_syscall_sysenter);
+}
+
+void syscall_init(void)
+{
+    // Early Pentium Pro processors report SEP without actually supporting SYSENTER
+    syscall_sysenter_enabled = msr_is_supported() && cpuid_supports_feature_edx(CPUID_FEATURE_EDX_SEP)
+        && !(cpuid_family_id == 6 && cpuid_model_id < 3);
+
+    idt_register_ext_handler(SYSCALL_VECTOR - IDT_EXT_START, syscall_int_handle);
+
+    if (syscall_sysenter_enabled)
+        sysenter_init_msrs();
+
+    klog(KLOG_LEVEL_INFO, "System calls enabled (%s)\n", syscall_sysenter_enabled ? "SYSENTER" : "INT 0x80");
+}
+
+void syscall_init_ap(void)
+{
+    if (syscall_sysenter_enabled)
+        sysenter_init_msrs();
+}
+
+void syscall_register(uint32 n, syscall_function fn)
+{
+    assert(n < SYSCALL_MAX);
+
+    syscall_table[n] = fn;
+}
@@ -0,0 +1,74 @@
+#include <cpu/tsc.h>
+#include <cpu/cpuid.h>
+#include <core/clock.h>
+#include <lock/spinlock.h>
+
+#include <core/klog.h>
+
+// How long to measure the TSC against the reference clocksource for
+#define TSC_CALIBRATE_MS 100
+
+bool tsc_invariant;
+uint64 tsc_frequency;
+
+static uint64 tsc_clock_read(void)
+{
+    return tsc_read();
+}
+
+static clocksource tsc_clocksource = {
+    .name = "tsc",
+    .read = tsc_clock_read,
+    .rdtsc = true
+};
+
+static uint64 tsc_calibrate(const clocksource* ref)
+{
+    uint64 ref_counts = ref->frequency * TSC_CALIBRATE_MS / 1000;
+    uint64 ref_start, ref_now;
+    uint64 tsc_start, tsc_end;
+    uint32 eflags;
+
+    // The reference may be the scheduler tick, which only advances with interrupts enabled
+    eflags = eflags_save();
+    asm volatile ("sti");
+
+    // Wait for the reference to change, so that the measurement starts on the edge of one of its
+    // counts rather than somewhere in the middle
+    ref_start = ref->read();
+    while ((ref_now = ref->read()) == ref_start)
+        asm volatile ("pause");
+
+    tsc_start = tsc_read();
+    ref_start = ref_now;
+
+    while ((ref_now = ref->read()) < ref_start + ref_counts)
+        asm volatile ("pause");
+
+    tsc_end = tsc_read();
+
+    eflags_load(eflags);
+
+    return (tsc_end - tsc_start) * ref->frequency / (ref_now - ref_start);
+}
+
+void tsc_init(void)
+{
+    if (!cpuid_supports_feature_edx(CPUID_FEATURE_EDX_TSC))
+    {
+        klog(KLOG_LEVEL_WARN, "Processor has no TSC\n");
+        return;
+    }
+
+    tsc_invariant = cpuid_supports_feature_apm_edx(CPUID_FEATURE_APM_EDX_INVARIANT_TSC);
+    tsc_frequency = tsc_calibrate(clock_current_source());
+
+    klog(KLOG_LEVEL_INFO, "TSC runs at %ld kHz (%s)\n", tsc_frequency / 1000, tsc_invariant ? "invariant" : "not invariant");
+
+    // A TSC that isn't invariant may change speed or stop in deep sleep states, but is still more
+    // precise than the tick
+    tsc_clocksource.frequency = tsc_frequency;
+    tsc_clocksource.rating = tsc_invariant ? CLOCK_RATING_TSC_INVARIANT : CLOCK_RATING_TSC;
+
+    clock_register(&tsc_clocksource);
+}
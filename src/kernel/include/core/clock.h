@@ -0,0 +1,75 @@
+#ifndef CORE_CLOCK_H
+#define CORE_CLOCK_H
+
+#include <typedef.h>
+
+#define NANOSECONDS_PER_SECOND 1000000000ull
+
+// Ratings of the clocksources that the kernel knows about. The usable clocksource with the highest
+// rating is used to keep time.
+#define CLOCK_RATING_TICK 10
+#define CLOCK_RATING_TSC 100
+#define CLOCK_RATING_HPET 200
+#define CLOCK_RATING_TSC_INVARIANT 300
+
+/*
+ * A clocksource is a free-running counter that the kernel can read to find out
+ * how much time has passed. The kernel keeps a monotonic nanosecond clock on
+ * top of the best clocksource that has been registered. When a better one is
+ * registered, the clock carries on from where the old one left off.
+ *
+ * Counters are assumed to never wrap around, and to be synchronized between
+ * processors. If they are slightly out of sync, the clock may appear to go
+ * backwards by a small amount when read from different processors.
+ */
+typedef struct clocksource
+{
+    const char* name;
+    uint32 rating;
+
+    uint64 (*read)(void);
+    uint64 frequency;
+
+    // Set if the counter is the TSC, which user code can read itself through the time page
+    bool rdtsc;
+
+    // Filled in by clock_register, so that a number of counts can be converted to nanoseconds
+    // without division
+    uint32 mult;
+    uint32 shift;
+} clocksource;
+
+/**
+ * Sets up the kernel clock and registers the clocksources that are always
+ * available. Must be called after the scheduler has been initialized, since
+ * clocksources are calibrated against its ticks.
+ */
+extern void clock_init(void) __hidden;
+
+/**
+ * Makes a clocksource available to the kernel clock, which switches to it if
+ * it is better than the clocksource currently in use. The frequency of the
+ * clocksource must already be known.
+ */
+extern void clock_register(clocksource* cs);
+
+/**
+ * Gets the clocksource that the kernel clock is currently using, or NULL if
+ * clock_init has not been called yet.
+ */
+extern const clocksource* clock_current_source(void);
+
+/**
+ * Gets the number of nanoseconds that have passed since the kernel clock was
+ * initialized.
+ */
+extern uint64 clock_now_ns(void);
+
+/**
+ * Busy-waits for at least the given number of microseconds. This works with
+ * interrupts disabled unless the kernel has no clocksource other than the
+ * scheduler tick.
+ */
+extern void clock_delay_us(uint32 microseconds);
+
+#endif
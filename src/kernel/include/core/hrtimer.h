@@ -0,0 +1,67 @@
+#ifndef CORE_HRTIMER_H
+#define CORE_HRTIMER_H
+
+#include <typedef.h>
+#include <core/timer.h>
+#include <rbtree.h>
+
+/*
+ * High-resolution timers expire at a time measured by the kernel clock rather
+ * than on a tick, and are driven by a one-shot HPET event, so they can fire
+ * long before the next tick without the tick rate having to be raised. They
+ * are kept in a tree ordered by expiry time, and the HPET event is always armed
+ * for the earliest one.
+ *
+ * Timer functions are called on the bootstrap processor from the HPET event's
+ * interrupt with interrupts disabled, so they must not block. If no HPET event
+ * is available, high-resolution timers cannot be armed at all, and callers
+ * should fall back to tick-based timers.
+ */
+typedef struct hrtimer
+{
+    uint64 expires_ns;
+
+    timer_function function;
+    void* arg;
+
+    rbtree_node node;
+    bool pending;
+} hrtimer;
+
+/**
+ * Claims an HPET event for high-resolution timers. Must be called once, after
+ * the HPET has been initialized.
+ */
+extern void hrtimer_init_queue(void) __hidden;
+
+/**
+ * Returns true if high-resolution timers can be armed.
+ */
+extern bool hrtimer_available(void) __pure;
+
+extern void hrtimer_init(hrtimer* t, timer_function function, void* arg);
+
+/**
+ * Arms the given timer so that its function is called once the given number of
+ * nanoseconds have passed. If the timer is already pending, it is moved to the
+ * new expiry time instead. Returns false without arming the timer if
+ * high-resolution timers are not available.
+ */
+extern bool hrtimer_arm(hrtimer* t, uint64 delay_ns) __warn_unused_result;
+
+/**
+ * Cancels the given timer if it is pending. Returns true if the timer was
+ * pending, or false if it had already expired or was never armed.
+ */
+extern bool hrtimer_cancel(hrtimer* t);
+
+/**
+ * Cancels the given timer like hrtimer_cancel, but also waits for its function
+ * to finish if it is being run on another processor. Must not be called from
+ * the timer's own function.
+ */
+extern bool hrtimer_cancel_sync(hrtimer* t);
+
+extern bool hrtimer_is_pending(const hrtimer* t);
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef CORE_IDLE_H
+#define CORE_IDLE_H
+
+#include <typedef.h>
+#include <core/bootparam.h>
+
+#define IDLE_MAX_STATES 8
+
+/*
+ * A processor that has nothing to run is put into an idle state until it is
+ * needed again. Deeper states save more power, but take longer to wake up from
+ * and only pay off if the processor stays in them for long enough, so a
+ * governor picks the deepest state whose target residency fits how long the
+ * processor is expected to stay idle. That is predicted from how long it has
+ * stayed idle recently, and is capped by when its next timer is due.
+ *
+ * State 0 polls, which wakes up the fastest but saves no power, and is only
+ * used when even the shallowest halting state would not pay off or when poll
+ * mode is enabled. The other states halt the processor, either with HLT or,
+ * if the processor supports it, with MWAIT and the C-states that ACPI lists in
+ * the processor's _CST object. A processor that is polling or waiting in MWAIT
+ * is woken up by a write to memory rather than by an interrupt.
+ */
+typedef enum
+{
+    IDLE_TYPE_POLL,
+    IDLE_TYPE_HLT,
+    IDLE_TYPE_MWAIT
+} idle_state_type;
+
+typedef struct idle_state
+{
+    char name[8];
+    idle_state_type type;
+    uint32 mwait_hint;
+
+    // How long the processor takes to wake up from the state, and how long it has to stay in it for
+    // it to be worth entering
+    uint32 exit_latency_us;
+    uint32 target_residency_us;
+} idle_state;
+
+/**
+ * Sets up the idle states that are always available. Must be called after
+ * cpuid_init and before the scheduler is initialized. Poll mode is enabled if
+ * idle=poll is passed on the command line.
+ */
+extern void idle_init(const boot_param* param) __hidden;
+
+/**
+ * Replaces the idle states with those listed in the _CST object of the first
+ * processor in the ACPI namespace, if there is one. Must be called after the
+ * ACPI namespace has been loaded and before the application processors are
+ * started.
+ */
+extern void idle_init_acpi(void) __hidden;
+
+/**
+ * Enables or disables poll mode, in which idle processors always poll. This
+ * gives the lowest possible wakeup latency at the cost of power.
+ */
+extern void idle_set_poll(bool poll);
+
+extern uint32 idle_num_states(void) __pure;
+extern const idle_state* idle_get_state(uint32 i) __pure;
+
+/**
+ * Puts this processor into the idle state picked by the governor, given the
+ * number of nanoseconds until its next timer is due. Must be called by the
+ * idle thread with interrupts disabled, and returns with interrupts disabled
+ * after an interrupt has been handled or the processor has been woken up by
+ * idle_wake. Returns true in the latter case, in which case the idle thread
+ * must call into the scheduler itself.
+ */
+extern bool idle_enter(uint64 next_event_ns) __hidden;
+
+/**
+ * Called by the scheduler with interrupts disabled when this processor stops
+ * being idle, since that can happen from an interrupt without idle_enter
+ * returning.
+ */
+extern void idle_exit(void) __hidden;
+
+/**
+ * Wakes up the given processor if it is polling or waiting in MWAIT. Returns
+ * false if it isn't, in which case it must be sent an interrupt instead.
+ */
+extern bool idle_wake(uint32 cpu) __hidden;
+
+#endif
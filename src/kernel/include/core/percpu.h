@@ -0,0 +1,59 @@
+#ifndef CORE_PERCPU_H
+#define CORE_PERCPU_H
+
+#include <typedef.h>
+#include <core/smp.h>
+
+/*
+ * Variables marked with __percpu (see typedef.h) are placed in the .percpu section, which is
+ * used as a template for a separate copy of those variables on every
+ * processor. The GS segment of each processor is based such that accessing a
+ * per-CPU variable at its linked address through GS accesses that processor's
+ * own copy.
+ *
+ * Per-CPU variables must only be accessed through the accessors below. Values
+ * read are only meaningful while interrupts are disabled, since the current
+ * thread may otherwise be moved to another processor, except for values which
+ * are the same on any processor the current thread runs on (e.g. the current
+ * thread itself).
+ */
+#define PERCPU_ALIGN 64
+
+#define _percpu_check_size(var) \
+    _Static_assert(sizeof(var) == 1 || sizeof(var) == 2 || sizeof(var) == 4, "per-CPU accessors only support 1, 2 and 4 byte values")
+
+#define percpu_read(var) ({ \
+    __typeof__(var) __percpu_val; \
+    _percpu_check_size(var); \
+    asm volatile ("mov %%gs:%1, %0" : "=q" (__percpu_val) : "m" (var)); \
+    __percpu_val; \
+})
+
+#define percpu_write(var, val) do { \
+    __typeof__(var) __percpu_val = (val); \
+    _percpu_check_size(var); \
+    asm volatile ("mov %1, %%gs:%0" : "=m" (var) : "q" (__percpu_val)); \
+} while (0)
+
+#define percpu_ptr(var) ((__typeof__(var)*)((uint8*)&(var) + percpu_read(percpu_offset)))
+#define percpu_ptr_cpu(var, cpu) ((__typeof__(var)*)((uint8*)&(var) + percpu_offsets[cpu]))
+
+extern const uint8 _ld_percpu_begin[];
+extern const uint8 _ld_percpu_end[];
+
+extern uint32 percpu_offset __percpu;
+extern uint32 percpu_offsets[SMP_MAX_CPUS];
+
+/**
+ * Sets up the per-CPU area of the given processor by copying the template into
+ * the provided memory, which must be PERCPU_ALIGN aligned and at least
+ * percpu_area_size() bytes in size. Returns the base that should be used for
+ * the processor's GS segment.
+ */
+extern uint32 percpu_init_area(uint32 cpu, void* area) __hidden;
+extern uint32 percpu_init_bsp(void) __hidden;
+extern void* percpu_alloc_area(void) __hidden;
+
+extern size_t percpu_area_size(void) __const;
+
+#endif
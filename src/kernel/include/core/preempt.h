@@ -0,0 +1,78 @@
+#ifndef CORE_PREEMPT_H
+#define CORE_PREEMPT_H
+
+#include <typedef.h>
+
+/*
+ * Kernel code can be preempted wherever interrupts are enabled, except while
+ * the processor's preempt count is non-zero. The count is raised while holding
+ * a spinlock, while running an interrupt handler or softirqs, and between
+ * preempt_disable and preempt_enable.
+ *
+ * When the scheduler wants to preempt the current thread but can't right away,
+ * it sets sched_need_resched, and the switch happens at the next preemption
+ * point instead: when the count drops back to zero in spinlock_release or
+ * preempt_enable with interrupts enabled, or when an interrupt returns to code
+ * that can be preempted.
+ *
+ * The count is only ever changed by single instructions, so that it stays
+ * right even if an interrupt arrives in the middle of changing it.
+ */
+extern uint32 preempt_count __percpu;
+extern volatile bool sched_need_resched __percpu;
+
+/**
+ * Switches away from the current thread if sched_need_resched is set and it
+ * can be preempted. Called by preempt_check_resched.
+ */
+extern void sched_preempt(void);
+
+static inline uint32 preempt_count_read(void)
+{
+    uint32 count;
+
+    asm volatile ("movl %%gs:%1, %0" : "=r" (count) : "m" (preempt_count));
+    return count;
+}
+
+static inline void preempt_count_inc(void)
+{
+    asm volatile ("incl %%gs:%0" : "+m" (preempt_count) : : "memory");
+}
+
+static inline void preempt_count_dec(void)
+{
+    asm volatile ("decl %%gs:%0" : "+m" (preempt_count) : : "memory");
+}
+
+/**
+ * A preemption point. Must be called whenever the preempt count may have
+ * dropped to zero or interrupts may have been enabled.
+ */
+static inline void preempt_check_resched(void)
+{
+    bool need_resched;
+
+    asm volatile ("movb %%gs:%1, %0" : "=q" (need_resched) : "m" (sched_need_resched));
+
+    if (need_resched && preempt_count_read() == 0)
+        sched_preempt();
+}
+
+/**
+ * Keeps the current thread from being preempted without disabling interrupts,
+ * e.g. while it uses per-CPU data. The thread must not block until it calls
+ * preempt_enable.
+ */
+static inline void preempt_disable(void)
+{
+    preempt_count_inc();
+}
+
+static inline void preempt_enable(void)
+{
+    preempt_count_dec();
+    preempt_check_resched();
+}
+
+#endif
@@ -4,6 +4,10 @@
 #include <typedef.h>
 #include <core/bootparam.h>
 #include <memory/page.h>
+#include <memory/stack.h>
+#include <core/timer.h>
+#include <core/hrtimer.h>
+#include <rbtree.h>
 
 #define STS_RUNNING 0
 #define STS_READY 1
@@ -13,15 +17,69 @@
 
 #define PIT_IRQ 0
 #define CONTEXT_SWITCH_INTERRUPT 0x90
+#define SCHED_RESCHEDULE_VECTOR 0xA1
 
 #define TICKS_PER_SECOND 250
 #define TICKS_BEFORE_PREEMPT 10
+#define TICKS_BETWEEN_REBALANCE 25
+#define TICKS_CACHE_HOT 2
+#define TICKS_FAIR_PERIOD (TICKS_BEFORE_PREEMPT * 2)
 #define PIT_TICK_DIVISOR (1193182 / TICKS_PER_SECOND)
 #define MILLISECONDS_PER_TICK (1000 / TICKS_PER_SECOND)
+#define NANOSECONDS_PER_TICK (1000000000ull / TICKS_PER_SECOND)
+
+#define THREAD_STACK_SIZE KMEM_STACK_SIZE
+
+// Passed to functions that take a timeout in nanoseconds to wait for as long as it takes
+#define SCHED_NO_TIMEOUT (~0ull)
+
+// An affinity mask that lets a thread run on any processor
+#define SCHED_AFFINITY_ALL (~0u)
+
+/*
+ * Every thread has a priority from 0 to SCHED_NUM_PRIORITIES - 1, where lower
+ * numbers are more important. Priorities below SCHED_NUM_RT_PRIORITIES make up
+ * the real-time class: a ready real-time thread always runs before any thread of
+ * the fair class, preempting it if necessary, and only shares the processor
+ * with real-time threads of the same priority.
+ *
+ * The rest make up the fair class, where the priority of a thread only sets its
+ * weight. Each processor always runs the fair thread that has received the
+ * least CPU time relative to its weight (its virtual runtime), so fair threads
+ * get CPU time in proportion to their weights no matter which process they
+ * belong to. A fair priority can also be given as a nice value from -8 to 7.
+ */
+#define SCHED_NUM_PRIORITIES 32
+#define SCHED_NUM_RT_PRIORITIES 16
+#define SCHED_PRIO_FAIR_MAX SCHED_NUM_RT_PRIORITIES
+#define SCHED_PRIO_FAIR_MIN (SCHED_NUM_PRIORITIES - 1)
+#define SCHED_PRIO_DEFAULT 24
+
+// Used as a thread's inherited priority when it hasn't inherited one
+#define SCHED_PRIO_NONE SCHED_NUM_PRIORITIES
+
+#define SCHED_PRIO_IS_RT(p) ((p) < SCHED_NUM_RT_PRIORITIES)
+#define SCHED_PRIO_FROM_NICE(n) (SCHED_PRIO_DEFAULT + (n))
 
 struct sched_process;
 struct sched_thread;
 struct mutex;
+struct workqueue_worker;
+
+/*
+ * CPU accounting for a thread or process. Times are measured in TSC cycles.
+ * Wait time is the time spent ready to run but waiting for a processor, and a
+ * switch is involuntary if the thread was preempted rather than giving up the
+ * processor by itself.
+ */
+typedef struct
+{
+    uint64 run_cycles;
+    uint64 wait_cycles;
+    uint64 voluntary_switches;
+    uint64 involuntary_switches;
+    uint64 wakeups;
+} sched_stats;
 
 typedef struct
 {
@@ -49,12 +107,15 @@ typedef struct sched_process
 
     uint64 next_tid;
     struct sched_thread* first_thread;
-    sched_thread_queue thread_run_queue;
+
+    // Accounting for threads that have already ended, protected by lock
+    sched_stats exited_stats;
 
     sched_process_queue* in_queue;
     struct sched_process* next_in_queue;
 
     struct sched_process* next;
+    struct sched_process* next_in_hash;
 } sched_process;
 
 typedef struct sched_thread
@@ -63,7 +124,38 @@ typedef struct sched_thread
     uint64 tid;
 
     uint32 status;
-    unsigned long long sleep_until;
+    timer sleep_timer;
+    hrtimer sleep_hrtimer;
+
+    // The wait queue that the thread is waiting in with a timeout, if any. The sleep timers remove the
+    // thread from it under its lock if it is still there when they expire.
+    sched_thread_queue* wait_queue;
+    bool wait_timed_out;
+
+    // The thread runs with the more important of the priority it was given and the priority it has
+    // inherited from threads waiting for mutexes it holds (see lock/mutex.h)
+    uint32 priority;
+    uint32 base_priority;
+    uint32 inherited_priority;
+    uint32 time_slice;
+
+    // Index of the processor whose run queue the thread is waiting in, plus one, or zero if it is not
+    // waiting to run. Fair threads wait in a tree rather than a thread queue.
+    uint32 queued_on;
+    rbtree_node fair_node;
+    uint32 queued_weight;
+
+    unsigned long long vruntime;
+
+    // TSC values for when the thread started running and when it became ready, or 0 if it is not
+    // running or not waiting to run. These and stats are protected by stats_lock. woken_at is when
+    // the thread was last woken up, or 0 if it is waiting to run for another reason, and is set by
+    // whoever wakes it up before it is placed in a run queue.
+    spinlock stats_lock;
+    sched_stats stats;
+    uint64 run_start;
+    uint64 ready_since;
+    uint64 woken_at;
 
     spinlock registers_lock;
     volatile bool registers_dirty;
@@ -72,23 +164,39 @@ typedef struct sched_thread
     void* stack_low;
     void* stack_high;
 
+    uint32 last_cpu;
+    unsigned long long last_run;
+
+    // Processors that the thread may run on, with bit i standing for the processor with index i.
+    // Changes are serialized by the same lock as priority changes.
+    uint32 affinity;
+
+    // Allocated the first time the thread uses the FPU (see cpu/fpu.h)
+    void* fpu_state;
+    uint32 fpu_cpu;
+
+    // The process's thread list is protected by the process's lock
     struct sched_thread* next_in_process;
+    struct sched_thread* prev_in_process;
+    struct sched_thread* next_in_hash;
 
     sched_thread_queue* in_queue;
     struct sched_thread* next_in_queue;
 
     struct mutex* held_mutexes;
+    struct mutex* blocked_on;
+
+    // Set if the thread is a workqueue worker, so that its pool can be told when it blocks
+    struct workqueue_worker* worker;
 
 #ifdef SCHED_DEBUG
     unsigned long long creation;
-    unsigned long long run_ticks;
 #endif
 } sched_thread;
 
 typedef void (*sched_thread_function)(void* arg);
 
 extern unsigned long long ticks;
-extern sched_process_queue process_run_queue;
 
 extern spinlock process_list_spinlock;
 extern sched_process* first_process;
@@ -101,6 +209,39 @@ extern sched_process* kernel_process;
  */
 extern void sched_init(const boot_param* param);
 
+/**
+ * Sets up the scheduler on an application processor and starts running threads
+ * on it. The given stack, which the processor was started up on, is taken over
+ * by the processor's idle thread.
+ */
+extern void sched_init_ap(void* stack_low, void* stack_high) __attribute__((noreturn)) __hidden;
+
+/**
+ * Switches the scheduler over to a dynamic tick driven by one-shot local APIC
+ * timer events. Idle processors then stop receiving timer interrupts entirely,
+ * and the timekeeping processor's periodic tick is only kept running while
+ * some processor is busy. Must be called on the bootstrap processor after the
+ * local APIC timer has been calibrated, and before any application processors
+ * have been started. Passing no_dynamic_tick on the command line keeps the
+ * periodic tick on every processor.
+ */
+extern void sched_enable_dynamic_tick(const boot_param* param) __hidden;
+
+/**
+ * Brings ticks up to date if this is the timekeeping processor and its tick is
+ * currently stopped. This must be called before using ticks from an interrupt
+ * handler that may have woken up an idle system, e.g. to arm a timer.
+ */
+extern void sched_tick_sync(void);
+
+/**
+ * The preemption point on return from an interrupt, called by _idt_handle with
+ * interrupts disabled once the handler and any softirqs have finished. Makes
+ * any thread switch that was put off in the meantime if the interrupted code
+ * can be preempted.
+ */
+extern void sched_irq_exit(regs32_t* r, bool interrupts_enabled) __hidden;
+
 /*
  * IMPORTANT: sched_process_current and sched_thread_current are marked as
  * constant functions, even though they actually aren't. However, they always
@@ -118,6 +259,11 @@ extern sched_thread* sched_thread_current(void) __const;
 extern sched_process* __sched_process_current(void);
 extern sched_thread* __sched_thread_current(void);
 
+/**
+ * Finds a process or thread by its ID, or returns NULL if there is none. These
+ * don't take any locks, so they can be called from anywhere, but nothing stops
+ * the process or thread from being destroyed as soon as they return.
+ */
 extern sched_process* sched_find_process(uint64 pid) __pure;
 extern sched_thread* sched_find_thread(sched_process* process, uint64 tid) __pure;
 
@@ -125,25 +271,130 @@ extern int sched_process_create(const char* name, sched_process** process) __war
 extern void sched_process_destroy(sched_process* process);
 
 extern int sched_thread_create(sched_process* process, sched_thread_function func, void* arg, sched_thread** thread) __warn_unused_result;
+
+/**
+ * Frees a thread that has ended. Must be called with the lock of the thread's
+ * process held. The thread's kernel stack is left alone, since the thread may
+ * still be running on it, and must be freed by the caller once the lock has
+ * been released.
+ */
 extern void sched_thread_destroy(sched_thread* thread);
 
+/**
+ * Changes the priority of the given thread. A thread that is waiting to run is
+ * moved to its new run queue right away, while a running or blocked thread uses
+ * its new priority the next time it is made ready. If the thread has inherited
+ * a more important priority, it keeps running with that one until the
+ * inherited priority is dropped. Returns E_INVALID if the priority is out of
+ * range.
+ */
+extern int sched_thread_set_priority(sched_thread* thread, uint32 priority);
+
+/**
+ * Restricts the given thread to the processors whose bits are set in the given
+ * mask, where bit i stands for the processor with index i. A thread that is
+ * waiting to run is moved to one of those processors right away, and a thread
+ * that is running elsewhere is preempted so that it can be moved. Returns
+ * E_INVALID if none of the processors in the mask are online.
+ */
+extern int sched_thread_set_affinity(sched_thread* thread, uint32 mask);
+extern uint32 sched_thread_get_affinity(const sched_thread* thread) __pure;
+
+/**
+ * Sets the priority that the given thread has inherited, or SCHED_PRIO_NONE if
+ * it should only run with its own priority again.
+ */
+extern void sched_thread_set_inherited_priority(sched_thread* thread, uint32 priority) __hidden;
+
+/**
+ * Gets the CPU accounting of the given thread, including the time it has spent
+ * running or waiting so far if it is running or waiting right now.
+ */
+extern void sched_thread_get_stats(sched_thread* thread, sched_stats* stats);
+
+/**
+ * Gets the CPU accounting of the given process, i.e. the sum of the accounting
+ * of all of its threads, including those that have already ended.
+ */
+extern void sched_process_get_stats(sched_process* process, sched_stats* stats);
+
+/**
+ * Logs each processor's wakeup latency and run queue delay histograms, i.e.
+ * how long threads it has switched to took to start running after they were
+ * woken up and after they were placed in a run queue, along with the longest
+ * delay of each kind and the thread that suffered it.
+ */
+extern void sched_latency_dump(void);
+
+/**
+ * Clears the histograms logged by sched_latency_dump.
+ */
+extern void sched_latency_reset(void);
+
 extern void sched_thread_queue_init(sched_thread_queue* queue);
 extern void sched_process_queue_init(sched_process_queue* queue);
 
 extern void sched_thread_wake(sched_thread* thread);
 
+/**
+ * Wakes up every thread in the given wait queue at once, leaving it empty. Must
+ * be called with the queue's lock held.
+ */
+extern void sched_thread_wake_all(sched_thread_queue* queue);
+
+/**
+ * Wakes up the given thread like sched_thread_wake, and gives it the rest of
+ * this processor's time right away instead of leaving it to wait for its turn.
+ * The current thread stays ready to run. If the thread is less important than
+ * the current one, can't run on this processor or the current thread can't be
+ * switched out, this does the same as sched_thread_wake.
+ */
+extern void sched_thread_wake_yield(sched_thread* thread);
+
 extern void sched_thread_enqueue(sched_thread_queue* queue, sched_thread* thread);
 extern sched_thread* sched_thread_dequeue(sched_thread_queue* queue);
 
+/**
+ * Removes the given thread from anywhere in the given queue. Returns false if
+ * the thread was not in the queue.
+ */
+extern bool sched_thread_queue_remove(sched_thread_queue* queue, sched_thread* thread);
+
 extern void sched_process_enqueue(sched_process_queue* queue, sched_process* process);
 extern sched_process* sched_process_dequeue(sched_process_queue* queue);
 extern void sched_process_force_dequeue(sched_process* process);
 
+/**
+ * Switches this processor to another thread by rewriting the interrupt frame
+ * r. If r is NULL, the current thread's registers must already have been saved
+ * and the caller is responsible for switching to the new thread's stack.
+ */
 extern void sched_switch_thread(sched_thread* thread, regs32_t* r);
 extern void sched_switch_any(regs32_t* r);
 
+/**
+ * Gives up the processor. This switches stacks directly rather than going
+ * through an interrupt, and only the callee-saved registers are preserved.
+ */
 extern void sched_yield(void);
+
+/**
+ * Gives up the processor like sched_yield, for a thread that has set its status
+ * to STS_BLOCKING and put itself in the given wait queue. If nobody has taken it
+ * out of the queue and woken it up once the given number of nanoseconds have
+ * passed, it is removed from the queue and woken up anyway. Must be called with
+ * interrupts disabled and without holding the queue's lock. Returns false if the
+ * thread timed out.
+ */
+extern bool sched_yield_timeout(sched_thread_queue* queue, uint64 nanoseconds);
 extern void sched_sleep(uint64 milliseconds);
+
+/**
+ * Sleeps for at least the given number of nanoseconds. This is precise if
+ * high-resolution timers are available, and may otherwise last up to one tick
+ * longer, since the sleep can only end on a tick.
+ */
+extern void sched_sleep_ns(uint64 nanoseconds);
 extern void sched_thread_end(void) __attribute__((noreturn));
 
 #endif
@@ -0,0 +1,56 @@
+#ifndef CORE_SMP_H
+#define CORE_SMP_H
+
+#include <typedef.h>
+#include <core/bootparam.h>
+#include <memory/page.h>
+
+#define SMP_MAX_CPUS 32
+
+#define SMP_TLB_SHOOTDOWN_VECTOR 0xA8
+
+typedef struct smp_cpu
+{
+    uint32 index;
+    uint8 apic_id;
+    uint8 acpi_id;
+
+    volatile bool online;
+    volatile bool tlb_shootdown_pending;
+} smp_cpu;
+
+extern smp_cpu smp_cpus[SMP_MAX_CPUS];
+extern uint32 smp_num_cpus;
+extern volatile uint32 smp_num_online;
+
+/**
+ * Enumerates the processors listed in the ACPI MADT and starts all application
+ * processors. Must be called after ACPI tables have been loaded and the
+ * scheduler has been initialized.
+ */
+extern void smp_init(const boot_param* param) __hidden;
+
+/**
+ * Gets the index of the processor that is currently executing. This is always
+ * 0 before application processors have been started. The result is only stable
+ * while interrupts are disabled, since the current thread may otherwise be
+ * migrated to another processor.
+ */
+extern uint32 smp_cpu_index(void);
+extern smp_cpu* smp_cpu_current(void);
+
+/**
+ * Asks every other online processor to flush the given range of pages from its
+ * TLB and waits until they have done so. Passing 0 for num_pages flushes the
+ * entire TLB. This must not be called while holding a spinlock or from an
+ * interrupt handler, i.e. with a non-zero preempt count.
+ */
+extern void smp_tlb_shootdown(addr_v address, uint32 num_pages);
+
+/**
+ * Stops all other processors. This is used when the kernel crashes, and the
+ * other processors cannot be resumed afterwards.
+ */
+extern void smp_halt_others(void);
+
+#endif
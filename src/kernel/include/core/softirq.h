@@ -0,0 +1,80 @@
+#ifndef CORE_SOFTIRQ_H
+#define CORE_SOFTIRQ_H
+
+#include <typedef.h>
+
+/*
+ * Softirqs are the second half of interrupt handling. An interrupt handler
+ * runs with interrupts disabled, so it should only do what has to be done
+ * right away (e.g. acknowledging the device and draining its FIFO) and raise a
+ * softirq for the rest. Raised softirqs are run on the same processor once the
+ * outermost interrupt handler returns, with interrupts enabled, so that other
+ * interrupts are not held up by them.
+ *
+ * Softirq functions must not block, and they run with the preempt count raised
+ * (see core/preempt.h), so a thread switch that is asked for in the meantime
+ * happens once they have finished. Since every processor runs the softirqs
+ * raised on it, the same softirq function may run on several processors at
+ * once, and must lock any data that isn't per-CPU. Only a given tasklet
+ * is guaranteed never to run on two processors at once.
+ *
+ * If softirqs keep being raised while they run, or are raised while no
+ * interrupt handler is running, the rest are handed off to a worker thread on
+ * the same processor so that they can't starve threads. Until the worker pools
+ * have been set up, application processors leave them for their next
+ * interrupt instead.
+ */
+typedef enum
+{
+    SOFTIRQ_TIMER,
+    SOFTIRQ_TASKLET,
+    SOFTIRQ_NUM
+} softirq_vector;
+
+typedef void (*softirq_function)(void);
+
+typedef void (*tasklet_function)(void* arg);
+
+/*
+ * A tasklet is a function that is run from a softirq, and can be scheduled by
+ * any interrupt handler that needs it. It runs on the processor that scheduled
+ * it, but never on two processors at once. Scheduling a tasklet again before
+ * it has started running does nothing, while scheduling it again while it is
+ * running makes it run once more afterwards.
+ */
+typedef struct tasklet
+{
+    tasklet_function function;
+    void* arg;
+
+    struct tasklet* next;
+
+    volatile bool scheduled;
+    volatile bool running;
+} tasklet;
+
+extern void softirq_register(softirq_vector n, softirq_function fn) __hidden;
+
+/**
+ * Marks the given softirq as pending on this processor.
+ */
+extern void softirq_raise(softirq_vector n);
+
+/**
+ * Called by _idt_handle around every IRQ and extended interrupt handler that is
+ * entered through an interrupt gate, since those can't block. Pending softirqs
+ * are run when the outermost one returns, as long as the code it interrupted
+ * had interrupts enabled.
+ */
+extern void softirq_irq_enter(void) __hidden;
+extern void softirq_irq_exit(bool interrupts_enabled) __hidden;
+
+extern void tasklet_init(tasklet* t, tasklet_function function, void* arg);
+
+/**
+ * Schedules a tasklet to run on this processor. Returns false if it was
+ * already scheduled.
+ */
+extern bool tasklet_schedule(tasklet* t);
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef CORE_TIME_PAGE_H
+#define CORE_TIME_PAGE_H
+
+#include <typedef.h>
+
+// The last page below the kernel, which is mapped read-only into every address space
+#define TIME_PAGE_ADDRESS 0xBFFFF000u
+
+typedef enum
+{
+    // Only the time as of the last tick is known, since the clocksource can't be read from user mode
+    TIME_PAGE_CLOCK_COARSE,
+
+    // The time can be worked out precisely from the TSC
+    TIME_PAGE_CLOCK_TSC
+} time_page_clock;
+
+/*
+ * The time page lets user code read the kernel clock without a system call.
+ * The kernel updates it on every tick and whenever the clocksource changes.
+ * Readers must retry if seq was odd or changed while they were reading, since
+ * that means that the page was being updated.
+ *
+ * In TIME_PAGE_CLOCK_TSC mode, the time in nanoseconds is base_ns plus the
+ * number of TSC counts since base_counts converted using mult and shift, in
+ * the same way as clock_now_ns. Otherwise, it is coarse_ns, which is only
+ * updated once per tick. Adding wall_offset_ns to either gives the wall-clock
+ * time in nanoseconds since the Unix epoch, if it is known (i.e. not 0).
+ */
+typedef struct time_page
+{
+    uint32 seq;
+    uint32 clock;
+
+    uint64 ticks;
+    uint64 coarse_ns;
+
+    uint64 base_counts;
+    uint64 base_ns;
+    uint32 mult;
+    uint32 shift;
+
+    int64 wall_offset_ns;
+} time_page;
+
+struct clocksource;
+struct page_context;
+
+/**
+ * Allocates the time page. Must be called before clock_init and before any
+ * address spaces other than the kernel's are created.
+ */
+extern void time_page_init(void) __hidden;
+
+/**
+ * Maps the time page into the given address space. Called by
+ * kmem_page_context_create.
+ */
+extern bool time_page_map(struct page_context* c) __hidden __warn_unused_result;
+
+/**
+ * Called by the timekeeping processor on every tick to publish the tick count
+ * and the coarse time. Must be called with interrupts disabled.
+ */
+extern void time_page_tick(unsigned long long ticks) __hidden;
+
+/**
+ * Called by clock_register when the kernel clock switches to another
+ * clocksource, with the count and the time at which it did.
+ */
+extern void time_page_set_clock(const struct clocksource* cs, uint64 base_counts, uint64 base_ns) __hidden;
+
+/**
+ * Sets the wall-clock time, in nanoseconds since the Unix epoch, that
+ * corresponds to the current value of the kernel clock.
+ */
+extern void time_page_set_wall_clock(uint64 wall_ns);
+
+/**
+ * Reads the time in nanoseconds from the given time page like clock_now_ns.
+ * This only uses unprivileged instructions, so that it can be used from user
+ * mode through TIME_PAGE_ADDRESS.
+ */
+static inline uint64 time_page_read_ns(const time_page* tp)
+{
+    uint32 seq;
+    uint32 clock;
+    uint64 counts;
+    uint64 ns;
+    uint32 hi, lo;
+
+    do
+    {
+        seq = __atomic_load_n(&tp->seq, __ATOMIC_ACQUIRE);
+
+        clock = tp->clock;
+        ns = tp->coarse_ns;
+
+        if (clock == TIME_PAGE_CLOCK_TSC)
+        {
+            asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+            counts = (uint64)lo | ((uint64)hi << 32);
+
+            // The count may have been taken on a processor whose TSC is slightly behind
+            ns = tp->base_ns;
+
+            if (counts > tp->base_counts)
+            {
+                counts -= tp->base_counts;
+                hi = (uint32)(counts >> 32);
+                lo = (uint32)counts;
+
+                ns += (((uint64)hi * tp->mult) << (32 - tp->shift)) + (((uint64)lo * tp->mult) >> tp->shift);
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) != 0 || seq != __atomic_load_n(&tp->seq, __ATOMIC_RELAXED));
+
+    return ns;
+}
+
+#endif
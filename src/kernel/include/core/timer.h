@@ -0,0 +1,79 @@
+#ifndef CORE_TIMER_H
+#define CORE_TIMER_H
+
+#include <typedef.h>
+
+typedef void (*timer_function)(void* arg);
+
+/*
+ * Kernel timers are kept in a hierarchical timer wheel indexed by the tick on
+ * which they expire, so arming and cancelling a timer takes constant time no
+ * matter how many timers are pending. Timers have a resolution of one tick.
+ *
+ * Timer functions are called from the timer softirq on the timekeeping
+ * processor, so they must not block. They may arm or cancel any
+ * timer, including the one that is being run.
+ *
+ * A timer must be initialized with timer_init before use, and the memory it is
+ * stored in must stay valid for as long as the timer is pending.
+ */
+typedef struct timer
+{
+    unsigned long long expires;
+
+    timer_function function;
+    void* arg;
+
+    struct timer* next;
+    struct timer* prev;
+    struct timer** bucket;
+} timer;
+
+/**
+ * Sets up the timer wheel. This function should only be called once, during
+ * kernel initialization.
+ */
+extern void timer_init_wheel(void) __hidden;
+
+extern void timer_init(timer* t, timer_function function, void* arg);
+
+/**
+ * Arms the given timer so that its function is called once the given number of
+ * ticks have passed. If the timer is already pending, it is moved to the new
+ * expiry time instead.
+ */
+extern void timer_arm(timer* t, uint64 delay_ticks);
+extern void timer_arm_at(timer* t, unsigned long long expires);
+
+/**
+ * Cancels the given timer if it is pending. Returns true if the timer was
+ * pending, or false if it had already expired or was never armed. This does not
+ * wait for the timer's function to finish if it is currently being run on
+ * another processor.
+ */
+extern bool timer_cancel(timer* t);
+
+/**
+ * Cancels the given timer like timer_cancel, but also waits for its function to
+ * finish if it is being run on another processor, so that the function is no
+ * longer using anything it was given once this returns. Must not be called from
+ * the timer's own function.
+ */
+extern bool timer_cancel_sync(timer* t);
+
+extern bool timer_is_pending(const timer* t);
+
+/**
+ * Runs the functions of all timers that expired at or before the given tick.
+ * Must only be called from the timer softirq.
+ */
+extern void timer_run(unsigned long long now) __hidden;
+
+/**
+ * Gets the earliest tick on which timer_run may have any timers to run, or ~0
+ * if no timers are pending. This may be earlier than the actual expiry time of
+ * the next timer, but it is never later.
+ */
+extern unsigned long long timer_next_expiry(void) __hidden;
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef CORE_WORKQUEUE_H
+#define CORE_WORKQUEUE_H
+
+#include <typedef.h>
+#include <core/sched.h>
+#include <lock/spinlock.h>
+
+// The most kernel threads that each processor's worker pool will ever start
+#define WORKQUEUE_MAX_WORKERS 8
+
+/*
+ * A work item is a function that is run later in a kernel thread, so that code
+ * which cannot block (e.g. an interrupt handler) or which should not have to
+ * wait can hand off work that may block. Work items are embedded in whatever
+ * structure they operate on, so queueing one never needs to allocate memory.
+ *
+ * Every processor has its own pool of worker threads, and work is run by the
+ * pool of the processor it was queued on. A pool normally only lets one of its
+ * workers run at a time, but when a running work item blocks, another worker
+ * is woken up to carry on with the rest of the pool's work, and more workers
+ * are started as needed up to WORKQUEUE_MAX_WORKERS.
+ *
+ * A work item can only be queued once at a time. Queueing it again while it is
+ * still waiting to run does nothing, while queueing it again while it is
+ * running makes it run once more on the same pool afterwards, so a work item
+ * never runs on two processors at once.
+ *
+ * The worker doesn't touch a work item again once its function has returned,
+ * unless it was queued again while running, so a work function may free its
+ * own work item.
+ */
+typedef void (*work_function)(void* arg);
+
+struct workqueue_pool;
+struct workqueue_worker;
+
+/*
+ * Work items are queued through a workqueue, which keeps track of how many of
+ * its work items have not finished yet so that they can all be waited for at
+ * once. Subsystems that need to wait for their own work can set up their own
+ * workqueue, and everything else can use system_workqueue.
+ */
+typedef struct workqueue
+{
+    const char* name;
+
+    spinlock lock;
+    uint32 in_flight;
+    sched_thread_queue flushers;
+} workqueue;
+
+typedef struct work
+{
+    work_function function;
+    void* arg;
+
+    struct workqueue* wq;
+
+    // The pool that the work item was last queued on. pending is set when the work item is queued and
+    // cleared once it starts running, while the rest is protected by the pool's lock.
+    struct workqueue_pool* pool;
+    struct work* next;
+
+    volatile bool pending;
+    bool queued;
+} work;
+
+extern workqueue system_workqueue;
+
+/**
+ * Sets up a worker pool for every processor. Must be called once, after the
+ * application processors have been started. Work can already be queued before
+ * this, but doesn't run until the pools have been set up.
+ */
+extern void workqueue_init_pools(void) __hidden;
+
+/**
+ * Returns true if work that is queued on the current processor also runs on
+ * it. Until workqueue_init_pools has been called, all work runs on the
+ * bootstrap processor.
+ */
+extern bool workqueue_runs_locally(void);
+
+extern void workqueue_init(workqueue* wq, const char* name);
+
+/**
+ * Waits until every work item that has been queued through the given workqueue
+ * has finished running, including any that are queued while waiting.
+ */
+extern void workqueue_flush(workqueue* wq);
+
+extern void work_init(work* w, work_function function, void* arg);
+
+/**
+ * Queues a work item on the current processor's pool. This can be called from
+ * an interrupt handler. Returns false if the work item was already waiting to
+ * run, in which case it will still only run once.
+ */
+extern bool work_queue(workqueue* wq, work* w);
+
+/**
+ * Stops a work item from running if it is waiting to run, and then waits for
+ * it to finish if it is running. Must not be called from the work item itself.
+ * Returns true if the work item was waiting to run.
+ */
+extern bool work_cancel(work* w);
+
+/**
+ * Waits until the given work item is neither waiting to run nor running. Must
+ * not be called from the work item itself.
+ */
+extern void work_flush(work* w);
+
+extern bool work_is_pending(const work* w);
+
+/**
+ * Called by the scheduler when a worker thread is about to block and when it is
+ * made ready again, so that its pool can wake up another worker in the meantime.
+ * Both are called with interrupts disabled.
+ */
+extern void workqueue_worker_sleeping(sched_thread* t) __hidden;
+extern void workqueue_worker_waking(sched_thread* t) __hidden;
+
+#endif
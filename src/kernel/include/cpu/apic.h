@@ -0,0 +1,38 @@
+#ifndef CORE_APIC_H
+#define CORE_APIC_H
+
+#include <typedef.h>
+#include <memory/page.h>
+
+#define APIC_TIMER_VECTOR 0xA0
+#define APIC_SPURIOUS_VECTOR 0xBF
+
+#define APIC_ICR_DELIVERY_FIXED   (0x0 << 8)
+#define APIC_ICR_DELIVERY_NMI     (0x4 << 8)
+#define APIC_ICR_DELIVERY_INIT    (0x5 << 8)
+#define APIC_ICR_DELIVERY_STARTUP (0x6 << 8)
+#define APIC_ICR_LEVEL_ASSERT     (1 << 14)
+#define APIC_ICR_TRIGGER_LEVEL    (1 << 15)
+#define APIC_ICR_DEST_SELF        (1 << 18)
+#define APIC_ICR_DEST_ALL         (2 << 18)
+#define APIC_ICR_DEST_OTHERS      (3 << 18)
+
+extern bool apic_enabled;
+extern uint32 apic_timer_counts_per_ms;
+
+extern bool apic_is_supported(void) __const;
+
+extern void apic_init(addr_p base) __hidden;
+extern void apic_init_ap(void) __hidden;
+
+extern uint8 apic_get_id(void);
+extern void apic_eoi(void);
+extern void apic_send_ipi(uint8 apic_id, uint32 flags);
+
+extern void apic_timer_calibrate(void) __hidden;
+extern void apic_timer_set_periodic(uint8 vector, uint32 count);
+extern void apic_timer_set_oneshot(uint8 vector, uint32 count);
+extern uint32 apic_timer_get_current(void);
+extern void apic_timer_stop(void);
+
+#endif
@@ -100,6 +100,24 @@ typedef enum
     CPUID_FEATURE_EXT_EDX_LONG_MODE = (1 << 29)
 } cpuid_feature_ext_edx;
 
+typedef enum
+{
+    CPUID_FEATURE_APM_EDX_INVARIANT_TSC = (1 << 8)
+} cpuid_feature_apm_edx;
+
+// MONITOR/MWAIT leaf (EAX=5)
+typedef enum
+{
+    CPUID_FEATURE_MWAIT_ECX_EMX = (1 << 0),
+    CPUID_FEATURE_MWAIT_ECX_IBE = (1 << 1)
+} cpuid_feature_mwait_ecx;
+
+// Thermal and power management leaf (EAX=6)
+typedef enum
+{
+    CPUID_FEATURE_PM_EAX_ARAT = (1 << 2)
+} cpuid_feature_pm_eax;
+
 extern const cpuid_vendor* cpuid_detected_vendor;
 extern uint8 cpuid_max_eax;
 
@@ -107,11 +125,18 @@ extern uint8 cpuid_processor_type;
 extern uint16 cpuid_family_id;
 extern uint8 cpuid_model_id;
 
+// The number of MWAIT sub-states that each C-state has, four bits per C-state starting with C0 in the
+// lowest bits, or 0 if MONITOR/MWAIT is not supported
+extern uint32 cpuid_mwait_substates;
+
 extern void cpuid_init(void) __hidden;
 
 extern bool cpuid_supports_feature_edx(cpuid_feature_edx f) __const;
 extern bool cpuid_supports_feature_ecx(cpuid_feature_ecx f) __const;
 extern bool cpuid_supports_feature_ext_edx(cpuid_feature_ext_edx f) __const;
 extern bool cpuid_supports_feature_ext_ecx(cpuid_feature_ext_ecx f) __const;
+extern bool cpuid_supports_feature_apm_edx(cpuid_feature_apm_edx f) __const;
+extern bool cpuid_supports_feature_mwait_ecx(cpuid_feature_mwait_ecx f) __const;
+extern bool cpuid_supports_feature_pm_eax(cpuid_feature_pm_eax f) __const;
 
 #endif
@@ -0,0 +1,45 @@
+#ifndef CPU_FPU_H
+#define CPU_FPU_H
+
+#include <typedef.h>
+
+struct sched_thread;
+
+/*
+ * FPU and SSE state is switched lazily. CR0.TS is set whenever a thread is
+ * switched out, so the first FPU or SSE instruction that the next thread runs
+ * raises #NM, and only then is that thread's state loaded. Threads that never
+ * touch the FPU never have any state allocated for them, and a thread that
+ * comes back to the processor that last loaded its state doesn't have to load
+ * it again.
+ */
+
+extern bool fpu_sse_enabled;
+
+/**
+ * Enables FXSAVE and SSE support if the processor has them and sets up lazy FPU
+ * switching. Must be called on the bootstrap processor before any application
+ * processors have been started, since they copy its CR4.
+ */
+extern void fpu_init(void) __hidden;
+extern void fpu_init_ap(void) __hidden;
+
+extern void fpu_thread_init(struct sched_thread* t) __hidden;
+extern void fpu_thread_destroy(struct sched_thread* t) __hidden;
+
+/**
+ * Saves the FPU state of the given thread if it has used the FPU since it was
+ * switched in, and sets CR0.TS. Must be called with interrupts disabled while
+ * the thread is being switched out, before another processor can run it.
+ */
+extern void fpu_switch_out(struct sched_thread* t) __hidden;
+
+/**
+ * Allows the kernel to use FPU and SSE instructions until kernel_fpu_end is
+ * called. Interrupts are disabled in between, so the code in between must not
+ * block, and calls to these functions cannot be nested.
+ */
+extern void kernel_fpu_begin(void);
+extern void kernel_fpu_end(void);
+
+#endif
@@ -11,6 +11,7 @@
 #define GDT_KERNEL_DATA 0x10
 #define GDT_USER_CODE 0x18
 #define GDT_USER_DATA 0x20
+#define GDT_PERCPU 0x28
 
 typedef struct
 {
@@ -42,10 +43,12 @@ typedef struct
     uint8 iopb[GDT_IOPB_SIZE];
 } __attribute__((packed)) tss_entry;
 
-extern gdt_entry gdt_entries[GDT_NUM_ENTRIES];
+// gdt_set and gdt_set_tss only affect the GDT of the current processor
+extern gdt_entry gdt_entries[GDT_NUM_ENTRIES] __percpu;
 extern tss_entry tss_entries[GDT_NUM_TSS_ENTRIES];
 
 extern void gdt_init(void) __hidden;
+extern void gdt_init_ap(uint32 percpu_base) __hidden;
 extern void gdt_set(uint32 n, uint32 base, uint32 limit, uint8 access, uint8 flags);
 extern void gdt_set_tss(uint32 n, tss_entry* tss);
 
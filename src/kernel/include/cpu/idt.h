@@ -32,6 +32,7 @@ typedef struct
 } __attribute__((packed)) idt_pointer;
 
 extern void idt_init(void) __hidden;
+extern void idt_init_ap(void) __hidden;
 extern void idt_set_entry(uint32 n, uint32 offset, uint16 selector, uint8 flags);
 
 extern void idt_register_isr_handler(uint32 n, interrupt_handler handler);
@@ -5,6 +5,10 @@
 #define MSR_EFER 0xC0000080
 #define MSR_EFER_FLAG_NX (1 << 11)
 
+#define MSR_APIC_BASE 0x1B
+#define MSR_APIC_BASE_FLAG_BSP (1 << 8)
+#define MSR_APIC_BASE_FLAG_ENABLE (1 << 11)
+
 extern bool msr_is_supported(void) __const;
 
 extern uint64 msr_read(uint32 msr) __pure;
@@ -0,0 +1,54 @@
+#ifndef CPU_SYSCALL_H
+#define CPU_SYSCALL_H
+
+#define SYSCALL_VECTOR 0x80
+#define SYSCALL_MAX 64
+
+#ifndef __ASSEMBLY__
+#include <typedef.h>
+
+/*
+ * System calls take their number in EAX and up to four arguments in EBX, ESI,
+ * EDI and EBP, and return their result in EAX. Unknown system calls return
+ * -E_NOT_SUPPORTED.
+ *
+ * If the processor supports SYSENTER, user code calls into the kernel with it,
+ * after putting the address to return to in EDX and the stack pointer to
+ * return with in ECX. ECX and EDX are clobbered, and so are TF, which is
+ * cleared, and IF, which is set. All other registers and flags are carried
+ * through unchanged. Otherwise, INT SYSCALL_VECTOR is used instead, which
+ * preserves everything but EAX.
+ *
+ * The SYSENTER path only saves what it needs to return to user mode. The
+ * rest of the registers are preserved by the C calling convention, so no
+ * interrupt frame is built. This makes it much cheaper than the INT path.
+ */
+typedef uint32 (*syscall_function)(uint32 a, uint32 b, uint32 c, uint32 d);
+
+// Set if system calls can be made with SYSENTER
+extern bool syscall_sysenter_enabled;
+
+// The top of the current thread's kernel stack, which SYSENTER switches to
+extern uint32 syscall_stack_top __percpu;
+
+/**
+ * Sets up system call entry through INT SYSCALL_VECTOR and, if the processor
+ * supports it, SYSENTER. Must be called on the bootstrap processor before any
+ * application processors have been started.
+ */
+extern void syscall_init(void) __hidden;
+extern void syscall_init_ap(void) __hidden;
+
+extern void syscall_register(uint32 n, syscall_function fn);
+
+/**
+ * Sets the kernel stack that system calls made on this processor run on. Must
+ * be called with interrupts disabled whenever a thread is switched in.
+ */
+static inline void syscall_set_kernel_stack(void* stack_high)
+{
+    asm volatile ("movl %1, %%gs:%0" : "=m" (syscall_stack_top) : "r" ((uint32)stack_high));
+}
+#endif
+
+#endif
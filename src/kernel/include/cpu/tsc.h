@@ -0,0 +1,31 @@
+#ifndef CPU_TSC_H
+#define CPU_TSC_H
+
+#include <typedef.h>
+
+// Set if the TSC runs at a constant rate in all power states, in which case it is used as the kernel's
+// main clocksource
+extern bool tsc_invariant;
+
+// The number of times the TSC increments per second, or 0 if it could not be calibrated
+extern uint64 tsc_frequency;
+
+/**
+ * Calibrates the TSC against the current clocksource and registers it as a
+ * clocksource. Called by clock_init.
+ */
+extern void tsc_init(void) __hidden;
+
+/**
+ * Reads the processor's time stamp counter. This is not a serializing
+ * instruction, so it may be reordered with the instructions around it.
+ */
+static inline uint64 tsc_read(void)
+{
+    uint32 lo, hi;
+
+    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return (uint64)lo | ((uint64)hi << 32);
+}
+
+#endif
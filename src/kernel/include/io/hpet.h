@@ -0,0 +1,44 @@
+#ifndef IO_HPET_H
+#define IO_HPET_H
+
+#include <typedef.h>
+#include <core/timer.h>
+
+// Each comparator that is used for events gets its own vector
+#define HPET_VECTOR_BASE 0xA4
+#define HPET_MAX_EVENTS 4
+
+/*
+ * The HPET is found through the ACPI HPET table. Its main counter is registered
+ * as a clocksource, and each of its comparators that can deliver interrupts
+ * straight to a local APIC can be claimed for one-shot events. Event functions
+ * are called on the bootstrap processor from the comparator's interrupt, with
+ * interrupts disabled.
+ */
+typedef struct hpet_event hpet_event;
+
+// The number of times the main counter increments per second, or 0 if there is no HPET
+extern uint64 hpet_frequency;
+
+/**
+ * Finds and enables the HPET. Must be called after ACPI tables have been
+ * loaded and the local APIC has been enabled.
+ */
+extern void hpet_init(void) __hidden;
+
+/**
+ * Claims a free comparator for one-shot events, which call the given function
+ * when they fire. Returns NULL if there is no HPET or all comparators that can
+ * be used for events have already been claimed.
+ */
+extern hpet_event* hpet_event_alloc(timer_function function, void* arg);
+
+/**
+ * Arms the event so that it fires once after the given number of nanoseconds,
+ * replacing any earlier deadline. Very long delays are cut short, so the
+ * function must be prepared to be called early and arm the event again.
+ */
+extern void hpet_event_arm(hpet_event* e, uint64 delay_ns);
+extern void hpet_event_cancel(hpet_event* e);
+
+#endif
@@ -6,6 +6,7 @@
 #include <typedef.h>
 #include <lock/spinlock.h>
 #include <lock/condvar.h>
+#include <core/softirq.h>
 
 struct serial_port;
 
@@ -25,6 +26,7 @@ typedef struct serial_port
     int recv_buf_head;
     int recv_buf_tail;
     cond_var_s recv_buf_ready;
+    tasklet recv_tasklet;
 
     char* send_buf;
     int send_buf_len;
@@ -32,6 +34,7 @@ typedef struct serial_port
     int send_buf_head;
     int send_buf_tail;
     cond_var_s send_buf_ready;
+    tasklet send_tasklet;
 } serial_port;
 
 extern serial_port serial_ports[NUM_SERIAL_PORTS];
@@ -13,6 +13,14 @@ typedef struct cond_var
 
 void cond_var_init(cond_var* v, mutex* m);
 void cond_var_wait(cond_var* v);
+
+/**
+ * Waits on the condition variable like cond_var_wait, but stops waiting once the
+ * given number of nanoseconds have passed. The lock is held again when this
+ * returns either way. Returns false if the timeout passed before the condition
+ * variable was signalled.
+ */
+bool cond_var_wait_timeout(cond_var* v, uint64 timeout_ns);
 void cond_var_signal(cond_var* v);
 void cond_var_broadcast(cond_var* v);
 
@@ -23,6 +23,13 @@
  * These mutexes are not re-entrant. Attempting to acquire a mutex that is already held by the
  * current thread will result in the kernel crashing.
  *
+ * Mutexes use priority inheritance: while a thread is waiting for a mutex, its owner runs with at
+ * least the waiting thread's priority, and so does the owner of any mutex that owner is waiting
+ * for in turn. This keeps a less important thread that holds a mutex from being preempted
+ * indefinitely while a more important thread needs the mutex. A thread gives up an inherited
+ * priority when it releases the mutex it inherited it through, or when the thread it inherited it
+ * from stops waiting because its timeout has passed.
+ *
  * No fields on this structure should ever be accessed directly, as they need to be handled using
  * special atomic operations. Instead, functions such as \link mutex_acquire \endlink should be used
  * to indirectly modify the state of the mutex.
@@ -63,6 +70,21 @@ extern void mutex_init(mutex* m);
  */
 extern void mutex_acquire(mutex* m);
 
+/**
+ * \brief Attempts to acquire the given mutex, blocking for at most the given amount of time if the
+ *        mutex is currently held.
+ *
+ * This behaves like \link mutex_acquire \endlink, except that the thread gives up waiting once the
+ * timeout has passed. The wait is precise if high-resolution timers are available, and is otherwise
+ * rounded up to a whole number of ticks.
+ *
+ * \param m The mutex which is being acquired.
+ * \param timeout_ns The most time to wait for in nanoseconds, or SCHED_NO_TIMEOUT to wait forever.
+ *
+ * \return true if the mutex was acquired, and false if the timeout passed first.
+ */
+extern bool mutex_acquire_timeout(mutex* m, uint64 timeout_ns);
+
 /**
  * \brief Attempts to acquire the given mutex.
  *
@@ -93,4 +115,33 @@ extern bool mutex_try_acquire(mutex* m);
  */
 extern void mutex_release(mutex* m);
 
+/**
+ * \brief Releases the given mutex like \link mutex_release \endlink, and lets the thread that it is
+ *        given to run right away.
+ *
+ * Normally, the next owner only runs once the scheduler gets around to it, and the mutex stays
+ * unusable until then. Here, the rest of the current thread's time is handed to the new owner
+ * instead, as long as it is at least as important as the current thread and can run on this
+ * processor. The current thread stays ready to run.
+ *
+ * \param m The mutex which is being released.
+ */
+extern void mutex_release_handoff(mutex* m);
+
+/**
+ * \brief Moves threads that are blocked in the given wait queue onto the wait queue of the given
+ *        mutex, as if they had blocked trying to acquire it.
+ *
+ * The threads are not woken up until the mutex is handed to them by \link mutex_release \endlink,
+ * which is used by condition variables so that woken threads don't all contend for the mutex at
+ * once. The mutex must be held by the current thread.
+ *
+ * \param m The mutex which the threads should wait for.
+ * \param queue The wait queue which the threads are taken from.
+ * \param all Whether every thread should be moved, rather than only the first one.
+ *
+ * \return true if any threads were moved.
+ */
+extern bool mutex_requeue_waiters(mutex* m, sched_thread_queue* queue, bool all) __hidden;
+
 #endif
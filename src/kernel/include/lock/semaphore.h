@@ -16,6 +16,12 @@ typedef struct semaphore
 extern void semaphore_init(semaphore* s, int value);
 
 extern void semaphore_wait(semaphore* s);
+
+/**
+ * Waits for the semaphore like semaphore_wait, but gives up once the given
+ * number of nanoseconds have passed. Returns false if the timeout passed first.
+ */
+extern bool semaphore_wait_timeout(semaphore* s, uint64 timeout_ns);
 extern bool semaphore_try_wait(semaphore* s);
 extern void semaphore_signal(semaphore* s);
 
@@ -11,6 +11,7 @@
 #define LOCK_SPINLOCK_H
 
 #include <typedef.h>
+#include <core/preempt.h>
 
 /**
  * \brief A simple spinlock which can be acquired and released atomically.
@@ -64,7 +65,8 @@ void _spinlock_acquire(spinlock* lock, uint32 eflags);
  *        to acquire it.
  *
  * While the spinlock is held, all interrupts will be disabled on the current processor to ensure
- * that an interrupt handler will not attempt to acquire the same spinlock.
+ * that an interrupt handler will not attempt to acquire the same spinlock, and the processor's
+ * preempt count is raised.
  *
  * \warning Calling this function to acquire a spinlock that you already hold will cause the
  *          processor to hang, as it is waiting for itself to release the spinlock. Interrupts
@@ -101,7 +103,8 @@ uint32 _spinlock_release(spinlock* lock);
  * \brief Releases the given spinlock, allowing another processor to acquire it.
  *
  * This function also restores the interrupt flag from when this spinlock was acquired, which will
- * cause interrupts to be enabled if they were enabled when acquiring the spinlock.
+ * cause interrupts to be enabled if they were enabled when acquiring the spinlock. If that was the
+ * last spinlock held and interrupts are enabled again, this is a preemption point.
  *
  * \warning A call to this function must always be preceeded by a corresponding call to either
  *          \link spinlock_acquire \endlink or \link spinlock_try_acquire \endlink. Attempting to
@@ -115,6 +118,10 @@ uint32 _spinlock_release(spinlock* lock);
  *
  * \param lock The spinlock to release.
  */
-static inline void spinlock_release(spinlock* lock) { eflags_load(_spinlock_release(lock)); }
+static inline void spinlock_release(spinlock* lock)
+{
+    eflags_load(_spinlock_release(lock));
+    preempt_check_resched();
+}
 
 #endif
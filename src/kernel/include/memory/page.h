@@ -87,7 +87,7 @@ typedef struct page_table_legacy
 } page_table_legacy __attribute__((aligned(0x1000)));
 
 extern page_context kernel_page_context;
-extern page_context* active_page_context;
+extern page_context* active_page_context __percpu;
 
 extern bool kmem_page_pae_enabled;
 extern bool kmem_page_pge_enabled;
@@ -122,6 +122,14 @@ void kmem_page_global_unmap(addr_v virtual_address, bool flush);
 void kmem_page_set_temp_fault_handler(jmp_buf env, volatile addr_v* fault_address, volatile uint32* fault_reason);
 void kmem_page_clear_temp_fault_handler(void);
 
+// The local flush functions only affect the TLB of the current processor. They are safe to call while
+// holding a spinlock and are sufficient after mapping a page that was previously not present. The
+// other flush functions also flush the TLBs of all other processors and must not be called while
+// holding a spinlock.
+void kmem_page_flush_local_one(addr_v virtual_address);
+void kmem_page_flush_local_region(addr_v virtual_address, uint32 num_pages);
+void kmem_page_flush_local_all(void);
+
 void kmem_page_flush_one(addr_v virtual_address);
 void kmem_page_flush_region(addr_v virtual_address, uint32 num_pages);
 void kmem_page_flush_all(void);
@@ -23,6 +23,9 @@ typedef struct mempool_small
     uint32 num_total;
     uint32 num_free;
 
+    // Set by kmem_pool_small_never_compact for pools whose objects may be read after they are freed
+    bool no_compact;
+
     mempool_small_part* parts_empty;
     mempool_small_part* parts_partial;
     mempool_small_part* parts_full;
@@ -35,6 +38,13 @@ extern void* kmem_pool_small_alloc(mempool_small* pool, frame_alloc_flags frame_
 extern void kmem_pool_small_free(mempool_small* pool, void* obj);
 extern void kmem_pool_small_compact(mempool_small* pool);
 
+/**
+ * Keeps the given pool's memory from ever being freed, even by kmem_pools_compact,
+ * so that a freed object stays mapped and can still be read by lock-free code
+ * that found it before it was freed.
+ */
+extern void kmem_pool_small_never_compact(mempool_small* pool);
+
 extern void kmem_pool_generic_init(void);
 extern void* kmem_pool_generic_alloc(size_t size, frame_alloc_flags flags) __warn_unused_result;
 extern void kmem_pool_generic_free(void* obj);
@@ -0,0 +1,41 @@
+#ifndef MEMORY_STACK_H
+#define MEMORY_STACK_H
+
+#include <typedef.h>
+
+#define KMEM_STACK_SIZE 0x4000
+
+// The number of free stacks that each processor keeps around for reuse
+#define KMEM_STACK_CACHE_SIZE 8
+
+/*
+ * Kernel stacks are mapped with an unmapped guard page directly below them, so
+ * that overflowing a stack faults instead of silently corrupting whatever is
+ * mapped below it. Each processor keeps a small cache of free stacks that are
+ * still mapped, so that threads can be created and destroyed without touching
+ * the page tables. Stacks that don't fit into the cache are unmapped later by
+ * a work item, since unmapping them has to flush the TLBs of other processors.
+ */
+
+/**
+ * Sets up the list of stacks waiting to be unmapped. Must be called before the
+ * first stack is allocated.
+ */
+extern void kmem_stack_init(void) __hidden;
+
+/**
+ * Allocates a kernel stack of KMEM_STACK_SIZE bytes, returning its lowest
+ * address, or NULL if there is not enough memory.
+ */
+extern void* kmem_stack_alloc(void) __warn_unused_result;
+
+/**
+ * Frees a kernel stack that was allocated by kmem_stack_alloc. The stack is
+ * only handed out again by the current processor, so a thread may free its
+ * own stack as long as it doesn't enable interrupts before switching away.
+ * Never blocks or flushes other processors' TLBs, so this may be called while
+ * holding a spinlock.
+ */
+extern void kmem_stack_free(void* stack_low);
+
+#endif
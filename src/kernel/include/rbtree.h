@@ -0,0 +1,53 @@
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <typedef.h>
+
+/*
+ * An intrusive red-black tree. Nodes are embedded in the structures that are
+ * stored in the tree, and rbtree_entry gets the containing structure back from
+ * a node. The tree does no locking of its own and never allocates memory.
+ *
+ * The leftmost node is cached, so getting the smallest node takes constant
+ * time. Nodes that compare equal are kept in the order they were inserted.
+ */
+typedef struct rbtree_node
+{
+    struct rbtree_node* parent;
+    struct rbtree_node* left;
+    struct rbtree_node* right;
+    bool red;
+} rbtree_node;
+
+typedef struct
+{
+    rbtree_node* root;
+    rbtree_node* leftmost;
+} rbtree;
+
+/**
+ * Compares two nodes, returning true if the first should come before the
+ * second.
+ */
+typedef bool (*rbtree_less)(const rbtree_node* a, const rbtree_node* b);
+
+#define rbtree_entry(node, type, member) ((type*)((uint8*)(node) - offsetof(type, member)))
+
+extern void rbtree_init(rbtree* tree);
+
+extern void rbtree_insert(rbtree* tree, rbtree_node* node, rbtree_less less);
+extern void rbtree_remove(rbtree* tree, rbtree_node* node);
+
+extern rbtree_node* rbtree_next(const rbtree_node* node) __pure;
+
+static inline rbtree_node* rbtree_first(const rbtree* tree)
+{
+    return tree->leftmost;
+}
+
+static inline bool rbtree_empty(const rbtree* tree)
+{
+    return tree->root == NULL;
+}
+
+#endif
@@ -25,6 +25,7 @@
 #define __pure __attribute__((pure))
 #define __const __attribute__((const))
 #define __warn_unused_result __attribute__((warn_unused_result))
+#define __percpu __attribute__((section(".percpu")))
 
 #define alloca(size) __builtin_alloca(size)
 
@@ -0,0 +1,280 @@
+#include <io/hpet.h>
+#include <core/clock.h>
+#include <core/smp.h>
+#include <cpu/apic.h>
+#include <cpu/idt.h>
+#include <memory/virt.h>
+#include <lock/spinlock.h>
+#include <acpica/acpi.h>
+
+#include <core/klog.h>
+
+#define HPET_REG_CAPABILITIES 0x000
+#define HPET_REG_PERIOD 0x004
+#define HPET_REG_CONFIG 0x010
+#define HPET_REG_COUNTER_LOW 0x0F0
+#define HPET_REG_COUNTER_HIGH 0x0F4
+#define HPET_REG_TIMER_CONFIG(n) (0x100 + 0x20 * (n))
+#define HPET_REG_TIMER_COMPARATOR(n) (0x108 + 0x20 * (n))
+#define HPET_REG_TIMER_FSB_VALUE(n) (0x110 + 0x20 * (n))
+#define HPET_REG_TIMER_FSB_ADDRESS(n) (0x114 + 0x20 * (n))
+
+#define HPET_CAP_NUM_TIMERS(cap) ((((cap) >> 8) & 0x1F) + 1)
+#define HPET_CAP_COUNTER_64BIT (1 << 13)
+
+#define HPET_CONFIG_ENABLE (1 << 0)
+#define HPET_CONFIG_LEGACY_ROUTE (1 << 1)
+
+#define HPET_TIMER_LEVEL_TRIGGERED (1 << 1)
+#define HPET_TIMER_INT_ENABLE (1 << 2)
+#define HPET_TIMER_PERIODIC (1 << 3)
+#define HPET_TIMER_32BIT_MODE (1 << 8)
+#define HPET_TIMER_FSB_ENABLE (1 << 14)
+#define HPET_TIMER_FSB_CAPABLE (1 << 15)
+
+// The HPET specification does not allow the main counter to tick more slowly than this
+#define HPET_MAX_PERIOD_FS 100000000u
+#define FEMTOSECONDS_PER_SECOND 1000000000000000ull
+
+// Comparator interrupts are written straight to the local APIC of the bootstrap processor
+#define APIC_MSI_ADDRESS(apic_id) (0xFEE00000u | ((uint32)(apic_id) << 12))
+
+// The comparator must be set at least this many counts ahead of the main counter, or the counter may
+// already have passed it by the time it has been written. Events are cut short after the maximum
+// delay, which keeps the counts well within the 32 bits that the comparators are used with.
+#define HPET_MIN_DELTA 32
+#define HPET_MAX_DELAY_NS NANOSECONDS_PER_SECOND
+
+struct hpet_event
+{
+    uint32 timer;
+    uint32 config;
+    bool claimed;
+
+    timer_function function;
+    void* arg;
+};
+
+uint64 hpet_frequency;
+
+static volatile uint32* hpet_regs;
+
+static hpet_event hpet_events[HPET_MAX_EVENTS];
+static uint32 hpet_num_events;
+static spinlock hpet_events_lock;
+
+static uint64 hpet_clock_read(void);
+
+static clocksource hpet_clocksource = {
+    .name = "hpet",
+    .rating = CLOCK_RATING_HPET,
+    .read = hpet_clock_read
+};
+
+static inline uint32 hpet_read(uint32 reg)
+{
+    return hpet_regs[reg / sizeof(uint32)];
+}
+
+static inline void hpet_write(uint32 reg, uint32 val)
+{
+    hpet_regs[reg / sizeof(uint32)] = val;
+}
+
+static uint64 hpet_clock_read(void)
+{
+    uint32 hi, lo;
+
+    // The two halves of the main counter can only be read separately, so the low half must not have
+    // wrapped around in between
+    do
+    {
+        hi = hpet_read(HPET_REG_COUNTER_HIGH);
+        lo = hpet_read(HPET_REG_COUNTER_LOW);
+    } while (hi != hpet_read(HPET_REG_COUNTER_HIGH));
+
+    return ((uint64)hi << 32) | lo;
+}
+
+static void hpet_event_handle(regs32_t* r)
+{
+    hpet_event* e = &hpet_events[r->int_no - HPET_VECTOR_BASE];
+
+    apic_eoi();
+
+    // Comparators only compare the low 32 bits of the counter, so the event would fire again when it
+    // wraps around if it were left enabled
+    hpet_write(HPET_REG_TIMER_CONFIG(e->timer), e->config);
+
+    e->function(e->arg);
+}
+
+static bool hpet_map(addr_p base)
+{
+    void* regs;
+
+    if ((regs = kmem_virt_alloc(1)) == NULL)
+        return false;
+
+    if (!kmem_page_global_map((addr_v)regs, PT_ENTRY_WRITEABLE | PT_ENTRY_NO_EXECUTE | PT_ENTRY_CACHE_DISABLE | PT_ENTRY_GLOBAL, true, base & ~(addr_p)FRAME_OFFSET_MASK))
+    {
+        kmem_virt_free(regs, 1);
+        return false;
+    }
+
+    hpet_regs = (volatile uint32*)((addr_v)regs + (addr_v)(base & FRAME_OFFSET_MASK));
+    return true;
+}
+
+static void hpet_init_events(uint32 num_timers)
+{
+    uint8 apic_id = smp_cpus[0].apic_id;
+    uint32 i;
+
+    spinlock_init(&hpet_events_lock);
+
+    // Only comparators that support FSB delivery can be used, since there is no I/O APIC driver to
+    // route their interrupt lines
+    for (i = 0; i < num_timers && hpet_num_events < HPET_MAX_EVENTS; i++)
+    {
+        hpet_event* e;
+        uint8 vector;
+
+        if ((hpet_read(HPET_REG_TIMER_CONFIG(i)) & HPET_TIMER_FSB_CAPABLE) == 0)
+            continue;
+
+        e = &hpet_events[hpet_num_events];
+        vector = (uint8)(HPET_VECTOR_BASE + hpet_num_events);
+
+        e->timer = i;
+        e->config = HPET_TIMER_32BIT_MODE | HPET_TIMER_FSB_ENABLE;
+        e->claimed = false;
+
+        hpet_write(HPET_REG_TIMER_FSB_VALUE(i), vector);
+        hpet_write(HPET_REG_TIMER_FSB_ADDRESS(i), APIC_MSI_ADDRESS(apic_id));
+        hpet_write(HPET_REG_TIMER_CONFIG(i), e->config);
+
+        idt_set_ext_handler_flags(vector - IDT_EXT_START, 0x8E);
+        idt_register_ext_handler(vector - IDT_EXT_START, hpet_event_handle);
+
+        hpet_num_events++;
+    }
+}
+
+void hpet_init(void)
+{
+    ACPI_TABLE_HPET* table;
+    uint32 capabilities;
+    uint32 period;
+    uint32 num_timers;
+    uint32 i;
+
+    if (AcpiGetTable((char*)ACPI_SIG_HPET, 1, (ACPI_TABLE_HEADER**)&table) != AE_OK)
+    {
+        klog(KLOG_LEVEL_INFO, "No HPET found\n");
+        return;
+    }
+
+    if (table->Address.SpaceId != ACPI_ADR_SPACE_SYSTEM_MEMORY || !hpet_map(table->Address.Address))
+    {
+        klog(KLOG_LEVEL_WARN, "Failed to map the HPET\n");
+        return;
+    }
+
+    capabilities = hpet_read(HPET_REG_CAPABILITIES);
+    period = hpet_read(HPET_REG_PERIOD);
+
+    if (period == 0 || period > HPET_MAX_PERIOD_FS)
+    {
+        klog(KLOG_LEVEL_WARN, "HPET reports an invalid period of %u fs\n", period);
+        return;
+    }
+
+    hpet_frequency = FEMTOSECONDS_PER_SECOND / period;
+    num_timers = HPET_CAP_NUM_TIMERS(capabilities);
+
+    // Firmware may have left comparators running, and the legacy replacement route would take the
+    // PIT's interrupt away
+    for (i = 0; i < num_timers; i++)
+        hpet_write(HPET_REG_TIMER_CONFIG(i), 0);
+
+    hpet_write(HPET_REG_CONFIG, (hpet_read(HPET_REG_CONFIG) & ~(uint32)HPET_CONFIG_LEGACY_ROUTE) | HPET_CONFIG_ENABLE);
+
+    klog(KLOG_LEVEL_INFO, "HPET at 0x%08x enabled (%ld Hz, %d comparators)\n", (uint32)table->Address.Address, hpet_frequency, num_timers);
+
+    if (apic_enabled)
+        hpet_init_events(num_timers);
+
+    // A 32-bit main counter wraps around within minutes, which is too soon for a clocksource
+    if ((capabilities & HPET_CAP_COUNTER_64BIT) != 0)
+    {
+        hpet_clocksource.frequency = hpet_frequency;
+        clock_register(&hpet_clocksource);
+    }
+}
+
+hpet_event* hpet_event_alloc(timer_function function, void* arg)
+{
+    hpet_event* e = NULL;
+    uint32 i;
+
+    if (hpet_num_events == 0)
+        return NULL;
+
+    spinlock_acquire(&hpet_events_lock);
+
+    for (i = 0; i < hpet_num_events; i++)
+    {
+        if (!hpet_events[i].claimed)
+        {
+            e = &hpet_events[i];
+            e->claimed = true;
+            e->function = function;
+            e->arg = arg;
+            break;
+        }
+    }
+
+    spinlock_release(&hpet_events_lock);
+
+    return e;
+}
+
+void hpet_event_arm(hpet_event* e, uint64 delay_ns)
+{
+    uint32 delta;
+    uint32 target;
+    uint32 eflags;
+
+    if (delay_ns > HPET_MAX_DELAY_NS)
+        delay_ns = HPET_MAX_DELAY_NS;
+
+    if ((delta = (uint32)(delay_ns * hpet_frequency / NANOSECONDS_PER_SECOND)) < HPET_MIN_DELTA)
+        delta = HPET_MIN_DELTA;
+
+    eflags = eflags_save();
+    asm volatile ("cli");
+
+    // If the counter passed the comparator before the interrupt was enabled, the event would be lost,
+    // so try again further ahead. This may make the event fire twice, which callers must tolerate
+    // anyway since events can fire early.
+    for (;;)
+    {
+        target = hpet_read(HPET_REG_COUNTER_LOW) + delta;
+
+        hpet_write(HPET_REG_TIMER_COMPARATOR(e->timer), target);
+        hpet_write(HPET_REG_TIMER_CONFIG(e->timer), e->config | HPET_TIMER_INT_ENABLE);
+
+        if ((int32)(target - hpet_read(HPET_REG_COUNTER_LOW)) > 0)
+            break;
+
+        delta *= 2;
+    }
+
+    eflags_load(eflags);
+}
+
+void hpet_event_cancel(hpet_event* e)
+{
+    hpet_write(HPET_REG_TIMER_CONFIG(e->timer), e->config);
+}
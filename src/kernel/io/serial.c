@@ -33,8 +33,6 @@ static void serial_standard_sink(regs32* r, serial_port* p, char c)
         if (p->recv_buf_head >= p->recv_buf_maxlen)
             p->recv_buf_head -= p->recv_buf_maxlen;
     }
-
-    cond_var_s_broadcast(&p->recv_buf_ready);
 }
 
 static void serial_send_buffer(serial_port* p, bool wait)
@@ -58,7 +56,22 @@ static void serial_send_buffer(serial_port* p, bool wait)
             break;
         }
     }
-    cond_var_s_broadcast(&p->send_buf_ready);
+}
+
+// Waiting threads are woken up from a tasklet rather than from the interrupt handler, so that a
+// burst of characters only wakes them up once
+static void serial_recv_wake(void* arg)
+{
+    serial_port* port = arg;
+
+    cond_var_s_broadcast(&port->recv_buf_ready);
+}
+
+static void serial_send_wake(void* arg)
+{
+    serial_port* port = arg;
+
+    cond_var_s_broadcast(&port->send_buf_ready);
 }
 
 static void serial_port_handle_interrupt(regs32* r, serial_port* port)
@@ -74,12 +87,14 @@ static void serial_port_handle_interrupt(regs32* r, serial_port* port)
             port->recv_sink(r, port, (char) inb(port->io_port));
 
         spinlock_release(&port->lock);
+        tasklet_schedule(&port->recv_tasklet);
     }
     else if (int_type == 0x1)
     {
         spinlock_acquire(&port->lock);
         serial_send_buffer(port, false);
         spinlock_release(&port->lock);
+        tasklet_schedule(&port->send_tasklet);
     }
 }
 
@@ -184,6 +199,7 @@ static void serial_port_init_interrupts(serial_port* port)
         port->recv_buf_head = 0;
         port->recv_buf_tail = 0;
         cond_var_s_init(&port->recv_buf_ready, &port->lock);
+        tasklet_init(&port->recv_tasklet, serial_recv_wake, port);
 
         port->send_buf = kmem_pool_generic_alloc(SEND_BUF_SIZE, 0);
         if (port->send_buf == NULL)
@@ -194,6 +210,7 @@ static void serial_port_init_interrupts(serial_port* port)
         port->send_buf_head = 0;
         port->send_buf_tail = 0;
         cond_var_s_init(&port->send_buf_ready, &port->lock);
+        tasklet_init(&port->send_tasklet, serial_send_wake, port);
 
         serial_port_enable_interrupts(port->io_port);
     }
@@ -254,7 +271,10 @@ int serial_send_spin(serial_port* port, const char* c, size_t s)
     if (port->io_port == 0) return E_IO_ERROR;
 
     if (port->send_buf != NULL && port->send_buf_len != 0)
+    {
         serial_send_buffer(port, true);
+        cond_var_s_broadcast(&port->send_buf_ready);
+    }
 
     while (s != 0)
     {
@@ -0,0 +1,271 @@
+#include <rbtree.h>
+
+static inline bool is_red(const rbtree_node* node)
+{
+    return node != NULL && node->red;
+}
+
+static void replace_child(rbtree* tree, rbtree_node* parent, rbtree_node* old, rbtree_node* new)
+{
+    if (parent == NULL)
+        tree->root = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+
+    if (new != NULL)
+        new->parent = parent;
+}
+
+static void rotate_left(rbtree* tree, rbtree_node* node)
+{
+    rbtree_node* pivot = node->right;
+
+    node->right = pivot->left;
+    if (pivot->left != NULL)
+        pivot->left->parent = node;
+
+    replace_child(tree, node->parent, node, pivot);
+
+    pivot->left = node;
+    node->parent = pivot;
+}
+
+static void rotate_right(rbtree* tree, rbtree_node* node)
+{
+    rbtree_node* pivot = node->left;
+
+    node->left = pivot->right;
+    if (pivot->right != NULL)
+        pivot->right->parent = node;
+
+    replace_child(tree, node->parent, node, pivot);
+
+    pivot->right = node;
+    node->parent = pivot;
+}
+
+void rbtree_init(rbtree* tree)
+{
+    tree->root = NULL;
+    tree->leftmost = NULL;
+}
+
+void rbtree_insert(rbtree* tree, rbtree_node* node, rbtree_less less)
+{
+    rbtree_node* parent = NULL;
+    rbtree_node** link = &tree->root;
+    bool leftmost = true;
+
+    while (*link != NULL)
+    {
+        parent = *link;
+
+        if (less(node, parent))
+        {
+            link = &parent->left;
+        }
+        else
+        {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->red = true;
+    *link = node;
+
+    if (leftmost)
+        tree->leftmost = node;
+
+    while (is_red(node->parent))
+    {
+        rbtree_node* grandparent = node->parent->parent;
+        rbtree_node* uncle = (node->parent == grandparent->left) ? grandparent->right : grandparent->left;
+
+        if (is_red(uncle))
+        {
+            node->parent->red = false;
+            uncle->red = false;
+            grandparent->red = true;
+            node = grandparent;
+        }
+        else if (node->parent == grandparent->left)
+        {
+            if (node == node->parent->right)
+            {
+                node = node->parent;
+                rotate_left(tree, node);
+            }
+
+            node->parent->red = false;
+            grandparent->red = true;
+            rotate_right(tree, grandparent);
+        }
+        else
+        {
+            if (node == node->parent->left)
+            {
+                node = node->parent;
+                rotate_right(tree, node);
+            }
+
+            node->parent->red = false;
+            grandparent->red = true;
+            rotate_left(tree, grandparent);
+        }
+    }
+
+    tree->root->red = false;
+}
+
+void rbtree_remove(rbtree* tree, rbtree_node* node)
+{
+    rbtree_node* child;
+    rbtree_node* parent;
+    bool removed_red;
+
+    if (tree->leftmost == node)
+        tree->leftmost = rbtree_next(node);
+
+    if (node->left == NULL || node->right == NULL)
+    {
+        child = (node->left != NULL) ? node->left : node->right;
+        parent = node->parent;
+        removed_red = node->red;
+
+        replace_child(tree, parent, node, child);
+    }
+    else
+    {
+        // The node has two children, so its successor (which has no left child) takes its place
+        rbtree_node* successor = node->right;
+
+        while (successor->left != NULL)
+            successor = successor->left;
+
+        child = successor->right;
+        removed_red = successor->red;
+
+        if (successor->parent == node)
+        {
+            parent = successor;
+        }
+        else
+        {
+            parent = successor->parent;
+            replace_child(tree, parent, successor, child);
+
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+
+        replace_child(tree, node->parent, node, successor);
+
+        successor->left = node->left;
+        node->left->parent = successor;
+        successor->red = node->red;
+    }
+
+    if (removed_red)
+        return;
+
+    // A black node was removed, so the path through child is now one black node short
+    while (child != tree->root && !is_red(child))
+    {
+        rbtree_node* sibling;
+
+        if (child == parent->left)
+        {
+            sibling = parent->right;
+
+            if (is_red(sibling))
+            {
+                sibling->red = false;
+                parent->red = true;
+                rotate_left(tree, parent);
+                sibling = parent->right;
+            }
+
+            if (!is_red(sibling->left) && !is_red(sibling->right))
+            {
+                sibling->red = true;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+
+            if (!is_red(sibling->right))
+            {
+                sibling->left->red = false;
+                sibling->red = true;
+                rotate_right(tree, sibling);
+                sibling = parent->right;
+            }
+
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rotate_left(tree, parent);
+        }
+        else
+        {
+            sibling = parent->left;
+
+            if (is_red(sibling))
+            {
+                sibling->red = false;
+                parent->red = true;
+                rotate_right(tree, parent);
+                sibling = parent->left;
+            }
+
+            if (!is_red(sibling->left) && !is_red(sibling->right))
+            {
+                sibling->red = true;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+
+            if (!is_red(sibling->left))
+            {
+                sibling->right->red = false;
+                sibling->red = true;
+                rotate_left(tree, sibling);
+                sibling = parent->left;
+            }
+
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rotate_right(tree, parent);
+        }
+
+        child = tree->root;
+    }
+
+    if (child != NULL)
+        child->red = false;
+}
+
+rbtree_node* rbtree_next(const rbtree_node* node)
+{
+    if (node->right != NULL)
+    {
+        node = node->right;
+
+        while (node->left != NULL)
+            node = node->left;
+
+        return (rbtree_node*)node;
+    }
+
+    while (node->parent != NULL && node == node->parent->right)
+        node = node->parent;
+
+    return node->parent;
+}
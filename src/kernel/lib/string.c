@@ -5,6 +5,10 @@
 #include <setjmp.h>
 #include <memory/page.h>
 #include <lock/spinlock.h>
+#include <cpu/fpu.h>
+
+#define MEMCPY_SSE_BLOCK 64
+#define MEMCPY_SSE_THRESHOLD 1024
 
 static const char* itoa_values = "0123456789ABCDEF";
 static const char* errcode_names[] = {
@@ -314,7 +318,7 @@ void* memmove(void* dest, const void* src, size_t size)
     return dest;
 }
 
-void* memcpy(void* dest, const void* src, size_t size)
+static void* memcpy_bytes(void* dest, const void* src, size_t size)
 {
     uint8* dest8 = dest;
     const uint8* src8 = src;
@@ -327,6 +331,48 @@ void* memcpy(void* dest, const void* src, size_t size)
     return dest;
 }
 
+// Copies 64 bytes at a time through the SSE registers. The FPU state of the current thread has to be
+// saved before doing this, which is only worth it for large copies.
+static void memcpy_sse(uint8* dest, const uint8* src, size_t blocks)
+{
+    kernel_fpu_begin();
+
+    while (blocks--)
+    {
+        asm volatile (
+            "movups (%0), %%xmm0\n"
+            "movups 16(%0), %%xmm1\n"
+            "movups 32(%0), %%xmm2\n"
+            "movups 48(%0), %%xmm3\n"
+            "movups %%xmm0, (%1)\n"
+            "movups %%xmm1, 16(%1)\n"
+            "movups %%xmm2, 32(%1)\n"
+            "movups %%xmm3, 48(%1)\n"
+            : : "r" (src), "r" (dest) : "memory"
+        );
+
+        src += MEMCPY_SSE_BLOCK;
+        dest += MEMCPY_SSE_BLOCK;
+    }
+
+    kernel_fpu_end();
+}
+
+void* memcpy(void* dest, const void* src, size_t size)
+{
+    if (size >= MEMCPY_SSE_THRESHOLD && fpu_sse_enabled)
+    {
+        size_t blocks = size / MEMCPY_SSE_BLOCK;
+
+        memcpy_sse(dest, src, blocks);
+        memcpy_bytes((uint8*)dest + blocks * MEMCPY_SSE_BLOCK, (const uint8*)src + blocks * MEMCPY_SSE_BLOCK, size % MEMCPY_SSE_BLOCK);
+
+        return dest;
+    }
+
+    return memcpy_bytes(dest, src, size);
+}
+
 void* memset(void* ptr, int val, size_t size)
 {
     uint8* ptr8 = ptr;
@@ -365,8 +411,9 @@ void* memcpy_safe(void* dest, const void* src, size_t size)
 
     if (!setjmp(env))
     {
+        // A fault in the middle of an SSE copy would leave the FPU claimed by the kernel
         kmem_page_set_temp_fault_handler(env, NULL, NULL);
-        result = memcpy(dest, src, size);
+        result = memcpy_bytes(dest, src, size);
         kmem_page_clear_temp_fault_handler();
     }
     else
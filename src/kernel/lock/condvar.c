@@ -10,8 +10,14 @@ void cond_var_init(cond_var* v, mutex* m)
 }
 
 void cond_var_wait(cond_var* v)
+{
+    cond_var_wait_timeout(v, SCHED_NO_TIMEOUT);
+}
+
+bool cond_var_wait_timeout(cond_var* v, uint64 timeout_ns)
 {
     sched_thread* t = sched_thread_current();
+    bool signalled;
 
     uint32 eflags = eflags_save();
     asm volatile ("cli");
@@ -27,10 +33,14 @@ void cond_var_wait(cond_var* v)
     spinlock_release(&v->wait_queue.lock);
     if (v->lock != NULL) mutex_release(v->lock);
 
-    sched_yield();
-    if (v->lock != NULL) mutex_acquire(v->lock);
+    signalled = sched_yield_timeout(&v->wait_queue, timeout_ns);
+
+    // A thread that was signalled was moved onto the lock's wait queue, and only woken up once the
+    // lock was handed to it
+    if (v->lock != NULL && v->lock->owner != t) mutex_acquire(v->lock);
 
     eflags_load(eflags);
+    return signalled;
 }
 
 void cond_var_signal(cond_var* v)
@@ -40,6 +50,13 @@ void cond_var_signal(cond_var* v)
     if (v->lock != NULL && v->lock->owner != sched_thread_current())
         crash("Attempt to signal a conditional variable with an unowned lock!");
 
+    // Waking the thread up now would only have it block again on the lock that is still held here
+    if (v->lock != NULL)
+    {
+        mutex_requeue_waiters(v->lock, &v->wait_queue, false);
+        return;
+    }
+
     spinlock_acquire(&v->wait_queue.lock);
 
     if ((t = sched_thread_dequeue(&v->wait_queue)) != NULL)
@@ -52,18 +69,19 @@ void cond_var_signal(cond_var* v)
 
 void cond_var_broadcast(cond_var* v)
 {
-    sched_thread* t;
-
     if (v->lock != NULL && v->lock->owner != sched_thread_current())
         crash("Attempt to signal a conditional variable with an unowned lock!");
 
-    spinlock_acquire(&v->wait_queue.lock);
-
-    while ((t = sched_thread_dequeue(&v->wait_queue)) != NULL)
+    // The threads are handed the lock one at a time as it is released, rather than all waking up to
+    // fight over it
+    if (v->lock != NULL)
     {
-        sched_thread_wake(t);
+        mutex_requeue_waiters(v->lock, &v->wait_queue, true);
+        return;
     }
 
+    spinlock_acquire(&v->wait_queue.lock);
+    sched_thread_wake_all(&v->wait_queue);
     spinlock_release(&v->wait_queue.lock);
 }
 
@@ -108,14 +126,7 @@ void cond_var_s_signal(cond_var_s* v)
 
 void cond_var_s_broadcast(cond_var_s* v)
 {
-    sched_thread* t;
-
     spinlock_acquire(&v->wait_queue.lock);
-
-    while ((t = sched_thread_dequeue(&v->wait_queue)) != NULL)
-    {
-        sched_thread_wake(t);
-    }
-
+    sched_thread_wake_all(&v->wait_queue);
     spinlock_release(&v->wait_queue.lock);
 }
@@ -3,6 +3,16 @@
 
 #include <core/crash.h>
 
+// How many mutexes deep a priority is passed on through owners that are themselves waiting for a
+// mutex. This also stops threads that are deadlocked on each other from boosting each other forever.
+#define MUTEX_PI_MAX_DEPTH 16
+
+// Protects the owners of contended mutexes, what threads are blocked on and the priorities that they
+// have inherited, so that a chain of owners can be followed without any of them going away. It is
+// always acquired before any mutex's wait queue lock. Releasing a mutex that nobody is waiting for
+// doesn't change any priorities, so it doesn't need this lock.
+static spinlock mutex_pi_lock;
+
 void mutex_init(mutex* m)
 {
     m->taken = 0;
@@ -18,9 +28,109 @@ static bool mutex_acquire_fast(mutex* m)
     return __atomic_compare_exchange_n(&m->taken, &expected, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 }
 
+// Gets the most important priority of the threads waiting for the given mutex. Must be called with its
+// wait queue lock held.
+static uint32 mutex_top_waiter_priority(mutex* m)
+{
+    uint32 priority = SCHED_PRIO_NONE;
+
+    for (sched_thread* t = m->wait_queue.first; t != NULL; t = t->next_in_queue)
+    {
+        if (t->priority < priority)
+            priority = t->priority;
+    }
+
+    return priority;
+}
+
+// Passes the given priority on to the owner of the given mutex and, if that owner is itself waiting
+// for a mutex, on to that mutex's owner and so on. Must be called with mutex_pi_lock held.
+static void mutex_boost_chain(mutex* m, uint32 priority)
+{
+    for (uint32 depth = 0; m != NULL && depth < MUTEX_PI_MAX_DEPTH; depth++)
+    {
+        sched_thread* owner = m->owner;
+
+        if (owner == NULL || owner->priority <= priority)
+            break;
+
+        sched_thread_set_inherited_priority(owner, priority);
+        m = owner->blocked_on;
+    }
+}
+
+// Works out the priority that the given thread should inherit from the waiters of the mutexes that it
+// still holds. Must be called with mutex_pi_lock held.
+static void mutex_update_inherited_priority(sched_thread* t)
+{
+    uint32 priority = SCHED_PRIO_NONE;
+
+    for (mutex* hm = t->held_mutexes; hm != NULL; hm = hm->owner_next)
+    {
+        uint32 p;
+
+        spinlock_acquire(&hm->wait_queue.lock);
+        p = mutex_top_waiter_priority(hm);
+        spinlock_release(&hm->wait_queue.lock);
+
+        if (p < priority)
+            priority = p;
+    }
+
+    sched_thread_set_inherited_priority(t, priority);
+}
+
+// Works out the priority of the owner of the given mutex again after one of its waiters has stopped
+// waiting and, if that owner is itself waiting for a mutex, the priority of that mutex's owner and so
+// on. Must be called with mutex_pi_lock held.
+static void mutex_unboost_chain(mutex* m)
+{
+    for (uint32 depth = 0; m != NULL && depth < MUTEX_PI_MAX_DEPTH; depth++)
+    {
+        sched_thread* owner = m->owner;
+        uint32 priority;
+
+        if (owner == NULL)
+            break;
+
+        priority = owner->priority;
+        mutex_update_inherited_priority(owner);
+
+        // Nothing further up the chain can have inherited more than this owner had
+        if (owner->priority == priority)
+            break;
+
+        m = owner->blocked_on;
+    }
+}
+
+static void mutex_set_owner(mutex* m, sched_thread* t)
+{
+    m->owner = t;
+    m->owner_next = t->held_mutexes;
+    t->held_mutexes = m;
+
+    // A thread that started waiting before the owner was set couldn't pass its priority on, so that
+    // has to be done here instead
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (m->wait_queue.first != NULL)
+    {
+        spinlock_acquire(&mutex_pi_lock);
+        mutex_update_inherited_priority(t);
+        spinlock_release(&mutex_pi_lock);
+    }
+}
+
 void mutex_acquire(mutex* m)
+{
+    mutex_acquire_timeout(m, SCHED_NO_TIMEOUT);
+}
+
+bool mutex_acquire_timeout(mutex* m, uint64 timeout_ns)
 {
     sched_thread* t = sched_thread_current();
+    bool acquired = true;
     uint32 eflags = eflags_save();
     asm volatile ("cli");
 
@@ -29,32 +139,55 @@ void mutex_acquire(mutex* m)
 
     if (!mutex_acquire_fast(m))
     {
+        spinlock_acquire(&mutex_pi_lock);
         spinlock_acquire(&m->wait_queue.lock);
 
-        if (!mutex_acquire_fast(m))
+        if (timeout_ns == 0)
+        {
+            spinlock_release(&m->wait_queue.lock);
+            spinlock_release(&mutex_pi_lock);
+            acquired = false;
+        }
+        else if (!mutex_acquire_fast(m))
         {
             t->status = STS_BLOCKING;
             sched_thread_enqueue(&m->wait_queue, t);
+            t->blocked_on = m;
+
+            // The owner must not be looked at until the thread is visibly waiting, or mutex_set_owner
+            // might not notice it
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            mutex_boost_chain(m, t->priority);
+
             spinlock_release(&m->wait_queue.lock);
-            sched_yield();
+            spinlock_release(&mutex_pi_lock);
+
+            // If the thread didn't time out, mutex_release has already made it the owner. If it did,
+            // it has already been taken off the wait queue, so any priority that the owners inherited
+            // from it has to be worked out again.
+            if (!(acquired = sched_yield_timeout(&m->wait_queue, timeout_ns)))
+            {
+                spinlock_acquire(&mutex_pi_lock);
+                t->blocked_on = NULL;
+                mutex_unboost_chain(m);
+                spinlock_release(&mutex_pi_lock);
+            }
         }
         else
         {
             spinlock_release(&m->wait_queue.lock);
+            spinlock_release(&mutex_pi_lock);
 
-            m->owner = t;
-            m->owner_next = t->held_mutexes;
-            t->held_mutexes = m;
+            mutex_set_owner(m, t);
         }
     }
     else
     {
-        m->owner = t;
-        m->owner_next = t->held_mutexes;
-        t->held_mutexes = m;
+        mutex_set_owner(m, t);
     }
 
     eflags_load(eflags);
+    return acquired;
 }
 
 bool mutex_try_acquire(mutex* m)
@@ -68,11 +201,7 @@ bool mutex_try_acquire(mutex* m)
         crash("Kernel mutex recursive locking detected!");
 
     if ((result = mutex_acquire_fast(m)))
-    {
-        m->owner = t;
-        m->owner_next = t->held_mutexes;
-        t->held_mutexes = m;
-    }
+        mutex_set_owner(m, t);
 
     eflags_load(eflags);
     return result;
@@ -98,7 +227,9 @@ static void mutex_remove_from_held(sched_thread* t, mutex* m)
     crash("Thread held_mutexes linked list corrupted");
 }
 
-void mutex_release(mutex* m)
+// Gives the mutex to the next thread waiting for it, if any, and returns that thread. The caller is
+// responsible for waking it up.
+static sched_thread* mutex_pass_on(mutex* m)
 {
     sched_thread* t = sched_thread_current();
     sched_thread* nt;
@@ -108,14 +239,43 @@ void mutex_release(mutex* m)
 
     mutex_remove_from_held(t, m);
 
+    // If nobody is waiting and the thread hasn't inherited anything, there are no priorities to pass
+    // on or give up. A thread that starts waiting in the meantime has to take the wait queue lock
+    // first, and will then see that the mutex is no longer taken.
+    if (t->inherited_priority == SCHED_PRIO_NONE)
+    {
+        spinlock_acquire(&m->wait_queue.lock);
+
+        if (m->wait_queue.first == NULL)
+        {
+            m->owner = NULL;
+            m->owner_next = NULL;
+            m->taken = 0;
+
+            asm volatile ("mfence" : : : "memory");
+            spinlock_release(&m->wait_queue.lock);
+
+            return NULL;
+        }
+
+        spinlock_release(&m->wait_queue.lock);
+    }
+
+    spinlock_acquire(&mutex_pi_lock);
     spinlock_acquire(&m->wait_queue.lock);
+
     if ((nt = sched_thread_dequeue(&m->wait_queue)) != NULL)
     {
+        uint32 top;
+
         m->owner = nt;
         m->owner_next = nt->held_mutexes;
         nt->held_mutexes = m;
+        nt->blocked_on = NULL;
 
-        sched_thread_wake(nt);
+        // The new owner takes over the priority of the threads that are still waiting
+        if ((top = mutex_top_waiter_priority(m)) < nt->inherited_priority)
+            sched_thread_set_inherited_priority(nt, top);
     }
     else
     {
@@ -126,4 +286,64 @@ void mutex_release(mutex* m)
 
     asm volatile ("mfence" : : : "memory");
     spinlock_release(&m->wait_queue.lock);
+
+    // Whatever was inherited through this mutex no longer applies
+    if (t->inherited_priority != SCHED_PRIO_NONE)
+        mutex_update_inherited_priority(t);
+
+    spinlock_release(&mutex_pi_lock);
+
+    return nt;
+}
+
+void mutex_release(mutex* m)
+{
+    sched_thread* nt;
+
+    // The new owner has been dequeued, so a timeout can no longer wake it up behind our back
+    if ((nt = mutex_pass_on(m)) != NULL)
+        sched_thread_wake(nt);
+}
+
+void mutex_release_handoff(mutex* m)
+{
+    sched_thread* nt;
+
+    if ((nt = mutex_pass_on(m)) != NULL)
+        sched_thread_wake_yield(nt);
+}
+
+bool mutex_requeue_waiters(mutex* m, sched_thread_queue* queue, bool all)
+{
+    uint32 top = SCHED_PRIO_NONE;
+    sched_thread* t;
+
+    if (m->owner != sched_thread_current())
+        crash("Kernel mutex waiters requeued by non-owner!");
+
+    spinlock_acquire(&mutex_pi_lock);
+    spinlock_acquire(&queue->lock);
+    spinlock_acquire(&m->wait_queue.lock);
+
+    while ((t = sched_thread_dequeue(queue)) != NULL)
+    {
+        sched_thread_enqueue(&m->wait_queue, t);
+        t->blocked_on = m;
+
+        if (t->priority < top)
+            top = t->priority;
+
+        if (!all)
+            break;
+    }
+
+    // The threads now wait for the mutex, so the current thread has to run with their priority
+    if (top != SCHED_PRIO_NONE)
+        mutex_boost_chain(m, top);
+
+    spinlock_release(&m->wait_queue.lock);
+    spinlock_release(&queue->lock);
+    spinlock_release(&mutex_pi_lock);
+
+    return top != SCHED_PRIO_NONE;
 }
@@ -9,21 +9,40 @@ void semaphore_init(semaphore* s, int value)
 }
 
 void semaphore_wait(semaphore* s)
+{
+    semaphore_wait_timeout(s, SCHED_NO_TIMEOUT);
+}
+
+bool semaphore_wait_timeout(semaphore* s, uint64 timeout_ns)
 {
     sched_thread* t = sched_thread_current();
+    bool acquired = true;
     uint32 eflags = eflags_save();
     asm volatile ("cli");
 
     spinlock_acquire(&s->lock);
 
-    if (s->value-- <= 0)
+    if (s->value <= 0 && timeout_ns == 0)
+    {
+        spinlock_release(&s->lock);
+        acquired = false;
+    }
+    else if (s->value-- <= 0)
     {
         spinlock_acquire(&s->wait_queue.lock);
         t->status = STS_BLOCKING;
         sched_thread_enqueue(&s->wait_queue, t);
         spinlock_release(&s->wait_queue.lock);
         spinlock_release(&s->lock);
-        sched_yield();
+
+        // A thread that timed out has already been taken out of the wait queue, but its unit must
+        // still be given back. semaphore_signal may find the wait queue empty in the meantime.
+        if (!(acquired = sched_yield_timeout(&s->wait_queue, timeout_ns)))
+        {
+            spinlock_acquire(&s->lock);
+            s->value++;
+            spinlock_release(&s->lock);
+        }
     }
     else
     {
@@ -31,6 +50,7 @@ void semaphore_wait(semaphore* s)
     }
 
     eflags_load(eflags);
+    return acquired;
 }
 
 bool semaphore_try_wait(semaphore* s)
@@ -60,8 +80,8 @@ void semaphore_signal(semaphore* s)
     {
         spinlock_acquire(&s->wait_queue.lock);
 
-        t = sched_thread_dequeue(&s->wait_queue);
-        sched_thread_wake(t);
+        if ((t = sched_thread_dequeue(&s->wait_queue)) != NULL)
+            sched_thread_wake(t);
 
         spinlock_release(&s->wait_queue.lock);
     }
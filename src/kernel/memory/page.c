@@ -1,10 +1,13 @@
 #include <cpu/cpuid.h>
 #include <cpu/msr.h>
 #include <cpu/idt.h>
+#include <core/smp.h>
+#include <core/percpu.h>
 #include <memory/early.h>
 #include <memory/phys.h>
 #include <memory/page.h>
 #include <memory/virt.h>
+#include <core/time_page.h>
 #include <assert.h>
 
 #define ALLOW_PAGE_H_DIRECT
@@ -31,14 +34,14 @@ typedef struct
 } page_fault_temp_handler;
 
 page_context kernel_page_context;
-page_context* active_page_context;
+page_context* active_page_context __percpu;
 
 addr_v kmem_page_resv_end;
 
 bool kmem_page_pae_enabled = false;
 bool kmem_page_pge_enabled = false;
 
-static page_fault_temp_handler _page_fault_temp_handler;
+static page_fault_temp_handler _page_fault_temp_handler __percpu;
 static bool _preinit_done;
 
 static void _init_map_range(addr_v start, addr_v end, uint64 flags)
@@ -78,22 +81,23 @@ static void _init_map_kmalloc_early(uint64 flags)
 
 static void _page_fault_handler(regs32* r)
 {
+    page_fault_temp_handler* temp_handler = percpu_ptr(_page_fault_temp_handler);
     addr_v fault_address;
     asm volatile ("movl %%cr2, %0" : "=r" (fault_address));
 
-    if (_page_fault_temp_handler.env != NULL)
+    if (temp_handler->env != NULL)
     {
-        longjmp_interrupt(*_page_fault_temp_handler.env, 1, r);
+        longjmp_interrupt(*temp_handler->env, 1, r);
 
-        if (_page_fault_temp_handler.fault_address != NULL)
-            *_page_fault_temp_handler.fault_address = fault_address;
+        if (temp_handler->fault_address != NULL)
+            *temp_handler->fault_address = fault_address;
 
-        if (_page_fault_temp_handler.fault_reason != NULL)
-            *_page_fault_temp_handler.fault_reason = r->err_code;
+        if (temp_handler->fault_reason != NULL)
+            *temp_handler->fault_reason = r->err_code;
 
         // Deregister the handler immediately, as we don't want it to execute again if there's an
         // issue in the handler.
-        _page_fault_temp_handler.env = NULL;
+        temp_handler->env = NULL;
 
         return;
     }
@@ -148,6 +152,7 @@ void kmem_page_init(const boot_param* param)
     _init_map_range((addr_v)&_ld_text_begin, (addr_v)&_ld_text_end, PT_ENTRY_GLOBAL);
     _init_map_range((addr_v)&_ld_rodata_begin, (addr_v)&_ld_rodata_end, PT_ENTRY_NO_EXECUTE | PT_ENTRY_GLOBAL);
     _init_map_range((addr_v)&_ld_data_begin, (addr_v)&_ld_data_end, PT_ENTRY_NO_EXECUTE | PT_ENTRY_WRITEABLE | PT_ENTRY_GLOBAL);
+    _init_map_range((addr_v)_ld_percpu_begin, (addr_v)_ld_percpu_end, PT_ENTRY_NO_EXECUTE | PT_ENTRY_GLOBAL);
     _init_map_range((addr_v)&_ld_bss_begin, (addr_v)&_ld_bss_end, PT_ENTRY_NO_EXECUTE | PT_ENTRY_WRITEABLE | PT_ENTRY_GLOBAL);
     _init_map_kmalloc_early(PT_ENTRY_NO_EXECUTE | PT_ENTRY_WRITEABLE | PT_ENTRY_GLOBAL);
 
@@ -173,6 +178,13 @@ bool kmem_page_context_create(page_context* c)
         crash("Legacy paging not implemented!");
     }
 
+    // User code reads the clock from the time page instead of making a system call
+    if (!time_page_map(c))
+    {
+        kmem_page_pae_context_destroy(c);
+        return false;
+    }
+
     // Insert the new paging context into the list of active paging contexts
     spinlock_acquire(&kernel_page_context.lock);
     c->next = kernel_page_context.next;
@@ -181,7 +193,7 @@ bool kmem_page_context_create(page_context* c)
     kernel_page_context.next = c;
     spinlock_release(&kernel_page_context.lock);
 
-    return false;
+    return true;
 }
 
 void kmem_page_context_destroy(page_context* c)
@@ -202,7 +214,7 @@ void kmem_page_context_destroy(page_context* c)
 
 void kmem_page_context_switch(page_context* c)
 {
-    active_page_context = c;
+    percpu_write(active_page_context, c);
     asm volatile ("mov %0, %%cr3" : : "r" (c->physical_address));
 }
 
@@ -234,7 +246,7 @@ void* kmem_page_global_alloc(uint64 page_flags, frame_alloc_flags alloc_flags, u
         if (!kmem_page_global_map(page + (i * FRAME_SIZE), page_flags, false, frames[i]))
         {
             for (j = 0; j < i; j++)
-                kmem_page_global_unmap(page + (i * FRAME_SIZE), false);
+                kmem_page_global_unmap(page + (j * FRAME_SIZE), false);
 
             kmem_frame_free_many(frames, frames_n);
             kmem_virt_free((void*) page, num_pages);
@@ -243,7 +255,8 @@ void* kmem_page_global_alloc(uint64 page_flags, frame_alloc_flags alloc_flags, u
         }
     }
 
-    kmem_page_flush_region(page, num_pages);
+    // The pages were not present before, so no other processor can have them cached in its TLB
+    kmem_page_flush_local_region(page, num_pages);
     return (void*)page;
 }
 
@@ -281,7 +294,7 @@ bool _kmem_page_map(page_context* c, addr_v virtual_address, uint64 flags, bool
     if (kmem_page_pae_enabled) result = kmem_page_pae_set(c, virtual_address, frame, flags | PT_ENTRY_PRESENT);
     else crash("Legacy paging not implemented!");
 
-    if (result && flush) kmem_page_flush_one(virtual_address);
+    if (result && flush) kmem_page_flush_local_one(virtual_address);
     return result;
 }
 
@@ -297,7 +310,7 @@ void _kmem_page_unmap(page_context* c, addr_v virtual_address, bool flush)
         crash("Legacy paging not implemented!");
     }
 
-    if (flush) kmem_page_flush_one(virtual_address);
+    if (flush) kmem_page_flush_local_one(virtual_address);
 }
 
 bool _kmem_page_global_get(addr_v virtual_address, addr_p* physical_address, uint64* flags)
@@ -349,8 +362,12 @@ bool kmem_page_map(page_context* c, addr_v virtual_address, uint64 flags, bool f
 void kmem_page_unmap(page_context* c, addr_v virtual_address, bool flush)
 {
     spinlock_acquire(&c->lock);
-    _kmem_page_unmap(c, virtual_address, flush);
+    _kmem_page_unmap(c, virtual_address, false);
     spinlock_release(&c->lock);
+
+    // Other processors must be asked to flush their TLBs only after the lock is released, since they
+    // may be spinning on it with interrupts disabled.
+    if (flush) kmem_page_flush_one(virtual_address);
 }
 
 bool kmem_page_global_get(addr_v virtual_address, addr_p* physical_address, uint64* flags)
@@ -378,38 +395,42 @@ bool kmem_page_global_map(addr_v virtual_address, uint64 flags, bool flush, addr
 void kmem_page_global_unmap(addr_v virtual_address, bool flush)
 {
     spinlock_acquire(&kernel_page_context.lock);
-    _kmem_page_global_unmap(virtual_address, flush);
+    _kmem_page_global_unmap(virtual_address, false);
     spinlock_release(&kernel_page_context.lock);
+
+    if (flush) kmem_page_flush_one(virtual_address);
 }
 
 void kmem_page_set_temp_fault_handler(jmp_buf env, volatile addr_v* fault_address, volatile uint32* fault_reason)
 {
-    assert(_page_fault_temp_handler.env == NULL);
+    page_fault_temp_handler* temp_handler = percpu_ptr(_page_fault_temp_handler);
+
+    assert(temp_handler->env == NULL);
 
     // Don't question this... jmp_buf is an array type, so it works in the end
-    _page_fault_temp_handler.env = (jmp_buf*)env;
+    temp_handler->env = (jmp_buf*)env;
 
-    _page_fault_temp_handler.fault_address = fault_address;
-    _page_fault_temp_handler.fault_reason = fault_reason;
+    temp_handler->fault_address = fault_address;
+    temp_handler->fault_reason = fault_reason;
 }
 
 void kmem_page_clear_temp_fault_handler(void)
 {
-    assert(_page_fault_temp_handler.env != NULL);
-    _page_fault_temp_handler.env = NULL;
+    assert(percpu_read(_page_fault_temp_handler.env) != NULL);
+    percpu_write(_page_fault_temp_handler.env, NULL);
 }
 
-void kmem_page_flush_one(addr_v virtual_address)
+void kmem_page_flush_local_one(addr_v virtual_address)
 {
     // If the CPU supports PGE, we can flush a single TLB entry using the INVLPG
     // instruction. Otherwise, we must flush the entire TLB.
     if (kmem_page_pge_enabled)
         asm volatile ("invlpg (%0)" : : "r" (virtual_address));
     else
-        kmem_page_flush_all();
+        kmem_page_flush_local_all();
 }
 
-void kmem_page_flush_region(addr_v virtual_address, uint32 num_pages)
+void kmem_page_flush_local_region(addr_v virtual_address, uint32 num_pages)
 {
     if (kmem_page_pge_enabled)
     {
@@ -423,11 +444,11 @@ void kmem_page_flush_region(addr_v virtual_address, uint32 num_pages)
     }
     else
     {
-        kmem_page_flush_all();
+        kmem_page_flush_local_all();
     }
 }
 
-void kmem_page_flush_all(void)
+void kmem_page_flush_local_all(void)
 {
     uint32 cr;
 
@@ -447,6 +468,24 @@ void kmem_page_flush_all(void)
     }
 }
 
+void kmem_page_flush_one(addr_v virtual_address)
+{
+    kmem_page_flush_local_one(virtual_address);
+    smp_tlb_shootdown(virtual_address, 1);
+}
+
+void kmem_page_flush_region(addr_v virtual_address, uint32 num_pages)
+{
+    kmem_page_flush_local_region(virtual_address, num_pages);
+    smp_tlb_shootdown(virtual_address, num_pages);
+}
+
+void kmem_page_flush_all(void)
+{
+    kmem_page_flush_local_all();
+    smp_tlb_shootdown(0, 0);
+}
+
 bool kmem_enable_write_protect(void)
 {
     uint32 cr0;
@@ -24,6 +24,8 @@
 #define PT_SHIFT FRAME_SHIFT
 #define PT_MASK (-(1u << PT_SHIFT) & ~PDPT_MASK & ~PD_MASK)
 
+#define PAGE_TABLE_VIRT_PAGES ((sizeof(struct page_table_pae*) * (PD_SIZE * PDPT_SIZE)) / FRAME_SIZE)
+
 typedef struct page_dir_pae
 {
     uint64 page_table_phys[PD_SIZE];
@@ -93,6 +95,16 @@ static page_table_pae* _alloc_page_table(page_dir_ptr_tab* pdpt, addr_v address)
         return NULL;
     }
 
+    if (!kmem_page_global_map((addr_v)pt, PT_ENTRY_WRITEABLE | PT_ENTRY_NO_EXECUTE, true, frame))
+    {
+        kmem_virt_free(pt, 1);
+        kmem_frame_free(frame);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < PT_SIZE; i++)
+        pt->page_phys[i] = 0;
+
     pdpt->page_dir_virt[pdpte]->page_table_phys[pde] = frame | PD_ENTRY_PRESENT | PD_ENTRY_WRITEABLE | PD_ENTRY_USER;
 
     return pdpt->page_table_virt[pdet] = pt;
@@ -114,7 +126,7 @@ static page_table_pae* _alloc_page_table_global(page_dir_ptr_tab* pdpt, addr_v a
             return NULL;
 
         kmem_page_pae_set(&kernel_page_context, global_tables + (pde * FRAME_SIZE), frame, PT_ENTRY_NO_EXECUTE | PT_ENTRY_WRITEABLE | PT_ENTRY_GLOBAL | PT_ENTRY_PRESENT);
-        kmem_page_flush_one(global_tables + (pde * FRAME_SIZE));
+        kmem_page_flush_local_one(global_tables + (pde * FRAME_SIZE));
 
         pdpt->page_dir_virt[pdpte]->page_table_phys[pde] = frame | PD_ENTRY_PRESENT | PD_ENTRY_WRITEABLE;
         if (kmem_page_pge_enabled)
@@ -229,13 +241,16 @@ bool kmem_page_pae_context_create(page_context* c, bool kernel_table)
 
             if (c->pae_pdpt->page_dir_virt[i] == NULL)
             {
-                for (j = i; j > 0; j--)
+                for (j = 0; j < i; j++)
                     kmem_page_global_free(c->pae_pdpt->page_dir_virt[j], 1);
 
                 kmem_pool_small_free(&pdpt_pool, c->pae_pdpt);
                 return false;
             }
 
+            for (j = 0; j < PD_SIZE; j++)
+                c->pae_pdpt->page_dir_virt[i]->page_table_phys[j] = 0;
+
             _get_entry(kernel_page_context.pae_pdpt, (addr_v) c->pae_pdpt->page_dir_virt[i], &c->pae_pdpt->page_dir_phys[i], NULL);
             c->pae_pdpt->page_dir_phys[i] |= PDPT_ENTRY_PRESENT;
         }
@@ -246,9 +261,9 @@ bool kmem_page_pae_context_create(page_context* c, bool kernel_table)
         c->pae_pdpt->page_dir_virt[3] = NULL;
         c->pae_pdpt->page_dir_phys[3] = kernel_page_context.pae_pdpt->page_dir_phys[3];
 
-        if ((c->pae_pdpt->page_table_virt = kmem_page_global_alloc(PT_ENTRY_WRITEABLE | PT_ENTRY_NO_EXECUTE, 0, (sizeof(page_table_pae*) * (PD_SIZE * PDPT_SIZE)))) == NULL)
+        if ((c->pae_pdpt->page_table_virt = kmem_page_global_alloc(PT_ENTRY_WRITEABLE | PT_ENTRY_NO_EXECUTE, 0, PAGE_TABLE_VIRT_PAGES)) == NULL)
         {
-            for (j = PDPT_SIZE - 1; j > 0; j--)
+            for (j = 0; j < PDPT_SIZE - 1; j++)
                 kmem_page_global_free(c->pae_pdpt->page_dir_virt[j], 1);
 
             kmem_pool_small_free(&pdpt_pool, c->pae_pdpt);
@@ -279,7 +294,7 @@ void kmem_page_pae_context_destroy(page_context* c)
     }
 
     // Free the space that stores virtual page table addresses
-    kmem_page_global_free(c->pae_pdpt->page_table_virt, (sizeof(page_table_pae*) * (PD_SIZE * PDPT_SIZE)));
+    kmem_page_global_free(c->pae_pdpt->page_table_virt, PAGE_TABLE_VIRT_PAGES);
     c->pae_pdpt->page_table_virt = NULL;
 
     // Free all the page directories and set their entries to a reserved value
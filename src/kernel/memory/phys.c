@@ -2,6 +2,7 @@
 #include <memory/page.h>
 #include <memory/early.h>
 #include <lock/spinlock.h>
+#include <core/percpu.h>
 
 #include <core/klog.h>
 #include <core/crash.h>
@@ -45,9 +46,37 @@ static volatile free_frame_stack free_stack __attribute__((aligned(FRAME_SIZE)))
 static uint32 emerg_stack_top;
 static addr_p emerg_stack[EMERG_STACK_SIZE];
 
+static uint32 stack_remap_generation;
+static uint32 stack_remap_seen __percpu;
+
 uint32 kmem_total_frames;
 uint32 kmem_free_frames;
 
+static void _lock_free_stacks(void)
+{
+    spinlock_acquire(&free_stack_lock);
+
+    // The free frame stacks are remapped in place while the lock is held. Since they are never
+    // accessed without holding the lock, stale TLB entries on this processor can be flushed lazily
+    // here rather than interrupting every other processor whenever a stack is remapped.
+    if (percpu_read(stack_remap_seen) != stack_remap_generation)
+    {
+        kmem_page_flush_local_one((addr_v)&low_stack);
+        kmem_page_flush_local_one((addr_v)&free_stack);
+        kmem_page_flush_local_one((addr_v)&high_stack);
+
+        percpu_write(stack_remap_seen, stack_remap_generation);
+    }
+}
+
+static void _remap_free_frame_stack(volatile free_frame_stack* stack, addr_p frame)
+{
+    if (!_kmem_page_global_map((addr_v)stack, PT_ENTRY_WRITEABLE | PT_ENTRY_NO_EXECUTE, true, frame))
+        crash("Free frame stack broken!");
+
+    percpu_write(stack_remap_seen, ++stack_remap_generation);
+}
+
 static void _push_free_frame_stack(uint32* stack_top, volatile free_frame_stack* stack, addr_p frame)
 {
     if (*stack_top != FRAMES_PER_STACK_FRAME)
@@ -60,8 +89,7 @@ static void _push_free_frame_stack(uint32* stack_top, volatile free_frame_stack*
         if (!_kmem_page_global_get((addr_v)stack, &old_stack, NULL))
             crash("Free frame stack broken");
 
-        if (!_kmem_page_global_map((addr_v)stack, PT_ENTRY_WRITEABLE | PT_ENTRY_NO_EXECUTE, true, frame))
-            crash("Free frame stack broken!");
+        _remap_free_frame_stack(stack, frame);
 
         *stack_top = 0;
         stack->next_stack_frame = old_stack;
@@ -114,8 +142,7 @@ static addr_p _pop_free_frame(uint32* stack_top, volatile free_frame_stack* stac
 
         *stack_top = FRAMES_PER_STACK_FRAME;
 
-        if (!_kmem_page_global_map((addr_v)stack, PT_ENTRY_WRITEABLE | PT_ENTRY_NO_EXECUTE, true, stack->next_stack_frame))
-            crash("Free frame stack broken!");
+        _remap_free_frame_stack(stack, stack->next_stack_frame);
 
         kmem_free_frames--;
 
@@ -177,7 +204,7 @@ static addr_p _alloc_frame(frame_alloc_flags flags)
         {
             spinlock_release(&free_stack_lock);
             // TODO Wait for a frame to be freed
-            spinlock_acquire(&free_stack_lock);
+            _lock_free_stacks();
 
             continue;
         }
@@ -353,7 +380,7 @@ addr_p kmem_frame_alloc(frame_alloc_flags flags)
 
     assert(init_done);
 
-    spinlock_acquire(&free_stack_lock);
+    _lock_free_stacks();
     frame = _alloc_frame(flags);
     spinlock_release(&free_stack_lock);
 
@@ -364,7 +391,7 @@ void kmem_frame_free(addr_p frame)
 {
     assert(init_done);
 
-    spinlock_acquire(&free_stack_lock);
+    _lock_free_stacks();
     _push_free_frame(frame);
     spinlock_release(&free_stack_lock);
 }
@@ -376,7 +403,7 @@ size_t kmem_frame_alloc_many(addr_p* frames, size_t num_frames, frame_alloc_flag
 
     assert(init_done);
 
-    spinlock_acquire(&free_stack_lock);
+    _lock_free_stacks();
 
     for (i = 0; i < num_frames; i++)
     {
@@ -400,7 +427,7 @@ void kmem_frame_free_many(const addr_p* frames, size_t num_frames)
 {
     assert(init_done);
 
-    spinlock_acquire(&free_stack_lock);
+    _lock_free_stacks();
     while (num_frames-- != 0)
     {
         _push_free_frame(*frames++);
@@ -143,6 +143,9 @@ static void _small_pool_part_alloc(mempool_small* pool, frame_alloc_flags flags)
     s->next = NULL;
 }
 
+// Takes an empty part out of the pool. Must be called with the pool's lock held, and the part must be
+// given back to the page allocator with kmem_page_global_free once the lock has been released, since
+// that flushes the TLBs of other processors.
 static void _small_pool_part_free(mempool_small* pool, mempool_small_part* part, mempool_small_part* prev_part)
 {
     if (part->num_free != (pool->frames_per_part * FRAME_SIZE - sizeof(mempool_small_part) - pool->part_first_offset) / pool->obj_size)
@@ -161,8 +164,6 @@ static void _small_pool_part_free(mempool_small* pool, mempool_small_part* part,
 
     pool->num_total -= part->num_free;
     pool->num_free -= part->num_free;
-
-    kmem_page_global_free(part, pool->frames_per_part);
 }
 
 static bool _small_pool_part_is_allocated(mempool_small_part* part, void* obj)
@@ -194,6 +195,7 @@ void kmem_pool_small_init(mempool_small* pool, const char* name, uint32 obj_size
     pool->frame_flags = frame_flags;
 
     pool->num_total = pool->num_free = 0;
+    pool->no_compact = false;
 
     pool->parts_empty = pool->parts_partial = pool->parts_full = NULL;
 
@@ -310,12 +312,29 @@ void kmem_pool_small_free(mempool_small* pool, void* obj)
 
 void kmem_pool_small_compact(mempool_small* pool)
 {
+    mempool_small_part* freed = NULL;
+    mempool_small_part* part;
+
+    if (pool->no_compact)
+        return;
+
     spinlock_acquire(&pool->lock);
 
-    while (pool->parts_empty != NULL)
-        _small_pool_part_free(pool, pool->parts_empty, NULL);
+    while ((part = pool->parts_empty) != NULL)
+    {
+        _small_pool_part_free(pool, part, NULL);
+
+        part->next_part = freed;
+        freed = part;
+    }
 
     spinlock_release(&pool->lock);
+
+    while ((part = freed) != NULL)
+    {
+        freed = part->next_part;
+        kmem_page_global_free(part, pool->frames_per_part);
+    }
 }
 
 void kmem_pool_generic_init(void)
@@ -417,14 +436,21 @@ void kmem_pool_generic_compact(void)
     kmem_pool_small_compact(&pool_gen_256);
 }
 
+void kmem_pool_small_never_compact(mempool_small* pool)
+{
+    pool->no_compact = true;
+}
+
 void kmem_pools_compact(void)
 {
     mempool_small* pool;
 
+    // Pools are never taken off of the list and new ones are added at the front, so the list can be
+    // walked without holding its lock, which compacting a pool can't be done under
     spinlock_acquire(&small_pool_list_lock);
+    pool = small_pool_list;
+    spinlock_release(&small_pool_list_lock);
 
-    for (pool = small_pool_list; pool != NULL; pool = pool->next)
+    for (; pool != NULL; pool = pool->next)
         kmem_pool_small_compact(pool);
-
-    spinlock_release(&small_pool_list_lock);
 }
@@ -0,0 +1,171 @@
+#include <memory/stack.h>
+#include <memory/page.h>
+#include <memory/phys.h>
+#include <memory/virt.h>
+#include <core/percpu.h>
+#include <core/crash.h>
+#include <core/workqueue.h>
+#include <lock/spinlock.h>
+
+#define STACK_PAGES (KMEM_STACK_SIZE / FRAME_SIZE)
+
+typedef struct
+{
+    uint32 count;
+    void* stacks[KMEM_STACK_CACHE_SIZE];
+} kmem_stack_cache;
+
+static kmem_stack_cache stack_cache __percpu;
+
+// Stacks that didn't fit into a processor's cache. Unmapping them has to flush every processor's TLB,
+// which can't be done wherever stacks are freed, so they are linked together through their lowest
+// word and unmapped later by stack_trim_work.
+static spinlock stack_overflow_lock;
+static void* stack_overflow;
+static work stack_trim_work;
+
+static void* stack_map(void)
+{
+    addr_p frames[STACK_PAGES];
+    addr_v region;
+    size_t frames_n;
+    size_t i, j;
+
+    frames_n = kmem_frame_alloc_many(frames, STACK_PAGES, 0);
+
+    if (frames_n < STACK_PAGES)
+    {
+        kmem_frame_free_many(frames, frames_n);
+        return NULL;
+    }
+
+    if ((region = (addr_v)kmem_virt_alloc(STACK_PAGES + 1)) == 0)
+    {
+        kmem_frame_free_many(frames, frames_n);
+        return NULL;
+    }
+
+    // The lowest page of the region is the guard page, and is never mapped
+    for (i = 0; i < STACK_PAGES; i++)
+    {
+        if (!kmem_page_global_map(region + (i + 1) * FRAME_SIZE, PT_ENTRY_WRITEABLE | PT_ENTRY_NO_EXECUTE, false, frames[i]))
+        {
+            for (j = 0; j < i; j++)
+                kmem_page_global_unmap(region + (j + 1) * FRAME_SIZE, false);
+
+            kmem_frame_free_many(frames, frames_n);
+            kmem_virt_free((void*)region, STACK_PAGES + 1);
+
+            return NULL;
+        }
+    }
+
+    // The pages were not present before, so no other processor can have them cached in its TLB
+    kmem_page_flush_local_region(region + FRAME_SIZE, STACK_PAGES);
+    return (void*)(region + FRAME_SIZE);
+}
+
+static void stack_unmap(void* stack_low)
+{
+    addr_p frames[STACK_PAGES];
+    size_t i;
+
+    for (i = 0; i < STACK_PAGES; i++)
+    {
+        if (!kmem_page_global_get((addr_v)stack_low + i * FRAME_SIZE, &frames[i], NULL))
+            crash("Attempt to free a stack that wasn't allocated!");
+        kmem_page_global_unmap((addr_v)stack_low + i * FRAME_SIZE, false);
+    }
+
+    kmem_page_flush_region((addr_v)stack_low, STACK_PAGES);
+    kmem_virt_free((uint8*)stack_low - FRAME_SIZE, STACK_PAGES + 1);
+
+    kmem_frame_free_many(frames, STACK_PAGES);
+}
+
+static void stack_trim(void* arg)
+{
+    void* stack_low;
+
+    for (;;)
+    {
+        spinlock_acquire(&stack_overflow_lock);
+
+        if ((stack_low = stack_overflow) != NULL)
+            stack_overflow = *(void**)stack_low;
+
+        spinlock_release(&stack_overflow_lock);
+
+        if (stack_low == NULL)
+            break;
+
+        stack_unmap(stack_low);
+    }
+}
+
+void kmem_stack_init(void)
+{
+    spinlock_init(&stack_overflow_lock);
+    work_init(&stack_trim_work, stack_trim, NULL);
+}
+
+void* kmem_stack_alloc(void)
+{
+    kmem_stack_cache* cache;
+    void* stack = NULL;
+    uint32 eflags;
+
+    eflags = eflags_save();
+    asm volatile ("cli");
+
+    cache = percpu_ptr(stack_cache);
+
+    if (cache->count != 0)
+        stack = cache->stacks[--cache->count];
+
+    eflags_load(eflags);
+
+    // A stack that is waiting to be unmapped can just as well be used again
+    if (stack == NULL && __atomic_load_n(&stack_overflow, __ATOMIC_RELAXED) != NULL)
+    {
+        spinlock_acquire(&stack_overflow_lock);
+
+        if ((stack = stack_overflow) != NULL)
+            stack_overflow = *(void**)stack;
+
+        spinlock_release(&stack_overflow_lock);
+    }
+
+    return (stack != NULL) ? stack : stack_map();
+}
+
+void kmem_stack_free(void* stack_low)
+{
+    kmem_stack_cache* cache;
+    void* evicted = NULL;
+    uint32 eflags;
+
+    eflags = eflags_save();
+    asm volatile ("cli");
+
+    cache = percpu_ptr(stack_cache);
+
+    // When the cache is full, another cached stack is evicted rather than this one, since this one may
+    // still be in use by the thread that is freeing it
+    if (cache->count == KMEM_STACK_CACHE_SIZE)
+        evicted = cache->stacks[--cache->count];
+
+    cache->stacks[cache->count++] = stack_low;
+
+    eflags_load(eflags);
+
+    if (evicted != NULL)
+    {
+        spinlock_acquire(&stack_overflow_lock);
+        *(void**)evicted = stack_overflow;
+        stack_overflow = evicted;
+        spinlock_release(&stack_overflow_lock);
+
+        work_queue(&system_workqueue, &stack_trim_work);
+    }
+}